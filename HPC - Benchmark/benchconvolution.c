@@ -0,0 +1,371 @@
+// Convolution microbenchmark
+// github : - aditya1453
+//          - widyameiriska
+//
+//  benchconvolution.c
+//
+//
+// Serial Code Created by Josep Lluis Lerida on 11/03/15.
+//
+// This program times the convolution engines in isolation, without the PPM text I/O.
+// Synthetic images (one channel, pixel values 0..255) and kernels (random integer weights,
+// dense or sparse) are generated in memory. Every engine that can handle a kernel is run
+// after some warmup runs for a number of repetitions, and the median and p95 times,
+// MPix/s and the effective GFLOP/s (2*kernelX*kernelY flops per pixel) are reported as CSV
+// or JSON. The engines are the ones of the convolution library, run through a plan on its
+// thread pool. Before it is timed, the output of every engine and tile is checked against the
+// one of the generic engine (convolve2D), and the benchmark stops when they differ.
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include "../HPC - Convolution Library/libconvolve.h"
+
+// Benchmark parameters
+#define BENCH_WARMUP      1
+#define BENCH_REPETITIONS 5
+#define BENCH_MAX_GFLOP   20.0  // skip image/kernel pairs above this dense work per run
+#define MAX_SIZES         16
+
+// Result of one engine on one image and kernel.
+struct structbench{
+    int ancho;
+    int altura;
+    int kernelX;
+    int kernelY;
+    int ntaps;
+    const char *kind;
+    const char *engine;
+    int tileX;
+    int threads;
+    int repetitions;
+    double median;
+    double p95;
+    double min;
+    double mpixels;
+    double gflops;
+};
+
+//Functions Definition
+int *syntheticImage(int ancho, int altura, unsigned int seed);
+kernelData syntheticKernel(int size, int sparse, unsigned int seed);
+int benchEngine(convPlan plan, int* in, int* out, int ancho, int altura, int warmup, int repetitions, struct structbench *res);
+int checkEngine(convPlan plan, int* in, int* out, const int* ref, int ancho, int altura);
+
+///////////////////////////////////////////////////////////////////////////////
+// Synthetic data
+///////////////////////////////////////////////////////////////////////////////
+
+// Small xorshift generator, so every run benchmarks the same data.
+static unsigned int nextRandom(unsigned int *state){
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// One image channel with pixel values 0..255.
+int *syntheticImage(int ancho, int altura, unsigned int seed){
+    long i, size = (long)ancho*altura;
+    int *img;
+
+    if((img = (int *)malloc(size*sizeof(int))) == NULL) return NULL;
+    if(seed == 0) seed = 1;
+    for(i = 0; i < size; i++)
+        img[i] = nextRandom(&seed) % 256;
+    return img;
+}
+
+// Square kernel with integer weights. Dense kernels have every weight in -50..50 like
+// Random25; sparse ones keep about a fifth of the taps, with small weights like Edge and Sharpen.
+kernelData syntheticKernel(int size, int sparse, unsigned int seed){
+    static const float sparseWeights[] = {-1, 1, 2, 5};
+    int i;
+    float *vkern;
+    kernelData kern;
+
+    if((vkern = (float *)malloc(size*size*sizeof(float))) == NULL) return NULL;
+    if(seed == 0) seed = 1;
+    for(i = 0; i < size*size; i++){
+        if(sparse)
+            vkern[i] = (nextRandom(&seed) % 5 == 0) ? sparseWeights[nextRandom(&seed) % 4] : 0;
+        else
+            vkern[i] = (float)((int)(nextRandom(&seed) % 101) - 50);
+    }
+    // the center tap is always used
+    if(sparse) vkern[size*size/2] = 5;
+    kern = newKernel(size, size, vkern);
+    free(vkern);
+    return kern;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Timing
+///////////////////////////////////////////////////////////////////////////////
+
+static double monotonicSeconds(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1000000000.0;
+}
+
+static int compareDoubles(const void *a, const void *b){
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Run the plan once and compare its output with ref, the output of the generic engine.
+// Returns 0 when they are equal, -1 (after printing the first pixel that differs) otherwise.
+int checkEngine(convPlan plan, int* in, int* out, const int* ref, int ancho, int altura){
+    long i, size = (long)ancho*altura;
+    convImage src = convPlanar(in, NULL, NULL, ancho, altura, ancho);
+    convImage dst = convPlanar(out, NULL, NULL, ancho, altura, ancho);
+
+    if(convExecute(plan, &src, &dst)){
+        fprintf(stderr, "Error: engine %s failed\n", engineNames[plan->kern.engine]);
+        return -1;
+    }
+    for(i = 0; i < size && out[i] == ref[i]; i++);
+    if(i < size){
+        fprintf(stderr, "Error: engine %s tile %d differs from %s on %dx%d with %dx%d kernel at pixel (%ld,%ld): %d instead of %d\n",
+                engineNames[plan->kern.engine], plan->kern.tileX, engineNames[ENGINE_GENERIC], ancho, altura,
+                plan->kern.kernelX, plan->kern.kernelY, i % ancho, i / ancho, out[i], ref[i]);
+        return -1;
+    }
+    return 0;
+}
+
+// Run the plan warmup+repetitions times on one channel and fill the statistics of res.
+int benchEngine(convPlan plan, int* in, int* out, int ancho, int altura, int warmup, int repetitions, struct structbench *res){
+    int r, p95;
+    double start, *times;
+    double pixels = (double)ancho*altura;
+    convImage src = convPlanar(in, NULL, NULL, ancho, altura, ancho);
+    convImage dst = convPlanar(out, NULL, NULL, ancho, altura, ancho);
+    kernelData kern = &plan->kern;
+
+    if((times = (double *)malloc(repetitions*sizeof(double))) == NULL) return -1;
+    for(r = 0; r < warmup; r++)
+        if(convExecute(plan, &src, &dst)) return -1;
+    for(r = 0; r < repetitions; r++){
+        start = monotonicSeconds();
+        if(convExecute(plan, &src, &dst)) return -1;
+        times[r] = monotonicSeconds() - start;
+    }
+    qsort(times, repetitions, sizeof(double), compareDoubles);
+
+    p95 = (int)ceil(0.95*repetitions) - 1;
+    res->repetitions = repetitions;
+    res->min = times[0];
+    res->median = (repetitions % 2) ? times[repetitions/2] : (times[repetitions/2-1] + times[repetitions/2]) / 2;
+    res->p95 = times[p95 < 0 ? 0 : p95];
+    res->mpixels = pixels / res->median / 1e6;
+    res->gflops = 2.0 * kern->kernelX * kern->kernelY * pixels / res->median / 1e9;
+    free(times);
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Report
+///////////////////////////////////////////////////////////////////////////////
+
+static void printResult(FILE *fp, struct structbench *res, int json, int first){
+    if(json){
+        fprintf(fp, "%s  {\"width\": %d, \"height\": %d, \"kernel\": \"%dx%d\", \"kind\": \"%s\", \"taps\": %d, "
+                "\"engine\": \"%s\", \"tile\": %d, \"threads\": %d, \"repetitions\": %d, "
+                "\"median_s\": %.9lf, \"p95_s\": %.9lf, \"min_s\": %.9lf, \"mpix_s\": %.3lf, \"gflop_s\": %.3lf}",
+                first ? "" : ",\n", res->ancho, res->altura, res->kernelX, res->kernelY, res->kind, res->ntaps,
+                res->engine, res->tileX, res->threads, res->repetitions,
+                res->median, res->p95, res->min, res->mpixels, res->gflops);
+    }
+    else{
+        fprintf(fp, "%d,%d,%dx%d,%s,%d,%s,%d,%d,%d,%.9lf,%.9lf,%.9lf,%.3lf,%.3lf\n",
+                res->ancho, res->altura, res->kernelX, res->kernelY, res->kind, res->ntaps,
+                res->engine, res->tileX, res->threads, res->repetitions,
+                res->median, res->p95, res->min, res->mpixels, res->gflops);
+    }
+    fflush(fp);
+}
+
+// Parse a comma separated list of integers ("3,5,99") or sizes ("800x600,6000x4000").
+static int parseList(char *arg, int *first, int *second, int max){
+    int n = 0;
+    char *tok = strtok(arg, ",");
+
+    while(tok && n < max){
+        if(second){
+            if(sscanf(tok, "%dx%d", &first[n], &second[n]) != 2) return -1;
+        }
+        else if(sscanf(tok, "%d", &first[n]) != 1) return -1;
+        n++;
+        tok = strtok(NULL, ",");
+    }
+    return n;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// MAIN FUNCTION
+//////////////////////////////////////////////////////////////////////////////////////////////////
+int main(int argc, char **argv)
+{
+    int anchos[MAX_SIZES]  = {800, 1920, 6000, 8000};
+    int alturas[MAX_SIZES] = {600, 1080, 4000, 6000};
+    int ksizes[MAX_SIZES]  = {3, 5, 7, 9, 25, 49, 99};
+    int tiles[MAX_SIZES]   = {0};
+    int nsizes = 4, nkernels = 7, ntiles = 1;
+    int warmup = BENCH_WARMUP, repetitions = BENCH_REPETITIONS, json = 0, first = 1;
+    int threads = convDefaultThreads();
+    int kinds = 3; // bit 0 dense, bit 1 sparse
+    double maxgflop = BENCH_MAX_GFLOP;
+    char *outname = NULL;
+    int i, s, k, sp, e, t, ok = 1;
+    int *in, *out, *ref;
+    FILE *fp = stdout;
+    kernelData kern;
+    convPlan plan;
+    struct structbench res;
+    convImage src, dst;
+
+    for(i = 1; i < argc && ok; i++){
+        if(strcmp(argv[i], "--sizes") == 0 && i+1 < argc)
+            ok = (nsizes = parseList(argv[++i], anchos, alturas, MAX_SIZES)) > 0;
+        else if(strcmp(argv[i], "--kernels") == 0 && i+1 < argc)
+            ok = (nkernels = parseList(argv[++i], ksizes, NULL, MAX_SIZES)) > 0;
+        else if(strcmp(argv[i], "--tiles") == 0 && i+1 < argc)
+            ok = (ntiles = parseList(argv[++i], tiles, NULL, MAX_SIZES)) > 0;
+        else if(strcmp(argv[i], "--kind") == 0 && i+1 < argc){
+            i++;
+            if(strcmp(argv[i], "dense") == 0) kinds = 1;
+            else if(strcmp(argv[i], "sparse") == 0) kinds = 2;
+            else if(strcmp(argv[i], "all") == 0) kinds = 3;
+            else ok = 0;
+        }
+        else if(strcmp(argv[i], "--threads") == 0 && i+1 < argc)
+            ok = (threads = atoi(argv[++i])) > 0;
+        else if(strcmp(argv[i], "--warmup") == 0 && i+1 < argc)
+            ok = (warmup = atoi(argv[++i])) >= 0;
+        else if(strcmp(argv[i], "--repetitions") == 0 && i+1 < argc)
+            ok = (repetitions = atoi(argv[++i])) > 0;
+        else if(strcmp(argv[i], "--max-gflop") == 0 && i+1 < argc)
+            ok = (maxgflop = atof(argv[++i])) > 0;
+        else if(strcmp(argv[i], "--format") == 0 && i+1 < argc){
+            i++;
+            if(strcmp(argv[i], "json") == 0) json = 1;
+            else if(strcmp(argv[i], "csv") == 0) json = 0;
+            else ok = 0;
+        }
+        else if(strcmp(argv[i], "--output") == 0 && i+1 < argc)
+            outname = argv[++i];
+        else ok = 0;
+    }
+    if(!ok){
+        printf("Usage: %s [options]\n", argv[0]);
+        printf("- --sizes WxH,...      : synthetic image sizes (default 800x600,1920x1080,6000x4000,8000x6000)\n");
+        printf("- --kernels N,...      : kernel sizes, NxN (default 3,5,7,9,25,49,99)\n");
+        printf("- --kind dense|sparse|all : kernel weights (default all)\n");
+        printf("- --tiles N,...        : column tiles of the engines, 0 = whole rows (default 0)\n");
+        printf("- --threads N          : threads of the plans (default CONVOLVE_THREADS or the processors)\n");
+        printf("- --warmup N           : untimed runs (default %d)\n", BENCH_WARMUP);
+        printf("- --repetitions N      : timed runs (default %d)\n", BENCH_REPETITIONS);
+        printf("- --max-gflop X        : skip image/kernel pairs above X dense GFLOP per run (default %.0f)\n", BENCH_MAX_GFLOP);
+        printf("- --format csv|json    : report format (default csv)\n");
+        printf("- --output file        : report file (default stdout)\n\n");
+        return -1;
+    }
+    if(outname && (fp = fopen(outname, "w")) == NULL){
+        perror("Error: ");
+        return -1;
+    }
+
+    if(json) fprintf(fp, "[\n");
+    else fprintf(fp, "width,height,kernel,kind,taps,engine,tile,threads,repetitions,median_s,p95_s,min_s,mpix_s,gflop_s\n");
+
+    for(s = 0; s < nsizes; s++){
+        if(anchos[s] <= 0 || alturas[s] <= 0) continue;
+        in  = syntheticImage(anchos[s], alturas[s], 1234);
+        out = (int *)malloc((long)anchos[s]*alturas[s]*sizeof(int));
+        ref = (int *)malloc((long)anchos[s]*alturas[s]*sizeof(int));
+        if(!in || !out || !ref){
+            perror("Error: ");
+            return -1;
+        }
+        for(k = 0; k < nkernels; k++){
+            if(ksizes[k] <= 0) continue;
+            // dense work of one run, the same for every engine
+            if(2.0*ksizes[k]*ksizes[k]*anchos[s]*alturas[s]/1e9 > maxgflop){
+                fprintf(stderr, "skipping %dx%d with %dx%d kernel (above %.1f GFLOP)\n",
+                        anchos[s], alturas[s], ksizes[k], ksizes[k], maxgflop);
+                continue;
+            }
+            for(sp = 0; sp < 2; sp++){
+                if(!(kinds & (1 << sp))) continue;
+                if((kern = syntheticKernel(ksizes[k], sp, 42 + ksizes[k])) == NULL){
+                    perror("Error: ");
+                    return -1;
+                }
+                // output of the generic engine, that every engine is checked against
+                if((plan = convPlanCreate(kern, anchos[s], alturas[s], threads, 1, CONV_PLAN_ESTIMATE)) == NULL){
+                    perror("Error: ");
+                    return -1;
+                }
+                src = convPlanar(in, NULL, NULL, anchos[s], alturas[s], anchos[s]);
+                dst = convPlanar(ref, NULL, NULL, anchos[s], alturas[s], anchos[s]);
+                if(convPlanSetEngine(plan, ENGINE_GENERIC, 0) || convExecute(plan, &src, &dst)){
+                    fprintf(stderr, "Error: engine %s failed\n", engineNames[ENGINE_GENERIC]);
+                    return -1;
+                }
+                convPlanDestroy(plan);
+                for(e = 0; e < ENGINES; e++){
+                    for(t = 0; t < ntiles; t++){
+                        // convolve2D always works on whole rows
+                        if(e == ENGINE_GENERIC && tiles[t] != 0) continue;
+                        if((plan = convPlanCreate(kern, anchos[s], alturas[s], threads, 1, CONV_PLAN_ESTIMATE)) == NULL){
+                            perror("Error: ");
+                            return -1;
+                        }
+                        if(convPlanSetEngine(plan, e, tiles[t])){
+                            convPlanDestroy(plan);
+                            continue;
+                        }
+
+                        if(checkEngine(plan, in, out, ref, anchos[s], alturas[s])) return -1;
+
+                        res.ancho = anchos[s];
+                        res.altura = alturas[s];
+                        res.kernelX = kern->kernelX;
+                        res.kernelY = kern->kernelY;
+                        res.ntaps = kern->ntaps;
+                        res.kind = sp ? "sparse" : "dense";
+                        res.engine = engineNames[e];
+                        res.tileX = tiles[t];
+                        res.threads = plan->threads;
+                        if(benchEngine(plan, in, out, anchos[s], alturas[s], warmup, repetitions, &res)){
+                            perror("Error: ");
+                            return -1;
+                        }
+                        convPlanDestroy(plan);
+                        printResult(fp, &res, json, first);
+                        first = 0;
+                    }
+                }
+                freeKernel(kern);
+            }
+        }
+        free(in);
+        free(out);
+        free(ref);
+    }
+
+    if(json) fprintf(fp, "\n]\n");
+    if(fp != stdout) fclose(fp);
+    return 0;
+}
+
+// gcc -O2 benchconvolution.c "../HPC - Convolution Library/libconvolve.c" -o benchconvolution -lpthread -lm
+// ./benchconvolution --sizes 800x600,6000x4000 --kernels 3,5,25 --format json --output bench.json
@@ -0,0 +1,200 @@
+#!/bin/bash
+# Strong and weak scaling harness
+# github : - aditya1453
+#          - widyameiriska
+#
+#  scaling.sh
+#
+# Builds the OMP, MPI and hybrid programs, generates a synthetic image and
+# kernels, and runs them over a sweep of workers: threads for the OMP build,
+# local MPI ranks for the MPI build, and ranks of --hybrid-threads threads
+# each for the hybrid build (up to --workers threads in all). Every run
+# writes its phase timings (--timings) and the harness keeps the median of
+# the repetitions. The plans are kept in a wisdom file of the work directory,
+# and an untimed run of every configuration tunes it before the repetitions.
+#
+# Strong scaling convolves the same image with more workers; weak scaling
+# grows the image height with the workers, so every worker has the same
+# rows. Speedup and efficiency are relative to the OMP build with 1 thread
+# on the same kernel (and, for weak scaling, on the image of 1 worker):
+#     strong: speedup = T1/Tp, efficiency = speedup/p
+#     weak:   efficiency = T1/Tp, speedup = p*efficiency
+# They are computed for the whole run (elapsed) and for the convolution
+# phase alone (the slowest rank). The table is printed and the rows are
+# written as CSV.
+#
+# ./scaling.sh --workers 8 --kernels 3,9,25 --size 4000x3000 --mode both --csv scaling.csv
+
+set -e
+ROOT="$(cd "$(dirname "$0")/.." && pwd)"
+LIB="$ROOT/HPC - Convolution Library/libconvolve.c"
+
+WORKERS=$(nproc 2>/dev/null || echo 4)
+KERNELS="3,5,25"
+SIZE="2000x1500"
+MODE="strong"
+PROGRAMS="omp,mpi,hybrid"
+HYBRID_THREADS=2
+REPETITIONS=3
+CSV="scaling.csv"
+WORK="scaling"
+MPIRUN="${MPIRUN:-mpirun --oversubscribe}"
+[ "$(id -u)" = 0 ] && MPIRUN="$MPIRUN --allow-run-as-root"
+
+usage(){
+    echo "Usage: $0 [options]"
+    echo "- --workers N         : largest number of threads or ranks (default: the processors, $WORKERS)"
+    echo "- --kernels N,...     : kernel sizes, NxN with integer weights (default $KERNELS)"
+    echo "- --size WxH          : image of 1 worker (default $SIZE)"
+    echo "- --mode strong|weak|both : scaling mode (default $MODE)"
+    echo "- --programs list     : omp,mpi,hybrid or a subset (default $PROGRAMS)"
+    echo "- --hybrid-threads N  : threads of every hybrid rank (default $HYBRID_THREADS)"
+    echo "- --repetitions N     : runs of every configuration, the median is kept (default $REPETITIONS)"
+    echo "- --csv file          : result rows (default $CSV)"
+    echo "- --work dir          : builds, images, kernels and timings (default $WORK)"
+    echo "MPIRUN overrides the launcher (default \"mpirun --oversubscribe\")."
+    exit 1
+}
+
+while [ $# -gt 0 ]; do
+    case "$1" in
+    --workers)        WORKERS="$2"; shift;;
+    --kernels)        KERNELS="$2"; shift;;
+    --size)           SIZE="$2"; shift;;
+    --mode)           MODE="$2"; shift;;
+    --programs)       PROGRAMS="$2"; shift;;
+    --hybrid-threads) HYBRID_THREADS="$2"; shift;;
+    --repetitions)    REPETITIONS="$2"; shift;;
+    --csv)            CSV="$2"; shift;;
+    --work)           WORK="$2"; shift;;
+    *)                usage;;
+    esac
+    shift || usage
+done
+WIDTH=${SIZE%x*}
+HEIGHT=${SIZE#*x}
+case "$MODE" in strong) MODES="strong";; weak) MODES="weak";; both) MODES="strong weak";; *) usage;; esac
+[ "$WORKERS" -ge 1 ] && [ "$HYBRID_THREADS" -ge 1 ] && [ "$REPETITIONS" -ge 1 ] && [ "$WIDTH" -ge 1 ] && [ "$HEIGHT" -ge 1 ] || usage
+mkdir -p "$WORK"
+# the plans of the runs, not the ones of the caller's directory
+export CONVOLUTION_WISDOM="$WORK/convolution.wisdom"
+
+##################################################################################################
+# Builds, with the compile lines of the programs
+##################################################################################################
+echo "Building in $WORK"
+gcc -O2 -fopenmp "$ROOT/HPC - OMP Convolution/omp_convolution.c" "$LIB" -o "$WORK/omp_convolution" -lpthread -lm
+if [[ "$PROGRAMS" == *mpi* || "$PROGRAMS" == *hybrid* ]]; then
+    mpicc -O2 "$ROOT/HPC - MPI Convolution/mpiconvolution.c" "$LIB" -o "$WORK/mpiconvolution" -lpthread -lm
+    mpicc -O2 -fopenmp "$ROOT/HPC - Hybrid Convolution/hybridconvolution.c" "$LIB" -o "$WORK/hybridconvolution" -lpthread -lm
+fi
+
+##################################################################################################
+# Synthetic data: P3 images with pixels 0..255 and square kernels with weights -50..50, from fixed
+# seeds so every run of the harness convolves the same data
+##################################################################################################
+image(){ # width height -> file name
+    local file="$WORK/image_$1x$2.ppm"
+    if [ ! -s "$file" ]; then
+        LC_ALL=C awk -v w="$1" -v h="$2" 'BEGIN{
+            srand(1); printf "P3\n# synthetic\n%d %d\n255\n", w, h
+            for(i = 0; i < h; i++){
+                line = ""
+                for(j = 0; j < 3*w; j++) line = line int(rand()*256) " "
+                print line
+            }
+        }' > "$file"
+    fi
+    echo "$file"
+}
+
+kernel(){ # size -> file name
+    local file="$WORK/kernel_$1.txt"
+    LC_ALL=C awk -v n="$1" 'BEGIN{
+        srand(n); printf "%d, %d", n, n
+        for(i = 0; i < n*n; i++) printf ", %d", int(rand()*101) - 50
+        printf "\n"
+    }' > "$file"
+    echo "$file"
+}
+
+# Value of a field of a timings file: elapsed_s, or the max_s of a phase
+field(){ # file key
+    if [ "$2" = elapsed_s ]; then
+        sed -n 's/^  "elapsed_s": \([0-9.]*\),*$/\1/p' "$1" | head -1
+    else
+        sed -n "s/^    \"$2\": {.*\"max_s\": \([0-9.]*\),.*/\1/p" "$1" | head -1
+    fi
+}
+
+median(){
+    sort -g | awk '{v[NR] = $1} END{print (NR % 2) ? v[(NR+1)/2] : (v[NR/2] + v[NR/2+1]) / 2}'
+}
+
+# Run one configuration REPETITIONS times and print "elapsed convolve communication" medians. The
+# first run (r = -1) is not timed: it plans the configuration, the repetitions read its wisdom.
+run(){ # program ranks threads image kernel
+    local program="$1" ranks="$2" threads="$3" img="$4" kern="$5" r json="$WORK/timings.json"
+    local elapsed="" conv="" comm=""
+    for ((r = -1; r < REPETITIONS; r++)); do
+        rm -f "$json"
+        case "$program" in
+        omp)    OMP_NUM_THREADS=$threads "$WORK/omp_convolution" "$img" "$kern" "$WORK/result.ppm" 1 --timings "$json" > /dev/null;;
+        mpi)    $MPIRUN -n "$ranks" "$WORK/mpiconvolution" "$img" "$kern" "$WORK/result.ppm" 1 --timings "$json" > /dev/null 2>&1;;
+        hybrid) OMP_NUM_THREADS=$threads $MPIRUN -n "$ranks" "$WORK/hybridconvolution" "$img" "$kern" "$WORK/result.ppm" 1 --timings "$json" > /dev/null 2>&1;;
+        esac
+        if [ ! -s "$json" ]; then
+            echo "Error: $program with $ranks ranks and $threads threads failed" >&2
+            return 1
+        fi
+        [ "$r" -lt 0 ] && continue
+        elapsed="$elapsed $(field "$json" elapsed_s)"
+        conv="$conv $(field "$json" convolve)"
+        comm="$comm $(field "$json" communication)"
+    done
+    echo "$(echo $elapsed | tr ' ' '\n' | median) $(echo $conv | tr ' ' '\n' | median) $(echo $comm | tr ' ' '\n' | median)"
+}
+
+##################################################################################################
+# Sweeps
+##################################################################################################
+echo "mode,program,workers,ranks,threads,kernel,width,height,elapsed_s,convolve_s,communication_s,speedup,efficiency,convolve_speedup,convolve_efficiency" > "$CSV"
+printf "%-6s %-7s %7s %5s %7s %7s %11s %11s %8s %6s %9s %6s\n" mode program workers ranks threads kernel elapsed_s convolve_s speedup eff conv_spd c_eff
+
+for mode in $MODES; do
+    for k in ${KERNELS//,/ }; do
+        kern=$(kernel "$k")
+        base=""
+        for program in ${PROGRAMS//,/ }; do
+            for ((p = 1; p <= WORKERS; p++)); do
+                case "$program" in
+                omp)    ranks=1; threads=$p;;
+                mpi)    ranks=$p; threads=1;;
+                hybrid) ranks=$p; threads=$HYBRID_THREADS;;
+                *)      usage;;
+                esac
+                workers=$((ranks*threads))
+                [ "$program" = hybrid ] && [ "$p" -gt 1 ] && [ "$workers" -gt "$WORKERS" ] && break
+                height=$HEIGHT
+                [ "$mode" = weak ] && height=$((HEIGHT*workers))
+                img=$(image "$WIDTH" "$height")
+                read -r elapsed conv comm < <(run "$program" "$ranks" "$threads" "$img" "$kern") || exit 1
+                # the OMP run with 1 thread is the baseline, measured first when it is in the sweep
+                if [ -z "$base" ]; then
+                    if [ "$program" = omp ] && [ "$workers" = 1 ]; then base="$elapsed $conv"
+                    else base="$(run omp 1 1 "$(image "$WIDTH" "$HEIGHT")" "$kern" | cut -d' ' -f1,2)"
+                    fi
+                fi
+                line=$(echo "$base $elapsed $conv $workers $mode" | awk '{
+                    if($6 == "weak"){e = $1/$3; s = $5*e; ce = $2/$4; cs = $5*ce}
+                    else{s = $1/$3; e = s/$5; cs = $2/$4; ce = cs/$5}
+                    printf "%.3f %.3f %.3f %.3f", s, e, cs, ce}')
+                read -r speedup efficiency cspeedup cefficiency <<< "$line"
+                echo "$mode,$program,$workers,$ranks,$threads,${k}x${k},$WIDTH,$height,$elapsed,$conv,$comm,$speedup,$efficiency,$cspeedup,$cefficiency" >> "$CSV"
+                printf "%-6s %-7s %7d %5d %7d %7s %11.6f %11.6f %8.3f %6.3f %9.3f %6.3f\n" "$mode" "$program" "$workers" "$ranks" "$threads" \
+                       "${k}x${k}" "$elapsed" "$conv" "$speedup" "$efficiency" "$cspeedup" "$cefficiency"
+            done
+        done
+    done
+done
+echo "Results in $CSV"
@@ -0,0 +1,637 @@
+// Convolution daemon
+// github : - aditya1453
+//          - widyameiriska
+//
+//  convolutiond.c
+//
+//
+// Serial Code Created by Josep Lluis Lerida on 11/03/15.
+//
+// This program keeps the convolution warm for many small jobs: the kernels are read and
+// analyzed once at startup, the plans of every kernel and image width are kept, and the
+// thread pool of the convolution library stays alive between requests. Every worker carves the
+// images of its requests from its own arena (huge pages), recycled between requests.
+// It listens on a UNIX domain socket. Every connection is put in a bounded queue and served
+// by one of the worker threads; when the queue is full the connection is refused with BUSY.
+// A connection can send any number of requests, one per line:
+//
+//   FILE <kernel> <image.ppm> <result.ppm> [engine=<name>] [tile=<n>] [boundary=<mode>]
+//        convolve a PPM file into another one
+//   PIXELS <kernel> <width> <height> <channels> [engine=<name>] [tile=<n>] [boundary=<mode>]
+//        followed by width*height*channels native ints (interleaved, at most MAX_PIXELS); the reply line is
+//        followed by the convolved pixels in the same layout
+//   STATS
+//        one line of JSON: queue depth, busy workers, requests, latency percentiles
+//
+// Replies are "OK <queue-us> <run-us>", "ERROR <message>" or "BUSY <message>".
+// <kernel> is the name given to the kernel on the command line.
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "../HPC - Convolution Library/libconvolve.h"
+
+// Daemon parameters
+#define DAEMON_WORKERS      4
+#define DAEMON_QUEUE        64
+#define MAX_KERNELS         32
+#define MAX_PLANS           16      // image widths kept per kernel
+#define LATENCY_SAMPLES     1024    // recent requests used for the percentiles
+#define MAX_LINE            1024
+#define MAX_PIXELS          (1L << 26)  // samples of a PIXELS request, its buffers take 8 bytes each
+
+// Plan of a kernel for an image width. The requests running on it hold a reference; a plan
+// evicted from its kernel is destroyed by the last of them.
+struct structcached{
+    convPlan plan;
+    int width;
+    int users;
+    int evicted;
+};
+
+// Kernel loaded at startup, with its plans by image width.
+struct structentry{
+    char name[64];
+    kernelData kern;
+    struct structcached *plans[MAX_PLANS];
+    int nplans;
+};
+
+// Connection waiting for a worker.
+struct structconn{
+    int fd;
+    double queued;          // when it was accepted
+};
+
+// Bounded queue of connections and the counters reported by STATS.
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct structconn conn[DAEMON_QUEUE];
+    int capacity;
+    int head;
+    int depth;
+    int maxDepth;
+    int busy;               // workers serving a connection
+    long requests;
+    long errors;
+    long rejected;
+    double latency[LATENCY_SAMPLES];    // seconds from accept to reply, ring buffer
+    long nlatency;
+} queue;
+
+static struct structentry kernels[MAX_KERNELS];
+static int nkernels = 0;
+static pthread_mutex_t plansLock = PTHREAD_MUTEX_INITIALIZER;
+static int threads = 0;
+static volatile sig_atomic_t stopping = 0;
+
+//Functions Definition
+int loadKernel(char *arg);
+struct structcached *kernelPlan(struct structentry *entry, int width, int height);
+void releasePlan(struct structcached *cached);
+int serveConnection(int fd, double queued, convArena arena);
+int convolveFile(struct structentry *entry, convPlan plan, char *image, char *result);
+void writeStats(int fd);
+
+///////////////////////////////////////////////////////////////////////////////
+// Kernels and plans
+///////////////////////////////////////////////////////////////////////////////
+
+// name=path, or a path whose file name (without extension) is the kernel name.
+int loadKernel(char *arg){
+    struct structentry *entry;
+    char *eq = strchr(arg, '='), *path = eq ? eq + 1 : arg, *base, *dot;
+
+    if(nkernels == MAX_KERNELS) return -1;
+    entry = &kernels[nkernels];
+    if(eq){
+        snprintf(entry->name, sizeof(entry->name), "%.*s", (int)(eq - arg), arg);
+    }
+    else{
+        base = strrchr(path, '/');
+        snprintf(entry->name, sizeof(entry->name), "%s", base ? base + 1 : path);
+        if((dot = strrchr(entry->name, '.')) != NULL) *dot = '\0';
+    }
+    if((entry->kern = leerKernel(path)) == NULL) return -1;
+    nkernels++;
+    return 0;
+}
+
+static struct structentry *findKernel(char *name){
+    int i;
+
+    for(i = 0; i < nkernels; i++)
+        if(strcmp(kernels[i].name, name) == 0) return &kernels[i];
+    return NULL;
+}
+
+static struct structcached *findPlan(struct structentry *entry, int width){
+    int i;
+
+    for(i = 0; i < entry->nplans; i++)
+        if(entry->plans[i]->width == width) return entry->plans[i];
+    return NULL;
+}
+
+// Plan of the kernel for this width, created (and measured) the first time the width is seen.
+// The plan is measured without the lock, so the other workers keep serving; two workers seeing
+// a new width at once both measure it and the first one is kept. Release it with releasePlan.
+struct structcached *kernelPlan(struct structentry *entry, int width, int height){
+    struct structcached *cached, *old;
+    convPlan plan;
+
+    pthread_mutex_lock(&plansLock);
+    if((cached = findPlan(entry, width)) != NULL){
+        cached->users++;
+        pthread_mutex_unlock(&plansLock);
+        return cached;
+    }
+    pthread_mutex_unlock(&plansLock);
+
+    if((plan = convPlanCreate(entry->kern, width, height, threads, 1, CONV_PLAN_MEASURE)) == NULL) return NULL;
+    pthread_mutex_lock(&plansLock);
+    if((cached = findPlan(entry, width)) == NULL && (cached = (struct structcached *)calloc(1, sizeof(*cached))) != NULL){
+        cached->plan = plan;
+        cached->width = width;
+        plan = NULL;
+        // keep the most recent widths
+        if(entry->nplans == MAX_PLANS){
+            old = entry->plans[0];
+            old->evicted = 1;
+            if(old->users == 0){
+                convPlanDestroy(old->plan);
+                free(old);
+            }
+            memmove(entry->plans, entry->plans + 1, (MAX_PLANS-1)*sizeof(entry->plans[0]));
+            entry->nplans--;
+        }
+        entry->plans[entry->nplans++] = cached;
+    }
+    if(cached) cached->users++;
+    pthread_mutex_unlock(&plansLock);
+    if(plan) convPlanDestroy(plan);
+    return cached;
+}
+
+void releasePlan(struct structcached *cached){
+    int destroy;
+
+    if(!cached) return;
+    pthread_mutex_lock(&plansLock);
+    destroy = (--cached->users == 0 && cached->evicted);
+    pthread_mutex_unlock(&plansLock);
+    if(destroy){
+        convPlanDestroy(cached->plan);
+        free(cached);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Requests
+///////////////////////////////////////////////////////////////////////////////
+
+static int readFull(int fd, void *buf, size_t size){
+    char *p = (char *)buf;
+    ssize_t n;
+
+    while(size > 0){
+        if((n = read(fd, p, size)) <= 0){
+            if(n < 0 && errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static int writeFull(int fd, const void *buf, size_t size){
+    const char *p = (const char *)buf;
+    ssize_t n;
+
+    while(size > 0){
+        if((n = write(fd, p, size)) <= 0){
+            if(n < 0 && errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+// One request line, without the newline. Returns -1 at the end of the connection.
+static int readLine(int fd, char *line, int max){
+    int n = 0;
+    char c;
+
+    while(readFull(fd, &c, 1) == 0){
+        if(c == '\n'){
+            if(n > 0 && line[n-1] == '\r') n--;
+            line[n] = '\0';
+            return n;
+        }
+        if(n < max-1) line[n++] = c;
+    }
+    return -1;
+}
+
+static void reply(int fd, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void reply(int fd, const char *fmt, ...){
+    char line[MAX_LINE];
+    va_list args;
+    int n;
+
+    va_start(args, fmt);
+    n = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    if(n >= (int)sizeof(line)) n = sizeof(line) - 1;
+    writeFull(fd, line, n);
+}
+
+// errno tells why it failed.
+int convolveFile(struct structentry *entry, convPlan plan, char *image, char *result){
+    FILE *fpsrc = NULL, *fpdst = NULL;
+    ImagenData source = NULL, output = NULL;
+    struct structcached *cached = NULL;
+    convImage in, out;
+    long position = 0;
+    int status = -1, error;
+
+    errno = 0;
+    // a rejected image is closed by initimage, the codec of a compressed one as well
+    if((source = initimage(image, &fpsrc, 1, 0)) == NULL){
+        if(fpsrc) fclose(fpsrc);
+        return -1;
+    }
+    position = ftell(fpsrc);
+    if((output = duplicateImageData(source, 1, 0)) == NULL) goto done;
+    // a truncated or malformed image
+    if(readImage(source, &fpsrc, source->ancho*source->altura, 0, &position)){
+        if(!errno) errno = EINVAL;
+        goto done;
+    }
+    if(!plan){
+        if((cached = kernelPlan(entry, source->ancho, source->altura)) == NULL) goto done;
+        plan = cached->plan;
+    }
+
+    in  = convPlanar(source->R, source->G, source->B, source->ancho, source->altura, source->ancho);
+    out = convPlanar(output->R, output->G, output->B, source->ancho, source->altura, source->ancho);
+    if(convExecute(plan, &in, &out)) goto done;
+
+    if(initfilestore(output, &fpdst, result, &position)) goto done;
+    if(savingChunk(output, &fpdst, source->ancho*source->altura, 0)){
+        if(!errno) errno = EIO;
+        fclose(fpdst);
+        goto done;
+    }
+    status = (fclose(fpdst) == 0) ? 0 : -1;
+done:
+    // the cleanup must not hide the errno of the failure
+    error = errno;
+    releasePlan(cached);
+    fclose(fpsrc);
+    if(output) freeImagestructure(&output);
+    freeImagestructure(&source);
+    errno = error;
+    return status;
+}
+
+static void recordLatency(double seconds, int error){
+    pthread_mutex_lock(&queue.lock);
+    queue.requests++;
+    if(error) queue.errors++;
+    queue.latency[queue.nlatency++ % LATENCY_SAMPLES] = seconds;
+    pthread_mutex_unlock(&queue.lock);
+}
+
+static int compareDoubles(const void *a, const void *b){
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+void writeStats(int fd){
+    double lat[LATENCY_SAMPLES], sum = 0;
+    int n, i, depth, busy, maxDepth;
+    long requests, errors, rejected;
+
+    pthread_mutex_lock(&queue.lock);
+    n = (queue.nlatency < LATENCY_SAMPLES) ? (int)queue.nlatency : LATENCY_SAMPLES;
+    memcpy(lat, queue.latency, n*sizeof(double));
+    depth = queue.depth;
+    maxDepth = queue.maxDepth;
+    busy = queue.busy;
+    requests = queue.requests;
+    errors = queue.errors;
+    rejected = queue.rejected;
+    pthread_mutex_unlock(&queue.lock);
+
+    qsort(lat, n, sizeof(double), compareDoubles);
+    for(i = 0; i < n; i++) sum += lat[i];
+    reply(fd, "{\"queue_depth\": %d, \"queue_max_depth\": %d, \"queue_capacity\": %d, \"busy_workers\": %d, "
+          "\"requests\": %ld, \"errors\": %ld, \"rejected\": %ld, \"latency_samples\": %d, "
+          "\"latency_mean_ms\": %.3lf, \"latency_p50_ms\": %.3lf, \"latency_p99_ms\": %.3lf, \"latency_max_ms\": %.3lf}\n",
+          depth, maxDepth, queue.capacity, busy, requests, errors, rejected, n,
+          n ? 1000*sum/n : 0.0, n ? 1000*lat[n/2] : 0.0, n ? 1000*lat[(int)ceil(0.99*n)-1] : 0.0, n ? 1000*lat[n-1] : 0.0);
+}
+
+// Plan of the request from its options: a private plan when they choose the engine or the boundary (*private set),
+// otherwise the cached plan of the width (*cached, released by the caller), or NULL for FILE requests (width 0)
+// whose size is not known yet.
+static int requestPlan(struct structentry *entry, char *options, int width, int height, convPlan *plan,
+                       struct structcached **cached, int *private){
+    char *tok, *save = NULL;
+    int engine = -1, tile = 0, boundary = -1, e;
+
+    *plan = NULL;
+    *cached = NULL;
+    *private = 0;
+    for(tok = strtok_r(options, " ", &save); tok; tok = strtok_r(NULL, " ", &save)){
+        if(strncmp(tok, "engine=", 7) == 0){
+            for(e = 0; e < ENGINES; e++)
+                if(strcmp(tok + 7, engineNames[e]) == 0) engine = e;
+            if(engine < 0) return -1;
+        }
+        else if(strncmp(tok, "tile=", 5) == 0) tile = atoi(tok + 5);
+        else if(strncmp(tok, "boundary=", 9) == 0){
+            for(e = 0; e < CONV_BOUNDARIES; e++)
+                if(strcmp(tok + 9, boundaryNames[e]) == 0) boundary = e;
+            if(boundary < 0) return -1;
+        }
+        else return -1;
+    }
+    if(engine < 0 && boundary < 0){
+        if(width > 0){
+            if((*cached = kernelPlan(entry, width, height)) == NULL) return -1;
+            *plan = (*cached)->plan;
+        }
+        return 0;
+    }
+
+    // the engine does not depend on the size, FILE requests get a plan for any width
+    if((*plan = convPlanCreate(entry->kern, width > 0 ? width : 1, height > 0 ? height : 1, threads, 1, CONV_PLAN_ESTIMATE)) == NULL)
+        return -1;
+    if((engine >= 0 && convPlanSetEngine(*plan, engine, tile)) || (boundary >= 0 && convPlanSetBoundary(*plan, boundary))){
+        convPlanDestroy(*plan);
+        *plan = NULL;
+        return -1;
+    }
+    *private = 1;
+    return 0;
+}
+
+// Serve the requests of a connection until it is closed.
+int serveConnection(int fd, double queued, convArena arena){
+    char line[MAX_LINE], cmd[16], name[64], image[MAX_LINE], result[MAX_LINE], options[MAX_LINE];
+    int width, height, channels, private, n, status;
+    struct structentry *entry;
+    struct structcached *cached;
+    convPlan plan;
+    double start, waited;
+    long size;
+    int *pixels;
+    convImage src, dst;
+
+    while(!stopping && readLine(fd, line, sizeof(line)) >= 0){
+        start = timerNow();
+        waited = queued ? start - queued : 0;     // only the first request of the connection waited in the queue
+        queued = 0;
+        options[0] = '\0';
+        // the planes of the previous request are recycled, their pages stay mapped
+        arenaReset(arena);
+        if(sscanf(line, "%15s", cmd) != 1) continue;
+
+        if(strcmp(cmd, "STATS") == 0){
+            writeStats(fd);
+            continue;
+        }
+        else if(strcmp(cmd, "FILE") == 0){
+            n = 0;
+            if(sscanf(line, "%*s %63s %1023s %1023s %n", name, image, result, &n) < 3 || n == 0){
+                reply(fd, "ERROR usage: FILE <kernel> <image> <result> [options]\n");
+                recordLatency(timerNow() - start + waited, 1);
+                continue;
+            }
+            snprintf(options, sizeof(options), "%s", line + n);
+            if((entry = findKernel(name)) == NULL){
+                reply(fd, "ERROR unknown kernel %s\n", name);
+                recordLatency(timerNow() - start + waited, 1);
+                continue;
+            }
+            if(requestPlan(entry, options, 0, 0, &plan, &cached, &private)){
+                reply(fd, "ERROR bad options\n");
+                recordLatency(timerNow() - start + waited, 1);
+                continue;
+            }
+            status = convolveFile(entry, plan, image, result);
+            n = errno;
+            if(private) convPlanDestroy(plan);
+            if(status) reply(fd, "ERROR %s: %s\n", image, strerror(n ? n : EIO));
+            else reply(fd, "OK %.0lf %.0lf\n", 1e6*waited, 1e6*(timerNow() - start));
+            recordLatency(timerNow() - start + waited, status != 0);
+        }
+        else if(strcmp(cmd, "PIXELS") == 0){
+            n = 0;
+            if(sscanf(line, "%*s %63s %d %d %d %n", name, &width, &height, &channels, &n) < 4 || n == 0 ||
+               width <= 0 || height <= 0 || channels < 1 || channels > CONV_MAX_CHANNELS){
+                // the pixels that follow can not be skipped, drop the connection
+                reply(fd, "ERROR usage: PIXELS <kernel> <width> <height> <channels> [options]\n");
+                recordLatency(timerNow() - start + waited, 1);
+                break;
+            }
+            if((long)width*height > MAX_PIXELS/channels){
+                reply(fd, "ERROR image too large, at most %ld samples\n", MAX_PIXELS);
+                recordLatency(timerNow() - start + waited, 1);
+                break;
+            }
+            snprintf(options, sizeof(options), "%s", line + n);
+            size = (long)width*height*channels;
+            pixels = arena ? (int *)arenaAlloc(arena, 2*size*sizeof(int)) : (int *)malloc(2*size*sizeof(int));
+            if(pixels == NULL || readFull(fd, pixels, size*sizeof(int))){
+                if(!arena) free(pixels);
+                recordLatency(timerNow() - start + waited, 1);
+                break;
+            }
+            entry = findKernel(name);
+            plan = NULL;
+            if(entry) requestPlan(entry, options, width, height, &plan, &cached, &private);
+            status = -1;
+            if(plan){
+                src = convInterleaved(pixels, width, height, channels, width*channels);
+                dst = convInterleaved(pixels + size, width, height, channels, width*channels);
+                status = convExecute(plan, &src, &dst);
+                if(private) convPlanDestroy(plan);
+                else releasePlan(cached);
+            }
+            if(!entry) reply(fd, "ERROR unknown kernel %s\n", name);
+            else if(!plan) reply(fd, "ERROR bad options\n");
+            else if(status) reply(fd, "ERROR convolution failed\n");
+            else{
+                reply(fd, "OK %.0lf %.0lf\n", 1e6*waited, 1e6*(timerNow() - start));
+                writeFull(fd, pixels + size, size*sizeof(int));
+            }
+            if(!arena) free(pixels);
+            recordLatency(timerNow() - start + waited, status != 0);
+        }
+        else{
+            reply(fd, "ERROR unknown request %s\n", cmd);
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Workers
+///////////////////////////////////////////////////////////////////////////////
+
+// Every worker carves the images of its requests from its own arena.
+static void *worker(void *arg){
+    struct structconn conn;
+    convArena arena = arenaCreate(0);
+
+    (void)arg;
+    arenaUse(arena);
+    for(;;){
+        pthread_mutex_lock(&queue.lock);
+        while(queue.depth == 0) pthread_cond_wait(&queue.ready, &queue.lock);
+        conn = queue.conn[queue.head];
+        queue.head = (queue.head + 1) % queue.capacity;
+        queue.depth--;
+        queue.busy++;
+        pthread_mutex_unlock(&queue.lock);
+
+        serveConnection(conn.fd, conn.queued, arena);
+
+        pthread_mutex_lock(&queue.lock);
+        queue.busy--;
+        pthread_mutex_unlock(&queue.lock);
+    }
+    return NULL;
+}
+
+// Queue the connection, or refuse it when the queue is full.
+static void enqueue(int fd){
+    pthread_mutex_lock(&queue.lock);
+    if(queue.depth == queue.capacity){
+        queue.rejected++;
+        pthread_mutex_unlock(&queue.lock);
+        reply(fd, "BUSY queue full (%d connections)\n", queue.capacity);
+        close(fd);
+        return;
+    }
+    queue.conn[(queue.head + queue.depth) % queue.capacity].fd = fd;
+    queue.conn[(queue.head + queue.depth) % queue.capacity].queued = timerNow();
+    queue.depth++;
+    if(queue.depth > queue.maxDepth) queue.maxDepth = queue.depth;
+    pthread_cond_signal(&queue.ready);
+    pthread_mutex_unlock(&queue.lock);
+}
+
+static void stop(int sig){
+    (void)sig;
+    stopping = 1;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// MAIN FUNCTION
+//////////////////////////////////////////////////////////////////////////////////////////////////
+int main(int argc, char **argv)
+{
+    int i, fd, conn, workers = DAEMON_WORKERS, ok = 1;
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    pthread_t thread;
+    char *socketPath = NULL;
+
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.ready, NULL);
+    queue.capacity = DAEMON_QUEUE;
+    for(i = 1; i < argc && ok; i++){
+        if(strcmp(argv[i], "--workers") == 0 && i+1 < argc)
+            ok = (workers = atoi(argv[++i])) > 0;
+        else if(strcmp(argv[i], "--queue") == 0 && i+1 < argc)
+            ok = (queue.capacity = atoi(argv[++i])) > 0 && queue.capacity <= DAEMON_QUEUE;
+        else if(strcmp(argv[i], "--threads") == 0 && i+1 < argc)
+            ok = (threads = atoi(argv[++i])) > 0;
+        else if(strcmp(argv[i], "--kernel") == 0 && i+1 < argc){
+            if(loadKernel(argv[++i])){
+                fprintf(stderr, "Error: can not load kernel %s\n", argv[i]);
+                return -1;
+            }
+        }
+        else if(!socketPath && argv[i][0] != '-') socketPath = argv[i];
+        else ok = 0;
+    }
+    if(!ok || !socketPath || nkernels == 0){
+        printf("Usage: %s <socket> --kernel [name=]file [--kernel ...] [options]\n", argv[0]);
+        printf("- socket        : path of the UNIX domain socket\n");
+        printf("- --kernel      : kernel file, named after the file or name (up to %d)\n", MAX_KERNELS);
+        printf("- --workers N   : requests served at the same time (default %d)\n", DAEMON_WORKERS);
+        printf("- --queue N     : connections waiting for a worker, 1..%d (default %d)\n", DAEMON_QUEUE, DAEMON_QUEUE);
+        printf("- --threads N   : threads of every convolution (default CONVOLVE_THREADS or the processors)\n\n");
+        return -1;
+    }
+    if(threads <= 0) threads = convDefaultThreads();
+
+    // warm up the thread pool of the library
+    convPlanDestroy(convPlanCreate(kernels[0].kern, 1, 1, threads, 1, CONV_PLAN_ESTIMATE));
+
+    if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0){
+        perror("Error: ");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socketPath);
+    unlink(socketPath);
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, queue.capacity)){
+        perror("Error: ");
+        return -1;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    for(i = 0; i < workers; i++){
+        if(pthread_create(&thread, NULL, worker, NULL) != 0){
+            perror("Error: ");
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+    printf("Listening on %s: %d kernels, %d workers, queue of %d, %d threads per convolution\n",
+           socketPath, nkernels, workers, queue.capacity, threads);
+    fflush(stdout);
+
+    while(!stopping){
+        if((conn = accept(fd, NULL, NULL)) < 0){
+            if(errno == EINTR) continue;
+            perror("Error: ");
+            break;
+        }
+        enqueue(conn);
+    }
+
+    close(fd);
+    unlink(socketPath);
+    return 0;
+}
+
+// gcc -O2 convolutiond.c "../HPC - Convolution Library/libconvolve.c" -o convolutiond -lpthread -lm
+// ./convolutiond /tmp/convolution.sock --kernel "../HPC - OMP Convolution/01. Edge.txt" --kernel sharpen="../HPC - OMP Convolution/02. Sharpen.txt"
+// printf 'FILE 01 im03.ppm result.ppm\nSTATS\n' | socat - UNIX-CONNECT:/tmp/convolution.sock
@@ -0,0 +1,3675 @@
+// Convolution library
+// github : - aditya1453
+//          - widyameiriska
+//
+//  libconvolve.c
+//
+//
+// Serial Code Created by Josep Lluis Lerida on 11/03/15.
+//
+// PPM I/O, kernels, convolution engines, planner, thread pool and instrumentation
+// shared by the convolution programs. See libconvolve.h for the plan/execute API.
+
+#define _GNU_SOURCE     // fopencookie
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+#include <time.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#include "libconvolve.h"
+
+extern char **environ;
+
+///////////////////////////////////////////////////////////////////////////////
+// Compressed image streams
+// Images compressed with gzip or zstd are read and written through the codec
+// program, started without a shell and connected by a pipe. The pipe is
+// wrapped in a stdio stream (fopencookie), so the rest of the I/O keeps using
+// fscanf/fprintf, ftell counts the uncompressed bytes and fclose waits for the
+// codec. Compressed input is recognized by its magic number, compressed output
+// by the .gz/.zst suffix of the file name. gzip uses pigz when it is installed;
+// zstd compresses with every core (-T0).
+// Pipes can not seek: readImage keeps the halo rows of a chunk in memory for
+// the next one instead of reading them again.
+///////////////////////////////////////////////////////////////////////////////
+#define CODEC_NONE  0
+#define CODEC_GZIP  1
+#define CODEC_ZSTD  2
+
+#ifdef __linux__
+struct structcodec{
+    int fd;             // our end of the pipe
+    pid_t pid;          // codec process
+    long bytes;         // uncompressed bytes transferred
+};
+
+static ssize_t codecRead(void *cookie, char *buf, size_t size){
+    struct structcodec *s = (struct structcodec *)cookie;
+    ssize_t n;
+
+    while((n = read(s->fd, buf, size)) < 0 && errno == EINTR);
+    if(n > 0) s->bytes += n;
+    return n;
+}
+
+static ssize_t codecWrite(void *cookie, const char *buf, size_t size){
+    struct structcodec *s = (struct structcodec *)cookie;
+    size_t done = 0;
+    ssize_t n;
+
+    while(done < size){
+        if((n = write(s->fd, buf + done, size - done)) < 0){
+            if(errno == EINTR) continue;
+            return done ? (ssize_t)done : -1;
+        }
+        done += n;
+    }
+    s->bytes += size;
+    return size;
+}
+
+// Only ftell is supported.
+static int codecSeek(void *cookie, off64_t *offset, int whence){
+    struct structcodec *s = (struct structcodec *)cookie;
+
+    if(whence != SEEK_CUR || *offset != 0){
+        errno = ESPIPE;
+        return -1;
+    }
+    *offset = s->bytes;
+    return 0;
+}
+
+// Close the pipe and wait for the codec; an error of the codec is an error of fclose.
+static int codecClose(void *cookie){
+    struct structcodec *s = (struct structcodec *)cookie;
+    int status = 0;
+
+    close(s->fd);
+    while(waitpid(s->pid, &status, 0) < 0 && errno == EINTR);
+    free(s);
+    return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : -1;
+}
+
+// Start the codec on the file: its stdout is our pipe when reading, its stdin when writing.
+static FILE *codecOpen(char *nombre, int codec, int writing){
+    static char *gzipRead[][3]  = {{"pigz", "-dc", NULL}, {"gzip", "-dc", NULL}};
+    static char *gzipWrite[][3] = {{"pigz", "-c", NULL},  {"gzip", "-c", NULL}};
+    static char *zstdRead[][4]  = {{"zstd", "-dcq", NULL, NULL}};
+    static char *zstdWrite[][4] = {{"zstd", "-cq", "-T0", NULL}};
+    cookie_io_functions_t io = {codecRead, codecWrite, codecSeek, codecClose};
+    posix_spawn_file_actions_t actions;
+    struct structcodec *s;
+    char **argv;
+    int p[2], i, err = ENOENT, candidates = (codec == CODEC_GZIP) ? 2 : 1;
+    FILE *fp;
+
+    if(pipe2(p, O_CLOEXEC)) return NULL;
+    if((s = (struct structcodec *)calloc(1, sizeof(struct structcodec))) == NULL){
+        close(p[0]);
+        close(p[1]);
+        return NULL;
+    }
+    for(i = 0; i < candidates && err == ENOENT; i++){
+        if(codec == CODEC_GZIP) argv = writing ? gzipWrite[i] : gzipRead[i];
+        else argv = writing ? zstdWrite[i] : zstdRead[i];
+        posix_spawn_file_actions_init(&actions);
+        if(writing){
+            posix_spawn_file_actions_adddup2(&actions, p[0], 0);
+            posix_spawn_file_actions_addopen(&actions, 1, nombre, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        }
+        else{
+            posix_spawn_file_actions_addopen(&actions, 0, nombre, O_RDONLY, 0);
+            posix_spawn_file_actions_adddup2(&actions, p[1], 1);
+        }
+        err = posix_spawnp(&s->pid, argv[0], &actions, NULL, argv, environ);
+        posix_spawn_file_actions_destroy(&actions);
+    }
+    close(writing ? p[0] : p[1]);
+    s->fd = writing ? p[1] : p[0];
+    if(err){
+        fprintf(stderr, "Error: can not start the %s codec: %s\n", codec == CODEC_GZIP ? "gzip" : "zstd", strerror(err));
+        close(s->fd);
+        free(s);
+        return NULL;
+    }
+    if((fp = fopencookie(s, writing ? "w" : "r", io)) == NULL) codecClose(s);
+    return fp;
+}
+#endif
+
+// Open an image for reading ("r") or writing ("w"), through the codec when it is compressed.
+FILE *openImageFile(char *nombre, const char *mode){
+    unsigned char magic[4];
+    int codec = CODEC_NONE;
+    size_t len = strlen(nombre);
+    FILE *fp;
+
+    if(mode[0] == 'w'){
+        if(len > 3 && strcmp(nombre + len - 3, ".gz") == 0) codec = CODEC_GZIP;
+        if(len > 4 && strcmp(nombre + len - 4, ".zst") == 0) codec = CODEC_ZSTD;
+        if(codec == CODEC_NONE) return fopen(nombre, mode);
+    }
+    else{
+        if((fp = fopen(nombre, mode)) == NULL) return NULL;
+        if(fread(magic, 1, 4, fp) == 4){
+            if(magic[0] == 0x1f && magic[1] == 0x8b) codec = CODEC_GZIP;
+            if(magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) codec = CODEC_ZSTD;
+        }
+        if(codec == CODEC_NONE){
+            rewind(fp);
+            return fp;
+        }
+        fclose(fp);
+    }
+#ifdef __linux__
+    return codecOpen(nombre, codec, mode[0] == 'w');
+#else
+    fprintf(stderr, "Error: compressed images are not supported on this system\n");
+    errno = ENOTSUP;
+    return NULL;
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Tiled image files
+// Binary, planar and tiled: a header, the offset of every tile and the tiles.
+// Every tile holds its channels one after the other, each a tileW x tileH
+// block of native ints stored by rows (tiles on the right and bottom edges
+// are smaller). Any tile, and any row of a tile, can be read directly with
+// pread, in any order and from any thread or rank; the tiles of a band of
+// rows are read in parallel on the thread pool. initimage recognizes tiled
+// files by their magic number and initfilestore writes one when the name ends
+// in TILED_SUFFIX, so the programs and the converter use them like PPM files.
+//
+//   int magic, version, P, width, height, channels, maxcolor, tileW, tileH, commentLength
+//   char comment[commentLength], padded to 8 bytes
+//   long long offset[tilesY*tilesX]        tiles by rows
+//   tiles
+///////////////////////////////////////////////////////////////////////////////
+#define TILED_MAGIC     0x54564e43  // "CNVT"
+#define TILED_VERSION   1
+#define TILED_HEADER    10          // ints before the comment
+#define TILED_TILE      256         // default tile size
+#define TILED_SUFFIX    ".cvt"
+
+struct structtiled{
+    int fd;                 // descriptor of the FILE of the image, used with pread/pwrite
+    int tileW;
+    int tileH;
+    int tilesX;
+    int tilesY;
+    long long *offset;      // file offset of every tile
+    int channels;           // channels stored, the image has 1 when it is read as luma
+    long long bytes;        // bytes read or written, reported through ftell
+    long pixel;             // next pixel to read or write
+};
+
+static int tiledTileW = TILED_TILE, tiledTileH = TILED_TILE;
+
+// Rows of one band of tiles, task per tile column and channel.
+struct structtiledrows{
+    ImagenData img;
+    int ty;
+    int rowBegin;
+    int rowEnd;
+    long first;             // pixel of the planes where rowBegin goes
+    int writing;
+    int status;
+};
+
+static void poolGrow(int threads);
+static void poolParallel(void (*task)(void *arg, int index, int worker), void *arg, int ntasks);
+
+static int *imagePlane(ImagenData img, int c){
+    return (c==0) ? img->R : (c==1) ? img->G : img->B;
+}
+
+static long long tiledBytes(struct structtiled *t, ImagenData img, int tx, int ty){
+    int tw = (tx < t->tilesX-1) ? t->tileW : img->ancho - tx*t->tileW;
+    int th = (ty < t->tilesY-1) ? t->tileH : img->altura - ty*t->tileH;
+    return (long long)tw*th*t->channels*sizeof(int);
+}
+
+// Color tiles read into a luma image: the three channels are combined as by parsePixels.
+static void tiledLuma(int *R, const int *G, const int *B, long n){
+    long i;
+
+    for(i = 0; i < n; i++) R[i] = (299*R[i] + 587*G[i] + 114*B[i] + 500)/1000;
+}
+
+static void tiledRowsTask(void *arg, int index, int worker){
+    struct structtiledrows *x = (struct structtiledrows *)arg;
+    ImagenData img = x->img;
+    struct structtiled *t = img->tiled;
+    int luma = (t->channels != img->channels);    // every channel of the file goes to the R plane
+    int tx = index / img->channels, c = index % img->channels, k, copies = luma ? t->channels : 1;
+    int tw = (tx < t->tilesX-1) ? t->tileW : img->ancho - tx*t->tileW;
+    int th = (x->ty < t->tilesY-1) ? t->tileH : img->altura - x->ty*t->tileH;
+    int r0 = (x->rowBegin > x->ty*t->tileH) ? x->rowBegin : x->ty*t->tileH;
+    int r1 = (x->rowEnd < x->ty*t->tileH + th) ? x->rowEnd : x->ty*t->tileH + th;
+    long long at = t->offset[x->ty*t->tilesX + tx] + ((long long)c*th + (r0 - x->ty*t->tileH))*tw*sizeof(int);
+    size_t size = (size_t)(r1-r0)*tw*sizeof(int);
+    long count = (long)(r1-r0)*tw;
+    int *buf, *plane = imagePlane(img, c), r;
+    ssize_t n = size;
+
+    (void)worker;
+    if(r1 <= r0) return;
+    if((buf = (int *)malloc(size*copies)) == NULL){
+        x->status = -1;
+        return;
+    }
+    if(x->writing){
+        for(r = r0; r < r1; r++)
+            memcpy(buf + (long)(r-r0)*tw, plane + x->first + (long)(r-x->rowBegin)*img->ancho + tx*t->tileW, tw*sizeof(int));
+        n = pwrite(t->fd, buf, size, at);
+    }
+    else{
+        for(k = 0; k < copies && n == (ssize_t)size; k++)
+            n = pread(t->fd, buf + k*count, size, at + (long long)k*th*tw*sizeof(int));
+        if(luma) tiledLuma(buf, buf + count, buf + 2*count, count);
+        for(r = r0; r < r1 && n == (ssize_t)size; r++)
+            memcpy(plane + x->first + (long)(r-x->rowBegin)*img->ancho + tx*t->tileW, buf + (long)(r-r0)*tw, tw*sizeof(int));
+    }
+    if(n != (ssize_t)size) x->status = -1;
+    free(buf);
+}
+
+// Read (or write) the rows rowBegin..rowEnd-1 of a tiled image from (or to) its planes,
+// starting at the pixel first of the planes.
+static int tiledRows(ImagenData img, int rowBegin, int rowEnd, long first, int writing){
+    struct structtiled *t = img->tiled;
+    struct structtiledrows x = {img, 0, rowBegin, rowEnd, first, writing, 0};
+    int ty;
+
+    poolGrow(convDefaultThreads());
+    for(ty = rowBegin / t->tileH; ty*t->tileH < rowEnd && ty < t->tilesY; ty++){
+        x.ty = ty;
+        poolParallel(tiledRowsTask, &x, t->tilesX*img->channels);
+    }
+    t->bytes += (long long)(rowEnd-rowBegin)*img->ancho*t->channels*sizeof(int);
+    return x.status;
+}
+
+// Part of one row, columns x0..x1-1, to or from the pixel first of the planes.
+static int tiledSpan(ImagenData img, int row, int x0, int x1, long first, int writing){
+    struct structtiled *t = img->tiled;
+    int luma = (t->channels != img->channels);
+    int ty = row / t->tileH, tx, c, k, tw, th, a, b, copies = luma ? t->channels : 1;
+    int gb[2][TILED_TILE*4];
+    long long at;
+    size_t size;
+    ssize_t n;
+    int *plane;
+
+    for(c = 0; c < img->channels; c++){
+        plane = imagePlane(img, c);
+        for(tx = x0 / t->tileW; tx*t->tileW < x1; tx++){
+            tw = (tx < t->tilesX-1) ? t->tileW : img->ancho - tx*t->tileW;
+            th = (ty < t->tilesY-1) ? t->tileH : img->altura - ty*t->tileH;
+            a = (x0 > tx*t->tileW) ? x0 : tx*t->tileW;
+            for(; a < x1 && a < tx*t->tileW + tw; a = b){
+                // luma pieces go through a small buffer for G and B
+                b = (x1 < tx*t->tileW + tw) ? x1 : tx*t->tileW + tw;
+                if(luma && b - a > TILED_TILE*4) b = a + TILED_TILE*4;
+                at = t->offset[ty*t->tilesX + tx] + ((long long)c*th*tw + (long long)(row - ty*t->tileH)*tw + (a - tx*t->tileW))*sizeof(int);
+                size = (b-a)*sizeof(int);
+                n = writing ? pwrite(t->fd, plane + first + (a-x0), size, at) : pread(t->fd, plane + first + (a-x0), size, at);
+                for(k = 1; k < copies && n == (ssize_t)size; k++)
+                    n = pread(t->fd, gb[k-1], size, at + (long long)k*th*tw*sizeof(int));
+                if(n != (ssize_t)size) return -1;
+                if(luma) tiledLuma(plane + first + (a-x0), gb[0], gb[1], b-a);
+            }
+        }
+    }
+    t->bytes += (long long)(x1-x0)*t->channels*sizeof(int);
+    return 0;
+}
+
+// Pixels pixelBegin..pixelEnd-1 of the image (by rows) to or from the planes, starting at the pixel first.
+// Whole rows go by bands of tiles, a partial first or last row piece by piece.
+static int tiledPixels(ImagenData img, long pixelBegin, long pixelEnd, long first, int writing){
+    long rowA = (pixelBegin + img->ancho - 1) / img->ancho, rowB = pixelEnd / img->ancho;
+    int status = 0;
+
+    if(pixelEnd <= pixelBegin) return 0;
+    if(rowA > rowB)
+        return tiledSpan(img, rowB, pixelBegin % img->ancho, pixelEnd % img->ancho, first, writing);
+    if(pixelBegin % img->ancho)
+        status |= tiledSpan(img, rowA-1, pixelBegin % img->ancho, img->ancho, first, writing);
+    if(rowB > rowA)
+        status |= tiledRows(img, rowA, rowB, first + (rowA*img->ancho - pixelBegin), writing);
+    if(pixelEnd % img->ancho)
+        status |= tiledSpan(img, rowB, 0, pixelEnd % img->ancho, first + (rowB*img->ancho - pixelBegin), writing);
+    return status;
+}
+
+// Tile size of the tiled images written from now on.
+void setTiledTile(int tileW, int tileH){
+    tiledTileW = (tileW > 0) ? tileW : TILED_TILE;
+    tiledTileH = (tileH > 0) ? tileH : TILED_TILE;
+}
+
+int readTiledRows(ImagenData img, int rowBegin, int rowEnd, int first){
+    if(!img->tiled || rowBegin < 0 || rowEnd > img->altura) return -1;
+    return tiledRows(img, rowBegin, rowEnd, first, 0);
+}
+
+int writeTiledRows(ImagenData img, int rowBegin, int rowEnd, int first){
+    if(!img->tiled || rowBegin < 0 || rowEnd > img->altura) return -1;
+    return tiledRows(img, rowBegin, rowEnd, first, 1);
+}
+
+// Offsets of the tiles of an image: they follow the header in order.
+static struct structtiled *newTiled(ImagenData img, int fd, int tileW, int tileH, long long start){
+    struct structtiled *t;
+    int i;
+
+    if((t = (struct structtiled *)calloc(1, sizeof(struct structtiled))) == NULL) return NULL;
+    t->fd = fd;
+    t->channels = img->channels;
+    t->tileW = tileW;
+    t->tileH = tileH;
+    t->tilesX = (img->ancho + tileW - 1) / tileW;
+    t->tilesY = (img->altura + tileH - 1) / tileH;
+    if((t->offset = (long long *)malloc(t->tilesX*t->tilesY*sizeof(long long))) == NULL){
+        free(t);
+        return NULL;
+    }
+    for(i = 0; i < t->tilesX*t->tilesY; i++){
+        t->offset[i] = start;
+        start += tiledBytes(t, img, i % t->tilesX, i / t->tilesX);
+    }
+    return t;
+}
+
+static void freeTiled(struct structtiled *t){
+    if(!t) return;
+    free(t->offset);
+    free(t);
+}
+
+// Header and index of a tiled image, the FILE is at its start.
+static int readTiledHeader(ImagenData img, FILE *fp){
+    int head[TILED_HEADER], ntiles;
+    long long start;
+
+    if(fread(head, sizeof(int), TILED_HEADER, fp) != TILED_HEADER || head[0] != TILED_MAGIC || head[1] != TILED_VERSION ||
+       head[3] <= 0 || head[4] <= 0 || (head[5] != 1 && head[5] != 3) || head[7] <= 0 || head[8] <= 0 || head[9] < 0)
+        return -1;
+    img->P = head[2];
+    img->ancho = head[3];
+    img->altura = head[4];
+    img->channels = head[5];
+    img->maxcolor = head[6];
+    if((img->comentario = (char *)calloc(head[9]+1, 1)) == NULL || fread(img->comentario, 1, head[9], fp) != (size_t)head[9])
+        return -1;
+    start = TILED_HEADER*sizeof(int) + ((head[9] + 7) & ~7);
+    if((img->tiled = newTiled(img, fileno(fp), head[7], head[8], 0)) == NULL) return -1;
+    ntiles = img->tiled->tilesX*img->tiled->tilesY;
+    if(pread(img->tiled->fd, img->tiled->offset, ntiles*sizeof(long long), start) != (ssize_t)(ntiles*sizeof(long long)))
+        return -1;
+    img->tiled->bytes = start + ntiles*sizeof(long long);
+    return 0;
+}
+
+// Header and index of a new tiled image.
+static int writeTiledHeader(ImagenData img, FILE *fp){
+    int head[TILED_HEADER] = {TILED_MAGIC, TILED_VERSION, img->P, img->ancho, img->altura, img->channels,
+                              img->maxcolor, tiledTileW, tiledTileH, (int)strlen(img->comentario)};
+    int ntiles = ((img->ancho + tiledTileW - 1) / tiledTileW) * ((img->altura + tiledTileH - 1) / tiledTileH);
+    long long start = TILED_HEADER*sizeof(int) + ((head[9] + 7) & ~7);
+    struct structtiled *t;
+    char pad[8] = {0};
+
+    if((t = newTiled(img, fileno(fp), tiledTileW, tiledTileH, start + ntiles*sizeof(long long))) == NULL) return -1;
+    img->tiled = t;
+    if(pwrite(t->fd, head, sizeof(head), 0) != sizeof(head) ||
+       pwrite(t->fd, img->comentario, head[9], sizeof(head)) != head[9] ||
+       pwrite(t->fd, pad, start - sizeof(head) - head[9], sizeof(head) + head[9]) != start - (long long)sizeof(head) - head[9] ||
+       pwrite(t->fd, t->offset, ntiles*sizeof(long long), start) != (ssize_t)(ntiles*sizeof(long long)))
+        return -1;
+    t->bytes = start + ntiles*sizeof(long long);
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Arena
+// The planes of the images and the work buffers of a run are carved from one
+// mapping instead of a malloc each. The mapping is aligned to 2 MB so it can
+// be backed by huge pages: hugetlbfs pages when the size is given and the pool
+// has them, transparent huge pages otherwise. A few TLB entries then cover a
+// whole image. The pages are faulted in when a block first reaches them, and
+// that time is counted, so the page faults of a run are in one place.
+// Blocks are not freed one by one: arenaReset recycles the whole arena for the
+// next image or batch. An arena belongs to one thread (arenaUse): the image
+// planes and the work buffers of convExecute allocated by that thread are
+// carved from it.
+///////////////////////////////////////////////////////////////////////////////
+#define ARENA_RESERVE   (64L << 30)     // address space reserved when no size is given
+
+static __thread convArena threadArena = NULL;
+
+// Arena of size bytes, or when size is 0 of CONVOLUTION_ARENA_MB megabytes, or a reservation of
+// ARENA_RESERVE bytes of address space that is only backed as it is used.
+convArena arenaCreate(size_t size){
+    convArena a;
+    char *env, *raw = MAP_FAILED;
+    size_t lead;
+
+    if(size == 0 && (env = getenv("CONVOLUTION_ARENA_MB")) != NULL) size = (size_t)atol(env) << 20;
+    if((a = (convArena) calloc(1, sizeof(struct structarena))) == NULL) return NULL;
+#ifdef MAP_HUGETLB
+    if(size){
+        a->size = (size + ARENA_HUGEPAGE-1) / ARENA_HUGEPAGE * ARENA_HUGEPAGE;
+        raw = mmap(NULL, a->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+    if(raw != MAP_FAILED){
+        a->base = raw;
+        a->hugetlb = 1;
+        a->pageSize = ARENA_HUGEPAGE;
+        return a;
+    }
+
+    // normal pages: reserve a huge page more to align the start, and ask for transparent huge pages
+    a->size = size ? (size + ARENA_HUGEPAGE-1) / ARENA_HUGEPAGE * ARENA_HUGEPAGE : ARENA_RESERVE;
+    raw = mmap(NULL, a->size + ARENA_HUGEPAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(raw == MAP_FAILED){
+        free(a);
+        return NULL;
+    }
+    lead = (ARENA_HUGEPAGE - (size_t)raw % ARENA_HUGEPAGE) % ARENA_HUGEPAGE;
+    if(lead) munmap(raw, lead);
+    munmap(raw + lead + a->size, ARENA_HUGEPAGE - lead);
+    a->base = raw + lead;
+    a->pageSize = sysconf(_SC_PAGESIZE);
+#ifdef MADV_HUGEPAGE
+    madvise(a->base, a->size, MADV_HUGEPAGE);
+#endif
+    return a;
+}
+
+// Block of bytes aligned to ARENA_ALIGN, NULL when the arena is full. New pages are faulted in here.
+void *arenaAlloc(convArena a, size_t bytes){
+    size_t begin, end, p, page = sysconf(_SC_PAGESIZE);
+    struct rusage usage;
+    long faults;
+    double start;
+
+    if(!a) return NULL;
+    begin = (a->used + ARENA_ALIGN-1) / ARENA_ALIGN * ARENA_ALIGN;
+    if(begin > a->size || bytes > a->size - begin){
+        errno = ENOMEM;
+        return NULL;
+    }
+    end = begin + bytes;
+    if(end > a->touched){
+        getrusage(RUSAGE_SELF, &usage);
+        faults = usage.ru_minflt + usage.ru_majflt;
+        start = timerNow();
+        for(p = a->touched; p < end; p += page) a->base[p] = 0;
+        a->faultSeconds += timerNow() - start;
+        getrusage(RUSAGE_SELF, &usage);
+        a->faults += usage.ru_minflt + usage.ru_majflt - faults;
+        a->touched = (end + page-1) / page * page;
+        if(a->touched > a->size) a->touched = a->size;
+    }
+    a->used = end;
+    if(end > a->peak) a->peak = end;
+    return a->base + begin;
+}
+
+// Zeroed block of count x size bytes. Only the part that was used before the last reset is cleared.
+void *arenaCalloc(convArena a, size_t count, size_t size){
+    size_t touched = a ? a->touched : 0, bytes = count*size, offset;
+    char *p;
+
+    if(size && count > (size_t)-1 / size) return NULL;
+    if((p = (char *)arenaAlloc(a, bytes)) == NULL) return NULL;
+    offset = p - a->base;
+    if(offset < touched) memset(p, 0, (touched - offset < bytes) ? touched - offset : bytes);
+    return p;
+}
+
+// Carve the image planes and the work buffers allocated by the calling thread from the arena, NULL = malloc.
+void arenaUse(convArena arena){
+    threadArena = arena;
+}
+
+// Recycle every block of the arena. The pages stay mapped and faulted in.
+void arenaReset(convArena arena){
+    if(!arena) return;
+    arena->used = 0;
+    arena->resets++;
+}
+
+// Bytes of the arena backed by huge pages, from /proc/self/smaps; -1 when it can not be read.
+long arenaHugeBytes(convArena arena){
+    FILE *fp;
+    char line[256];
+    unsigned long begin, end;
+    long kb, huge = -1;
+    int inside = 0;
+
+    if(!arena) return -1;
+    if(arena->hugetlb) return (long)arena->touched;
+    if((fp = fopen("/proc/self/smaps", "r")) == NULL) return -1;
+    while(fgets(line, sizeof(line), fp)){
+        if(sscanf(line, "%lx-%lx ", &begin, &end) == 2) inside = (begin == (unsigned long)arena->base);
+        else if(inside && sscanf(line, "AnonHugePages: %ld kB", &kb) == 1){
+            huge = kb * 1024;
+            break;
+        }
+    }
+    fclose(fp);
+    return huge;
+}
+
+// One line about the arena: the bytes used, the pages (and so the TLB entries) that map them, the page faults.
+void arenaReport(convArena arena, FILE *fp){
+    long huge;
+    size_t small;
+
+    if(!arena) return;
+    huge = arenaHugeBytes(arena);
+    if(huge < 0) huge = 0;
+    small = (arena->touched > (size_t)huge) ? arena->touched - huge : 0;
+    fprintf(fp, "Arena: %.1lf MB used, %ld huge pages + %ld %ld kB pages (%s), %ld page faults in %.6lf seconds, %d resets\n",
+            arena->peak / 1048576.0, huge / ARENA_HUGEPAGE, (long)((small + arena->pageSize-1) / arena->pageSize),
+            (long)(arena->pageSize / 1024), arena->hugetlb ? "hugetlbfs" : "transparent huge pages",
+            arena->faults, arena->faultSeconds, arena->resets);
+}
+
+void arenaDestroy(convArena arena){
+    if(!arena) return;
+    if(threadArena == arena) threadArena = NULL;
+    munmap(arena->base, arena->size);
+    free(arena);
+}
+
+//Planes of size pixels of the image, from the arena of the thread when there is one
+static int allocPlanes(ImagenData img, long size){
+    int **plane[3] = {&img->R, &img->G, &img->B};
+    size_t mark = threadArena ? threadArena->used : 0;
+    int c;
+
+    img->R = img->G = img->B = NULL;
+    img->arena = 0;
+    if (threadArena) {
+        for (c=0; c<img->channels && (*plane[c] = (int *)arenaCalloc(threadArena, size, sizeof(int))) != NULL; c++);
+        if (c == img->channels) {
+            img->arena = 1;
+            return 0;
+        }
+        // the arena is full, use the heap
+        threadArena->used = mark;
+        img->R = img->G = img->B = NULL;
+    }
+    for (c=0; c<img->channels; c++)
+        if ((*plane[c] = (int *)calloc(size, sizeof(int))) == NULL) return -1;
+    return 0;
+}
+
+//Planes of one partition plus the halo rows
+static int allocImagePlanes(ImagenData img, int partitions, int halo){
+    long chunk = (long)img->ancho*img->altura / partitions;
+    //We need to read an extra row.
+    chunk = chunk + (long)img->ancho * halo;
+    return allocPlanes(img, chunk);
+}
+
+//Open Image file and read its header, the planes are not allocated. On an error the file is
+//closed again (*fp is NULL) and nothing is left allocated.
+static ImagenData readImageHeader(char* nombre, FILE **fp){
+    char c;
+    char comentario[300];
+    int i=0;
+    ImagenData img=NULL;
+    
+    /*Opening ppm*/
+
+    if ((*fp=openImageFile(nombre,"r"))==NULL){
+        // the callers report errno as well, perror may change it
+        i=errno;
+        perror("Error: ");
+        errno=i;
+    }
+    else{
+        //Memory allocation
+        img=(ImagenData) malloc(sizeof(struct imagenppm));
+        img->haloStart = img->haloLen = 0;
+        img->tiled = NULL;
+        img->R = img->G = img->B = NULL;
+        img->comentario = NULL;
+        img->arena = 0;
+
+        //Tiled images have a binary header
+        c = fgetc(*fp);
+        ungetc(c, *fp);
+        if (c == (char)(TILED_MAGIC & 0xff)) {
+            if (readTiledHeader(img, *fp)) {
+                fprintf(stderr,"Error: %s is not a valid tiled image\n",nombre);
+                freeImagestructure(&img);
+                fclose(*fp);
+                *fp=NULL;
+                return NULL;
+            }
+            return img;
+        }
+
+        //Reading the first line: Magical Number "P3", or "P2"/"P5" for gray images
+        fscanf(*fp,"%c%d ",&c,&(img->P));
+        if (img->P!=2 && img->P!=3 && img->P!=5) {
+            fprintf(stderr,"Error: %s is not a P2, P3 or P5 image\n",nombre);
+            free(img);
+            fclose(*fp);
+            *fp=NULL;
+            return NULL;
+        }
+        img->channels = (img->P==3) ? 3 : 1;
+        
+        //Reading the image comment
+        while((c=fgetc(*fp))!= '\n'){comentario[i]=c;i++;}
+        comentario[i]='\0';
+        //Allocating information for the image comment
+        img->comentario = calloc(strlen(comentario)+1,sizeof(char));
+        strcpy(img->comentario,comentario);
+        //Reading image dimensions and color resolution
+        fscanf(*fp,"%d %d %d",&img->ancho,&img->altura,&img->maxcolor);
+        //The binary pixels start after a single whitespace
+        if (img->P==5) fgetc(*fp);
+    }
+    return img;
+}
+
+//Open Image file and image struct initialization. On an error the file is closed (*fp is NULL).
+ImagenData initimage(char* nombre, FILE **fp,int partitions, int halo){
+    ImagenData img=readImageHeader(nombre, fp);
+
+    //Memory allocation based on number of partitions and halo size
+    if (img && allocImagePlanes(img, partitions, halo)) {
+        freeImagestructure(&img);
+        fclose(*fp);
+        *fp=NULL;
+        return NULL;
+    }
+    return img;
+}
+
+//Duplicate the Image struct for the resulting image
+ImagenData duplicateImageData(ImagenData src, int partitions, int halo){
+    char c;
+    char comentario[300];
+    unsigned int imageX, imageY;
+    int i=0;
+    //Struct memory allocation
+    ImagenData dst=(ImagenData) malloc(sizeof(struct imagenppm));
+
+    //Copying the magic number. A color image converted to luma is stored as P2.
+    dst->P = (src->P==3 && src->channels==1) ? 2 : src->P;
+    dst->channels=src->channels;
+    //Copying the string comment
+    dst->comentario = calloc(strlen(src->comentario)+1,sizeof(char));
+    strcpy(dst->comentario,src->comentario);
+    //Copying image dimensions and color resolution
+    dst->ancho=src->ancho;
+    dst->altura=src->altura;
+    dst->maxcolor=src->maxcolor;
+    dst->haloStart=dst->haloLen=0;
+    dst->tiled=NULL;
+    if (allocImagePlanes(dst, partitions, halo)) {return NULL;}
+    return dst;
+}
+
+//Convert a color image to luma before reading it: only one plane is kept and convolved,
+//and the result is written as a P2 image. Gray images are not changed.
+int lumaImage(ImagenData img){
+    if (img->channels==1) return 0;
+    if (!img->arena) {
+        free(img->G);
+        free(img->B);
+    }
+    img->G = img->B = NULL;
+    img->channels = 1;
+    return 0;
+}
+
+//Parse n pixels of a PPM/PGM file into the planes, from the pixel first. -1 when the file ends
+//before them or holds something else than numbers.
+static int parsePixels(ImagenData img, FILE *fp, long first, long n){
+    int bytes = (img->maxcolor<256) ? 1 : 2, r, g, b;
+    unsigned char *raw;
+    long i;
+
+    if (img->P==5) {
+        // binary gray, 16 bit samples are big endian
+        if ((raw = (unsigned char *)malloc(n*bytes)) == NULL) return -1;
+        if (fread(raw, bytes, n, fp) != (size_t)n) {
+            free(raw);
+            return -1;
+        }
+        for(i=0;i<n;i++)
+            img->R[first+i] = (bytes==1) ? raw[i] : (raw[2*i]<<8 | raw[2*i+1]);
+        free(raw);
+    }
+    else if (img->P==2) {
+        for(i=first;i<first+n;i++)
+            if (fscanf(fp,"%d ",&img->R[i]) != 1) return -1;
+    }
+    else if (img->channels==1) {
+        // color read as luma (ITU-R BT.601 weights)
+        for(i=first;i<first+n;i++) {
+            if (fscanf(fp,"%d %d %d ",&r,&g,&b) != 3) return -1;
+            img->R[i] = (299*r + 587*g + 114*b + 500)/1000;
+        }
+    }
+    else {
+        for(i=first;i<first+n;i++)
+            if (fscanf(fp,"%d %d %d ",&img->R[i],&img->G[i],&img->B[i]) != 3) return -1;
+    }
+    return 0;
+}
+
+//Skip n pixels of a PPM/PGM file without converting them
+static int skipPixels(ImagenData img, FILE *fp, long n){
+    long tokens = n * ((img->P==3) ? 3 : 1);
+    int c;
+
+    if (img->P==5) {
+        n *= (img->maxcolor<256) ? 1 : 2;
+        // compressed streams can not seek
+        if (fseek(fp, n, SEEK_CUR) == 0) return 0;
+        while (n-- > 0) if (getc(fp) == EOF) return -1;
+        return 0;
+    }
+    while (tokens-- > 0) {
+        do c = getc(fp); while (c == ' ' || c == '\n' || c == '\r' || c == '\t');
+        if (c == EOF) return -1;
+        while (c != EOF && c != ' ' && c != '\n' && c != '\r' && c != '\t') c = getc(fp);
+    }
+    return 0;
+}
+
+//Read the corresponding chunk from the source Image. The halo rows at the end of the chunk are also
+//the first rows of the next one: they are kept in memory, so the file is read once and never seeks back.
+int readImage(ImagenData img, FILE **fp, int dim, int halosize, long *position){
+    int haloposition=0, kept=img->haloLen;
+
+    // halo of the previous chunk
+    if (kept > 0) {
+        memmove(img->R, img->R+img->haloStart, kept*sizeof(int));
+        if (img->channels==3) {
+            memmove(img->G, img->G+img->haloStart, kept*sizeof(int));
+            memmove(img->B, img->B+img->haloStart, kept*sizeof(int));
+        }
+    }
+    haloposition = dim-(img->ancho*halosize*2);
+    if (img->tiled) {
+        // the pixels are read directly from their tiles
+        if (tiledPixels(img, img->tiled->pixel, img->tiled->pixel+dim-kept, kept, 0)) return -1;
+        img->tiled->pixel += dim-kept;
+        fseek(*fp, img->tiled->bytes, SEEK_SET);
+    }
+    else {
+        if (parsePixels(img, *fp, kept, dim-kept)) return -1;
+    }
+    // When the chunk has a halo, keep it for the next chunk
+    img->haloStart = (halosize != 0) ? haloposition : 0;
+    img->haloLen   = (halosize != 0) ? dim-haloposition : 0;
+    *position=ftell(*fp);
+//    printf ("Readed = %d pixels, posicio=%lu\n",dim-kept,*position);
+    return 0;
+}
+
+//Read a region of the image. (x,y,w,h) is the region of interest, it is clipped to the image. The image
+//returned holds it with marginX columns and marginY rows around it (as far as the image goes) and (x,y)
+//is set to the position of the region of interest in it. With luma color images are read as luma.
+//The rows before the region are skipped without converting them; tiled files only read the tiles
+//that cover the region. The file is closed when the function returns.
+ImagenData readImageRegion(char *nombre, int *x, int *y, int *w, int *h, int marginX, int marginY, int luma){
+    FILE *fp;
+    ImagenData img;
+    int x0, y0, x1, y1, row, status=0;
+    long size;
+
+    if ((img = readImageHeader(nombre, &fp)) == NULL) return NULL;
+    if (*x < 0) { *w += *x; *x = 0; }
+    if (*y < 0) { *h += *y; *y = 0; }
+    if (*x + *w > img->ancho) *w = img->ancho - *x;
+    if (*y + *h > img->altura) *h = img->altura - *y;
+    if (*w <= 0 || *h <= 0) {
+        fprintf(stderr,"Error: the region is outside the %dx%d image\n",img->ancho,img->altura);
+        fclose(fp);
+        freeImagestructure(&img);
+        return NULL;
+    }
+    x0 = (*x - marginX > 0) ? *x - marginX : 0;
+    y0 = (*y - marginY > 0) ? *y - marginY : 0;
+    x1 = (*x + *w + marginX < img->ancho) ? *x + *w + marginX : img->ancho;
+    y1 = (*y + *h + marginY < img->altura) ? *y + *h + marginY : img->altura;
+    if (luma) lumaImage(img);
+
+    // planes of the region only
+    size = (long)(x1-x0)*(y1-y0);
+    status = allocPlanes(img, size);
+
+    if (!status && img->tiled) {
+        for (row=y0; row<y1 && !status; row++)
+            status = tiledSpan(img, row, x0, x1, (long)(row-y0)*(x1-x0), 0);
+    }
+    else if (!status) {
+        status = skipPixels(img, fp, (long)y0*img->ancho);
+        for (row=y0; row<y1 && !status; row++) {
+            status = skipPixels(img, fp, x0) || parsePixels(img, fp, (long)(row-y0)*(x1-x0), x1-x0);
+            // the rest of the last row is not needed
+            if (!status && row < y1-1) status = skipPixels(img, fp, img->ancho-x1);
+        }
+    }
+    fclose(fp);
+    freeTiled(img->tiled);
+    img->tiled = NULL;
+    img->ancho = x1-x0;
+    img->altura = y1-y0;
+    *x -= x0;
+    *y -= y0;
+    if (status) {
+        fprintf(stderr,"Error: can not read the region of %s\n",nombre);
+        freeImagestructure(&img);
+        return NULL;
+    }
+    return img;
+}
+
+//Keep only the w x h pixels at (x,y) of the image, the planes are compacted in place
+int cropImage(ImagenData img, int x, int y, int w, int h){
+    int row, c;
+    int *plane[3] = {img->R, img->G, img->B};
+
+    if (x < 0 || y < 0 || w <= 0 || h <= 0 || x+w > img->ancho || y+h > img->altura) return -1;
+    for (c=0; c<img->channels; c++)
+        for (row=0; row<h; row++)
+            memmove(plane[c] + (long)row*w, plane[c] + (long)(y+row)*img->ancho + x, w*sizeof(int));
+    img->ancho = w;
+    img->altura = h;
+    return 0;
+}
+
+//Duplication of the  just readed source chunk to the destiny image struct chunk
+int duplicateImageChunk(ImagenData src, ImagenData dst, int dim){
+    int i=0;
+    
+    for(i=0;i<dim;i++){
+        dst->R[i] = src->R[i];
+    }
+    if (src->channels==3 && dst->channels==3) {
+        for(i=0;i<dim;i++){
+            dst->G[i] = src->G[i];
+            dst->B[i] = src->B[i];
+        }
+    }
+//    printf ("Duplicated = %d pixels\n",i);
+    return 0;
+}
+
+// Open kernel file and reading kernel matrix. The kernel matrix 2D is stored in 1D format.
+kernelData leerKernel(char* nombre){
+    FILE *fp;
+    int i=0, kernelX=0, kernelY=0;
+    float *vkern;
+    kernelData kern=NULL;
+    
+    /*Opening the kernel file*/
+    fp=fopen(nombre,"r");
+    if(!fp){
+        perror("Error: ");
+    }
+    else{
+        //Reading kernel matrix dimensions
+        fscanf(fp,"%d,%d,", &kernelX, &kernelY);
+        if (kernelX <= 0 || kernelY <= 0 || (vkern = (float *)malloc(kernelX*kernelY*sizeof(float))) == NULL) {
+            fclose(fp);
+            return NULL;
+        }
+        
+        // Reading kernel matrix values
+        for (i=0;i<(kernelX*kernelY)-1;i++){
+            fscanf(fp,"%f,",&vkern[i]);
+        }
+        fscanf(fp,"%f",&vkern[i]);
+        fclose(fp);
+        kern = newKernel(kernelX, kernelY, vkern);
+        free(vkern);
+        if (!kern) perror("Error: ");
+    }
+    return kern;
+}
+
+// Kernel from a kernelX x kernelY matrix stored by rows. The values are copied.
+kernelData newKernel(int kernelX, int kernelY, const float *values){
+    kernelData kern;
+
+    if(kernelX <= 0 || kernelY <= 0 || !values) return NULL;
+    if((kern = (kernelData) calloc(1, sizeof(struct structkernel))) == NULL) return NULL;
+    kern->kernelX = kernelX;
+    kern->kernelY = kernelY;
+    if((kern->vkern = (float *)malloc(kernelX*kernelY*sizeof(float))) == NULL){
+        free(kern);
+        return NULL;
+    }
+    memcpy(kern->vkern, values, kernelX*kernelY*sizeof(float));
+    // Nonzero taps, properties and default engine for this kernel
+    if(analyzeKernel(kern)){
+        freeKernel(kern);
+        return NULL;
+    }
+    return kern;
+}
+
+void freeKernel(kernelData kern){
+    if(!kern) return;
+    free(kern->vkern);
+    free(kern->taps);
+    free(kern->group);
+    free(kern->boxes);
+    free(kern);
+}
+
+// Open the image file with the convolution results
+int initfilestore(ImagenData img, FILE **fp, char* nombre, long *position){
+    size_t len = strlen(nombre);
+
+    /*Se crea el fichero con la imagen resultante*/
+    if ( (*fp=openImageFile(nombre,"w")) == NULL ){
+        // the callers report errno as well, perror may change it
+        int error=errno;
+        perror("Error: ");
+        errno=error;
+        return -1;
+    }
+    /*Tiled images are written by tiles*/
+    if (len > strlen(TILED_SUFFIX) && strcmp(nombre+len-strlen(TILED_SUFFIX), TILED_SUFFIX) == 0) {
+        if (writeTiledHeader(img, *fp)) {
+            perror("Error: ");
+            return -1;
+        }
+        fseek(*fp, img->tiled->bytes, SEEK_SET);
+        *position = ftell(*fp);
+        return 0;
+    }
+    /*Writing Image Header*/
+    fprintf(*fp,"P%d\n%s\n%d %d\n%d\n",img->P,img->comentario,img->ancho,img->altura,img->maxcolor);
+    *position = ftell(*fp);
+    return 0;
+}
+
+// Writing the image partition to the resulting file. dim is the exact size to write. offset is the displacement for avoid halos.
+int savingChunk(ImagenData img, FILE **fp, int dim, int offset){
+    int i,k=0,v;
+    //Writing image partition
+    if (img->tiled) {
+        if (tiledPixels(img, img->tiled->pixel, img->tiled->pixel+dim, offset, 1)) return -1;
+        img->tiled->pixel += dim;
+        fseek(*fp, img->tiled->bytes, SEEK_SET);
+        return 0;
+    }
+    if (img->P==5) {
+        // binary samples have to fit in 0..maxcolor
+        for(i=offset;i<dim+offset;i++){
+            v = img->R[i] < 0 ? 0 : (img->R[i] > img->maxcolor ? img->maxcolor : img->R[i]);
+            if (img->maxcolor>=256) fputc(v>>8,*fp);
+            fputc(v&0xff,*fp);
+            k++;
+        }
+        return 0;
+    }
+    for(i=offset;i<dim+offset;i++){
+        if (img->channels==1) fprintf(*fp,"%d ",img->R[i]);
+        else fprintf(*fp,"%d %d %d ",img->R[i],img->G[i],img->B[i]);
+//        if ((i+1)%6==0) fprintf(*fp,"\n");
+        k++;
+    }
+//    printf ("Writed = %d pixels, dim=%d, offset=%d\n",k,dim, offset);
+    return 0;
+}
+
+// This function free the space allocated for the image structure.
+void freeImagestructure(ImagenData *src){
+    
+    freeTiled((*src)->tiled);
+    free((*src)->comentario);
+    if (!(*src)->arena) {
+        free((*src)->R);
+        free((*src)->G);
+        free((*src)->B);
+    }
+    
+    free(*src);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// 2D convolution
+// 2D data are usually stored in computer memory as contiguous 1D array.
+// So, we are using 1D array for 2D data.
+// 2D convolution assumes the kernel is center originated, which means, if
+// kernel size 3 then, k[-1], k[0], k[1]. The middle of index is always 0.
+// The following programming logics are somewhat complicated because of using
+// pointer indexing in order to minimize the number of multiplications.
+//
+//
+// signed integer (32bit) version:
+///////////////////////////////////////////////////////////////////////////////
+// convolve2D(source->R, output->R, source->ancho, (source->altura/partitions)+halosize, kern->vkern, kern->kernelX, kern->kernelY);
+int convolve2D(int* in, int* out, int dataSizeX, int dataSizeY,
+               float* kernel, int kernelSizeX, int kernelSizeY)
+{
+    return convolve2DRows(in, out, dataSizeX, dataSizeY, 0, dataSizeY, kernel, kernelSizeX, kernelSizeY);
+}
+
+// Only the rows rowBegin..rowEnd-1 of the output, so the rows can be shared among threads.
+int convolve2DRows(int* in, int* out, int dataSizeX, int dataSizeY, int rowBegin, int rowEnd,
+                   float* kernel, int kernelSizeX, int kernelSizeY)
+{
+    int i, j, m, n;
+    int *inPtr, *inPtr2, *outPtr;
+    float *kPtr;
+    int kCenterX, kCenterY;
+    int rowMin, rowMax;                             // to check boundary of input array
+    int colMin, colMax;                             //
+    float sum;                                      // temp accumulation buffer
+    
+    // check validity of params
+    if(!in || !out || !kernel) return -1;
+    if(dataSizeX <= 0 || kernelSizeX <= 0) return -1;
+    
+    // find center position of kernel (half of kernel size)
+    kCenterX = (int)kernelSizeX / 2;
+    kCenterY = (int)kernelSizeY / 2;
+    
+    // init working  pointers
+    inPtr = inPtr2 = &in[dataSizeX * (kCenterY + rowBegin) + kCenterX];  // note that  it is shifted (kCenterX, kCenterY),
+    outPtr = &out[dataSizeX * rowBegin];
+    kPtr = kernel;
+    
+    // start convolution
+
+    for(i= rowBegin; i < rowEnd; ++i)               // number of rows
+    {
+        // compute the range of convolution, the current row of kernel should be between these
+        rowMax = i + kCenterY;
+        rowMin = i - dataSizeY + kCenterY;
+
+        for(j = 0; j < dataSizeX; ++j)              // number of columns
+        {
+            // compute the range of convolution, the current column of kernel should be between these
+            colMax = j + kCenterX;
+            colMin = j - dataSizeX + kCenterX;
+            
+            sum = 0;                                // set to 0 before accumulate
+            
+            // flip the kernel and traverse all the kernel values
+            // multiply each kernel value with underlying input data
+            
+            for(m = 0; m < kernelSizeY; ++m)        // kernel rows
+            {
+                // check if the index is out of bound of input array
+                if(m <= rowMax && m > rowMin)
+                {
+                    for(n = 0; n < kernelSizeX; ++n)
+                    {
+                        // check the boundary of array
+                        if(n <= colMax && n > colMin)
+                            sum += *(inPtr - n) * *kPtr;
+                        
+                        ++kPtr;                     // next kernel
+                    }
+                }
+                else
+                    kPtr += kernelSizeX;            // out of bound, move to next row of kernel
+                
+                inPtr -= dataSizeX;                 // move input data 1 raw up
+            }
+            
+            // convert integer number
+            if(sum >= 0) *outPtr = (int)(sum + 0.5f);
+//            else *outPtr = (int)(sum - 0.5f)*(-1);
+            // For using with image editors like GIMP or others...
+            else *outPtr = (int)(sum - 0.5f);
+            // For using with a text editor that read ppm images like libreoffice or others...
+//            else *outPtr = 0;
+            
+            kPtr = kernel;                          // reset kernel to (0,0)
+            inPtr = ++inPtr2;                       // next input
+            ++outPtr;                               // next output
+        }
+    }
+    
+    return 0;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Fixed-size convolution engines
+// Most kernels are small and odd sized (3x3, 5x5 ...). convolve2DFixed is
+// always inlined into one wrapper per size, so kernelSizeX/kernelSizeY are
+// compile-time constants there: the tap loops are fully unrolled and the
+// kernel offsets are folded into the code. Only the pixels near the border
+// need the bounds checks, they are computed by convolvePoint.
+// The taps are accumulated in the same order as convolve2D, so the results
+// are identical to the generic engine.
+// The image is processed in column strips of tileX pixels (whole rows when
+// tileX is 0), so the kernel rows of a strip stay in cache for big kernels.
+///////////////////////////////////////////////////////////////////////////////
+
+// Bounds-checked convolution of a single pixel (i,j). Out of image taps count as zero.
+static float convolvePoint(int* in, int dataSizeX, int dataSizeY,
+                           float* kernel, int kernelSizeX, int kernelSizeY, int i, int j)
+{
+    int m, n, row, col;
+    float sum = 0;
+
+    for(m = 0; m < kernelSizeY; ++m)
+    {
+        row = i + kernelSizeY/2 - m;
+        if(row < 0 || row >= dataSizeY) continue;
+        for(n = 0; n < kernelSizeX; ++n)
+        {
+            col = j + kernelSizeX/2 - n;
+            if(col >= 0 && col < dataSizeX)
+                sum += in[row*dataSizeX + col] * kernel[m*kernelSizeX + n];
+        }
+    }
+    return sum;
+}
+
+// Convolution of the pixel (y,x) in the order of convolve2D. Inside the image the window is
+// walked from its bottom right corner without bounds checks.
+static inline float convolveSample(int* in, int dataSizeX, int dataSizeY, kernelData kern, int y, int x)
+{
+    int m, n;
+    int kSizeX = kern->kernelX, kSizeY = kern->kernelY;
+    int kCenterX = kSizeX / 2, kCenterY = kSizeY / 2;
+    int *inPtr;
+    float *kPtr = kern->vkern, sum = 0;
+
+    if(y < kCenterY || y + kCenterY >= dataSizeY || x < kCenterX || x + kCenterX >= dataSizeX)
+        return convolvePoint(in, dataSizeX, dataSizeY, kern->vkern, kSizeX, kSizeY, y, x);
+    for(m = 0; m < kSizeY; ++m)
+    {
+        inPtr = &in[(long)dataSizeX * (y + kCenterY - m) + x + kCenterX];
+        for(n = 0; n < kSizeX; ++n)
+            sum += *(inPtr - n) * *kPtr++;
+    }
+    return sum;
+}
+
+// Decimated convolution: the output pixel (i,j) is the convolution of the input at
+// (firstRow + stride*i, stride*j), for the output rows rowBegin..rowEnd-1 of outSizeX pixels.
+// Only those samples are computed. The taps are accumulated in the order of convolve2D, so
+// every sample equals the pixel of the full convolution.
+int convolve2DStrided(int* in, int* out, int dataSizeX, int dataSizeY, int firstRow, int stride,
+                      int outSizeX, int rowBegin, int rowEnd, kernelData kern)
+{
+    int i, j;
+    int *outPtr;
+    float sum;
+
+    if(!in || !out || !kern || stride < 1 || outSizeX > (dataSizeX + stride - 1)/stride) return -1;
+
+    for(i = rowBegin; i < rowEnd; i++)
+    {
+        outPtr = &out[(long)outSizeX * i];
+        for(j = 0; j < outSizeX; j++)
+        {
+            sum = convolveSample(in, dataSizeX, dataSizeY, kern, firstRow + stride*i, stride*j);
+            if(sum >= 0) *outPtr++ = (int)(sum + 0.5f);
+            else *outPtr++ = (int)(sum - 0.5f);
+        }
+    }
+    return 0;
+}
+
+static inline __attribute__((always_inline))
+int convolve2DFixed(int* in, int* out, int dataSizeX, int dataSizeY, int rowBegin, int rowEnd,
+                    float* kernel, const int kernelSizeX, const int kernelSizeY, int tileX)
+{
+    int i, j, m, n, x0, x1;
+    int *inPtr;
+    float sum;
+    const int kCenterX = kernelSizeX / 2;
+    const int kCenterY = kernelSizeY / 2;
+
+    // check validity of params
+    if(!in || !out || !kernel) return -1;
+    if(dataSizeX <= 0) return -1;
+    if(tileX <= 0) tileX = dataSizeX;
+
+    for(x0 = 0; x0 < dataSizeX; x0 += tileX)       // column strips
+    {
+        x1 = (x0 + tileX < dataSizeX) ? x0 + tileX : dataSizeX;
+
+        for(i = rowBegin; i < rowEnd; ++i)          // number of rows
+        {
+            // rows close to the top and bottom border: every pixel needs the bounds check
+            if(i < kCenterY || i >= dataSizeY - kCenterY)
+            {
+                for(j = x0; j < x1; ++j)
+                {
+                    sum = convolvePoint(in, dataSizeX, dataSizeY, kernel, kernelSizeX, kernelSizeY, i, j);
+                    if(sum >= 0) out[i*dataSizeX + j] = (int)(sum + 0.5f);
+                    else out[i*dataSizeX + j] = (int)(sum - 0.5f);
+                }
+                continue;
+            }
+
+            // left border
+            for(j = x0; j < x1 && j < kCenterX; ++j)
+            {
+                sum = convolvePoint(in, dataSizeX, dataSizeY, kernel, kernelSizeX, kernelSizeY, i, j);
+                if(sum >= 0) out[i*dataSizeX + j] = (int)(sum + 0.5f);
+                else out[i*dataSizeX + j] = (int)(sum - 0.5f);
+            }
+
+            // inner part of the row, every tap is inside the image
+            for(; j < x1 && j < dataSizeX - kCenterX; ++j)
+            {
+                inPtr = &in[(i + kCenterY) * dataSizeX + j + kCenterX];
+                sum = 0;
+                #pragma GCC unroll 9
+                for(m = 0; m < kernelSizeY; ++m)
+                {
+                    #pragma GCC unroll 9
+                    for(n = 0; n < kernelSizeX; ++n)
+                        sum += inPtr[-m*dataSizeX - n] * kernel[m*kernelSizeX + n];
+                }
+                if(sum >= 0) out[i*dataSizeX + j] = (int)(sum + 0.5f);
+                else out[i*dataSizeX + j] = (int)(sum - 0.5f);
+            }
+
+            // right border
+            for(; j < x1; ++j)
+            {
+                sum = convolvePoint(in, dataSizeX, dataSizeY, kernel, kernelSizeX, kernelSizeY, i, j);
+                if(sum >= 0) out[i*dataSizeX + j] = (int)(sum + 0.5f);
+                else out[i*dataSizeX + j] = (int)(sum - 0.5f);
+            }
+        }
+    }
+
+    return 0;
+}
+
+// One instance per supported kernel size.
+static int convolve2D_3x3(int* in, int* out, int dataSizeX, int dataSizeY, int rowBegin, int rowEnd, kernelData kern)
+{
+    return convolve2DFixed(in, out, dataSizeX, dataSizeY, rowBegin, rowEnd, kern->vkern, 3, 3, kern->tileX);
+}
+
+static int convolve2D_5x5(int* in, int* out, int dataSizeX, int dataSizeY, int rowBegin, int rowEnd, kernelData kern)
+{
+    return convolve2DFixed(in, out, dataSizeX, dataSizeY, rowBegin, rowEnd, kern->vkern, 5, 5, kern->tileX);
+}
+
+static int convolve2D_7x7(int* in, int* out, int dataSizeX, int dataSizeY, int rowBegin, int rowEnd, kernelData kern)
+{
+    return convolve2DFixed(in, out, dataSizeX, dataSizeY, rowBegin, rowEnd, kern->vkern, 7, 7, kern->tileX);
+}
+
+static int convolve2D_9x9(int* in, int* out, int dataSizeX, int dataSizeY, int rowBegin, int rowEnd, kernelData kern)
+{
+    return convolve2DFixed(in, out, dataSizeX, dataSizeY, rowBegin, rowEnd, kern->vkern, 9, 9, kern->tileX);
+}
+
+// Same loops with the kernel size known only at run time: any kernel size, no bounds checks
+// in the inner part of the image.
+static int convolve2D_split(int* in, int* out, int dataSizeX, int dataSizeY, int rowBegin, int rowEnd, kernelData kern)
+{
+    return convolve2DFixed(in, out, dataSizeX, dataSizeY, rowBegin, rowEnd, kern->vkern, kern->kernelX, kern->kernelY, kern->tileX);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Sparse-tap convolution engine
+// Kernels like Edge or Sharpen are mostly zeros. buildKernelTaps keeps only
+// the nonzero coefficients as (row offset, column offset, weight) taps and
+// groups the taps that share a weight, so every group costs one multiply:
+//   sum += weight * (in[tap0] + in[tap1] + ...)
+// The pixels of a group are added as integers, which is exact. When at least
+// SPARSE_THRESHOLD of an integer kernel is zero the sparse engine is used; with
+// other weights the grouped products round differently from convolve2D.
+///////////////////////////////////////////////////////////////////////////////
+#define SPARSE_THRESHOLD 0.5f
+
+static int compareTaps(const void *a, const void *b){
+    const struct structtap *ta = (const struct structtap *)a;
+    const struct structtap *tb = (const struct structtap *)b;
+
+    if(ta->weight < tb->weight) return -1;
+    if(ta->weight > tb->weight) return 1;
+    // keep the kernel order inside a group
+    if(ta->dy != tb->dy) return tb->dy - ta->dy;
+    return tb->dx - ta->dx;
+}
+
+// Build the list of nonzero taps of the kernel grouped by weight.
+int buildKernelTaps(kernelData kern){
+    int m, n, t;
+    int kCenterX = kern->kernelX / 2;
+    int kCenterY = kern->kernelY / 2;
+    float w;
+
+    kern->ntaps = 0;
+    kern->ngroups = 0;
+    kern->taps = (struct structtap *)malloc(kern->kernelX*kern->kernelY*sizeof(struct structtap));
+    kern->group = (int *)malloc((kern->kernelX*kern->kernelY+1)*sizeof(int));
+    if(!kern->taps || !kern->group) return -1;
+
+    for(m = 0; m < kern->kernelY; m++){
+        for(n = 0; n < kern->kernelX; n++){
+            w = kern->vkern[m*kern->kernelX + n];
+            if(w == 0) continue;
+            // kernel is flipped: tap (m,n) reads the pixel (i+kCenterY-m, j+kCenterX-n)
+            kern->taps[kern->ntaps].dy = kCenterY - m;
+            kern->taps[kern->ntaps].dx = kCenterX - n;
+            kern->taps[kern->ntaps].weight = w;
+            kern->ntaps++;
+        }
+    }
+    qsort(kern->taps, kern->ntaps, sizeof(struct structtap), compareTaps);
+
+    for(t = 0; t < kern->ntaps; t++){
+        if(t == 0 || kern->taps[t].weight != kern->taps[t-1].weight)
+            kern->group[kern->ngroups++] = t;
+    }
+    kern->group[kern->ngroups] = kern->ntaps;
+    return 0;
+}
+
+// Sparse engine: only the nonzero taps are visited.
+static int convolve2D_sparse(int* in, int* out, int dataSizeX, int dataSizeY, int rowBegin, int rowEnd, kernelData kern)
+{
+    int i, j, g, t, row, col, acc, x0, x1;
+    int *offset, *inPtr;
+    int kCenterX = kern->kernelX / 2;
+    int kCenterY = kern->kernelY / 2;
+    int tileX = (kern->tileX > 0) ? kern->tileX : dataSizeX;
+    struct structtap *taps = kern->taps;
+    float sum;
+
+    // check validity of params
+    if(!in || !out || !taps) return -1;
+    if(dataSizeX <= 0) return -1;
+
+    // linear offset of every tap for this row width
+    if((offset = (int *)malloc((kern->ntaps+1)*sizeof(int))) == NULL) return -1;
+    for(t = 0; t < kern->ntaps; t++)
+        offset[t] = taps[t].dy*dataSizeX + taps[t].dx;
+
+    for(x0 = 0; x0 < dataSizeX; x0 += tileX)       // column strips
+    {
+        x1 = (x0 + tileX < dataSizeX) ? x0 + tileX : dataSizeX;
+
+        for(i = rowBegin; i < rowEnd; ++i)          // number of rows
+        {
+            for(j = x0; j < x1; ++j)                // columns of the strip
+            {
+                sum = 0;
+                if(i >= kCenterY && i < dataSizeY - kCenterY && j >= kCenterX && j < dataSizeX - kCenterX)
+                {
+                    // every tap is inside the image
+                    inPtr = &in[i*dataSizeX + j];
+                    for(g = 0; g < kern->ngroups; g++)
+                    {
+                        acc = 0;
+                        for(t = kern->group[g]; t < kern->group[g+1]; t++)
+                            acc += inPtr[offset[t]];
+                        sum += acc * taps[kern->group[g]].weight;
+                    }
+                }
+                else
+                {
+                    // near the border, out of image taps count as zero
+                    for(g = 0; g < kern->ngroups; g++)
+                    {
+                        acc = 0;
+                        for(t = kern->group[g]; t < kern->group[g+1]; t++)
+                        {
+                            row = i + taps[t].dy;
+                            col = j + taps[t].dx;
+                            if(row >= 0 && row < dataSizeY && col >= 0 && col < dataSizeX)
+                                acc += in[row*dataSizeX + col];
+                        }
+                        sum += acc * taps[kern->group[g]].weight;
+                    }
+                }
+                // convert integer number
+                if(sum >= 0) out[i*dataSizeX + j] = (int)(sum + 0.5f);
+                else out[i*dataSizeX + j] = (int)(sum - 0.5f);
+            }
+        }
+    }
+
+    free(offset);
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Box engine
+// Mean and box kernels, and kernels made of a few nested or adjacent constant
+// rectangles, are decomposed by buildKernelBoxes into at most BOX_MAX boxes
+// (rectangle + weight). The engine builds the integral image of the rows of
+// its band, so every box costs four lookups whatever the kernel size:
+//   sum += weight * (S[b][d] - S[a][d] - S[b][c] + S[a][c])
+// Box sums are exact 64-bit integers; with integer weights the whole result
+// is computed in integers.
+///////////////////////////////////////////////////////////////////////////////
+#define BOX_MAX         8   // boxes of a decomposition
+#define BOX_MIN_TAPS    16  // smaller kernels are left to the other engines
+
+// Decompose the kernel into constant rectangles: the first nonzero coefficient (in row order)
+// starts the largest rectangle of coefficients of its sign, which gets the smallest of them;
+// that weight is removed and the rest is decomposed again. nboxes is 0 when it needs more than
+// BOX_MAX boxes.
+int buildKernelBoxes(kernelData kern){
+    int kx = kern->kernelX, ky = kern->kernelY, i, m, n, m0, n0, m1, n1, run;
+    int kCenterX = kx / 2, kCenterY = ky / 2;
+    float *rest, w;
+
+    free(kern->boxes);
+    kern->nboxes = 0;
+    if((kern->boxes = (struct structbox *)malloc(BOX_MAX*sizeof(struct structbox))) == NULL) return -1;
+    if((rest = (float *)malloc(kx*ky*sizeof(float))) == NULL) return -1;
+    memcpy(rest, kern->vkern, kx*ky*sizeof(float));
+
+    for(i = 0; i < kx*ky && kern->nboxes < BOX_MAX; ){
+        if(rest[i] == 0){
+            i++;
+            continue;
+        }
+        m0 = i / kx;
+        n0 = i % kx;
+        w = rest[i];
+        if(!(w*w > 0)) break;                       // NaN
+        // widest run of the row, then every row below that has the run
+        for(n1 = n0; n1+1 < kx && rest[m0*kx + n1+1]*w > 0; n1++);
+        for(m1 = m0, run = 1; m1+1 < ky && run; ){
+            for(n = n0; n <= n1 && run; n++) run = rest[(m1+1)*kx + n]*w > 0;
+            if(run) m1++;
+        }
+        for(m = m0; m <= m1; m++)
+            for(n = n0; n <= n1; n++)
+                if(fabsf(rest[m*kx + n]) < fabsf(w)) w = rest[m*kx + n];
+        for(m = m0; m <= m1; m++)
+            for(n = n0; n <= n1; n++) rest[m*kx + n] -= w;
+        // kernel is flipped: the coefficient (m,n) reads the pixel (i+kCenterY-m, j+kCenterX-n)
+        kern->boxes[kern->nboxes].dy0 = kCenterY - m1;
+        kern->boxes[kern->nboxes].dy1 = kCenterY - m0;
+        kern->boxes[kern->nboxes].dx0 = kCenterX - n1;
+        kern->boxes[kern->nboxes].dx1 = kCenterX - n0;
+        kern->boxes[kern->nboxes].weight = w;
+        kern->nboxes++;
+    }
+    for(; i < kx*ky && rest[i] == 0; i++);
+    if(i < kx*ky) kern->nboxes = 0;
+    free(rest);
+    return 0;
+}
+
+// Box engine: integral image of the rows that the band reads, four lookups per box.
+static int convolve2D_box(int* in, int* out, int dataSizeX, int dataSizeY, int rowBegin, int rowEnd, kernelData kern)
+{
+    int i, j, b, first, last, r0, r1, c0, c1;
+    int up = 0, down = 0, stride = dataSizeX + 1;
+    long long *sat, *row, rowSum, box, isum;
+    struct structbox *boxes = kern->boxes;
+    double sum;
+
+    if(!in || !out || !boxes || kern->nboxes <= 0) return -1;
+    for(b = 0; b < kern->nboxes; b++){
+        if(-boxes[b].dy0 > up) up = -boxes[b].dy0;
+        if(boxes[b].dy1 > down) down = boxes[b].dy1;
+    }
+    first = (rowBegin - up > 0) ? rowBegin - up : 0;
+    last = (rowEnd + down < dataSizeY) ? rowEnd + down : dataSizeY;
+
+    // sat[(r-first)*stride + c] = sum of the pixels of rows first..r-1 and columns 0..c-1
+    if((sat = (long long *)malloc((long)(last - first + 1)*stride*sizeof(long long))) == NULL) return -1;
+    memset(sat, 0, stride*sizeof(long long));
+    for(i = first; i < last; i++){
+        row = sat + (long)(i - first + 1)*stride;
+        row[0] = 0;
+        rowSum = 0;
+        for(j = 0; j < dataSizeX; j++){
+            rowSum += in[(long)i*dataSizeX + j];
+            row[j+1] = row[j+1 - stride] + rowSum;
+        }
+    }
+
+    for(i = rowBegin; i < rowEnd; i++){
+        for(j = 0; j < dataSizeX; j++){
+            sum = 0;
+            isum = 0;
+            for(b = 0; b < kern->nboxes; b++){
+                // the box clipped to the image: rows [r0,r1) and columns [c0,c1)
+                r0 = i + boxes[b].dy0;     if(r0 < first) r0 = first;
+                r1 = i + boxes[b].dy1 + 1; if(r1 > last) r1 = last;
+                c0 = j + boxes[b].dx0;     if(c0 < 0) c0 = 0;
+                c1 = j + boxes[b].dx1 + 1; if(c1 > dataSizeX) c1 = dataSizeX;
+                if(r0 >= r1 || c0 >= c1) continue;
+                box = sat[(long)(r1-first)*stride + c1] - sat[(long)(r0-first)*stride + c1]
+                    - sat[(long)(r1-first)*stride + c0] + sat[(long)(r0-first)*stride + c0];
+                if(kern->integral) isum += (long long)boxes[b].weight * box;
+                else sum += (double)boxes[b].weight * box;
+            }
+            if(kern->integral) out[(long)i*dataSizeX + j] = (int)isum;
+            else if(sum >= 0) out[(long)i*dataSizeX + j] = (int)(sum + 0.5);
+            else out[(long)i*dataSizeX + j] = (int)(sum - 0.5);
+        }
+    }
+    free(sat);
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Winograd engines
+// Minimal filtering for 3x3 kernels: F(2x2,3x3) computes a 2x2 output tile
+// from a 4x4 input tile with 16 multiplies (4 per pixel instead of 9), and
+// F(4x4,3x3) a 4x4 tile from a 6x6 one with 36 (2.25 per pixel):
+//   Y = AT [ (G g GT) . (BT d B) ] A
+// g is the flipped kernel; its transform is made once by setEngine. The
+// transforms of B and A only add and scale; they are applied to a whole row
+// of tiles at a time, one tile per vector lane.
+// Winograd rounds differently from convolve2D: the pixels whose value falls
+// within the error bound of a .5 are convolved directly, so the rounding to
+// int is the one of convolve2D. The planner also checks the result against
+// convolve2D before it chooses these engines.
+///////////////////////////////////////////////////////////////////////////////
+#define WINOGRAD_ERROR2 1e-6f   // error bound of F(2x2,3x3), relative to sum|k| * max|pixel|
+#define WINOGRAD_ERROR4 1e-5f   // error bound of F(4x4,3x3)
+
+// Kernel transform U = G g GT (alpha x alpha, alpha = tile + 2) of the flipped kernel, in double.
+static void winogradKernel(kernelData kern, int tile){
+    static const double G2[4][3] = {{1,0,0}, {0.5,0.5,0.5}, {0.5,-0.5,0.5}, {0,0,1}};
+    static const double G4[6][3] = {{1.0/4,0,0}, {-1.0/6,-1.0/6,-1.0/6}, {-1.0/6,1.0/6,-1.0/6},
+                                    {1.0/24,1.0/12,1.0/6}, {1.0/24,-1.0/12,1.0/6}, {0,0,1}};
+    int alpha = tile + 2, a, b, m, n;
+    double g, u;
+
+    for(a = 0; a < alpha; a++)
+        for(b = 0; b < alpha; b++){
+            u = 0;
+            for(m = 0; m < 3; m++)
+                for(n = 0; n < 3; n++){
+                    g = kern->vkern[(2-m)*3 + (2-n)];
+                    u += (tile == 2 ? G2[a][m]*G2[b][n] : G4[a][m]*G4[b][n]) * g;
+                }
+            kern->winograd[a*alpha + b] = (float)u;
+        }
+}
+
+// 1D input transforms BT d of T lanes: element k of lane t is d[k*sd + t*ld], it goes to v[k*sv + t*lv]
+static inline void winogradIn2(const float *d, long sd, int ld, float *v, long sv, int lv, int T){
+    int t;
+    for(t = 0; t < T; t++){
+        float d0 = d[t*ld], d1 = d[sd+t*ld], d2 = d[2*sd+t*ld], d3 = d[3*sd+t*ld];
+        v[t*lv]      = d0 - d2;
+        v[sv+t*lv]   = d1 + d2;
+        v[2*sv+t*lv] = d2 - d1;
+        v[3*sv+t*lv] = d1 - d3;
+    }
+}
+
+static inline void winogradIn4(const float *d, long sd, int ld, float *v, long sv, int lv, int T){
+    int t;
+    for(t = 0; t < T; t++){
+        float d0 = d[t*ld], d1 = d[sd+t*ld], d2 = d[2*sd+t*ld], d3 = d[3*sd+t*ld], d4 = d[4*sd+t*ld], d5 = d[5*sd+t*ld];
+        v[t*lv]      = 4*d0 - 5*d2 + d4;
+        v[sv+t*lv]   = d3 + d4 - 4*(d1 + d2);
+        v[2*sv+t*lv] = d4 - d3 + 4*(d1 - d2);
+        v[3*sv+t*lv] = d4 - d2 + 2*(d3 - d1);
+        v[4*sv+t*lv] = d4 - d2 + 2*(d1 - d3);
+        v[5*sv+t*lv] = 4*d1 - 5*d3 + d5;
+    }
+}
+
+// 1D output transforms AT m of T lanes, with the same strides
+static inline void winogradOut2(const float *m, long sm, int lm, float *y, long sy, int ly, int T){
+    int t;
+    for(t = 0; t < T; t++){
+        float m0 = m[t*lm], m1 = m[sm+t*lm], m2 = m[2*sm+t*lm], m3 = m[3*sm+t*lm];
+        y[t*ly]    = m0 + m1 + m2;
+        y[sy+t*ly] = m1 - m2 - m3;
+    }
+}
+
+static inline void winogradOut4(const float *m, long sm, int lm, float *y, long sy, int ly, int T){
+    int t;
+    for(t = 0; t < T; t++){
+        float m0 = m[t*lm], m1 = m[sm+t*lm], m2 = m[2*sm+t*lm], m3 = m[3*sm+t*lm], m4 = m[4*sm+t*lm], m5 = m[5*sm+t*lm];
+        float a = m1 + m2, b = m1 - m2, c = m3 + m4, e = m3 - m4;
+        y[t*ly]      = m0 + a + c;
+        y[sy+t*ly]   = b + 2*e;
+        y[2*sy+t*ly] = a + 4*c;
+        y[3*sy+t*ly] = b + 8*e + m5;
+    }
+}
+
+// Round v as convolve2D does, unless it is too close to a .5 to trust: then convolve (i,j) directly.
+static inline int winogradRound(float v, float bound, int* in, int dataSizeX, int dataSizeY, kernelData kern, int i, int j){
+    float f = fabsf(v - (float)(int)v);         // distance to the integer towards zero
+
+    if(fabsf(f - 0.5f) <= bound)
+        v = convolveSample(in, dataSizeX, dataSizeY, kern, i, j);
+    return (v >= 0) ? (int)(v + 0.5f) : (int)(v - 0.5f);
+}
+
+// Winograd engine with output tiles of tile x tile pixels (2 or 4). Always inlined into one
+// wrapper per tile size, so the transforms are specialized. A row of tiles is transformed at
+// once: the vertical transforms run along whole rows, the horizontal ones have a tile per lane.
+static inline __attribute__((always_inline))
+int convolve2D_winograd(int* in, int* out, int dataSizeX, int dataSizeY, int rowBegin, int rowEnd,
+                        kernelData kern, const int tile)
+{
+    const int alpha = tile + 2;
+    int i, j, a, T, r0, r1, c1, y0;
+    long W = dataSizeX;
+    float *rows, *vert, *v, *hor, *res, bound, kabs = 0;
+    int *near;
+    long peak = 0;
+
+    if(!in || !out || kern->kernelX != 3 || kern->kernelY != 3) return -1;
+
+    // tiles cover the rows and columns whose window is inside the image
+    r0 = (rowBegin > 1) ? rowBegin : 1;
+    r1 = r0 + (((rowEnd < dataSizeY - 1) ? rowEnd : dataSizeY - 1) - r0) / tile * tile;
+    T = (dataSizeX - 2) / tile;
+    c1 = 1 + T*tile;
+    if(r1 < r0) r1 = r0;
+    if(T < 0) T = 0, c1 = 1;
+
+    // alpha input rows, their vertical transform, the tiles (alpha x alpha x T), the horizontal
+    // output transform (alpha rows) and the result rows
+    if((rows = (float *)malloc((3*alpha*W + alpha*alpha*(long)(T+1) + tile*W)*sizeof(float))) == NULL) return -1;
+    if((near = (int *)malloc(W*sizeof(int))) == NULL){
+        free(rows);
+        return -1;
+    }
+    vert = rows + alpha*W;
+    hor = vert + alpha*W;
+    res = hor + alpha*W;
+    v = res + tile*W;
+
+    // error bound of the band: the sums are at most sum|k| * max|pixel|
+    for(a = 0; a < 9; a++) kabs += fabsf(kern->vkern[a]);
+    for(i = r0 - 1; i < r1 + 1 && r1 > r0; i++)
+        for(j = 0; j < dataSizeX; j++)
+            if(labs(in[i*W + j]) > peak) peak = labs(in[i*W + j]);
+    bound = (tile == 2 ? WINOGRAD_ERROR2 : WINOGRAD_ERROR4) * kabs * (float)(peak + 1);
+
+    for(y0 = r0; y0 < r1; y0 += tile){
+        for(j = 0; j < alpha*W; j++) rows[j] = (float)in[(y0-1)*W + j];
+        // V = BT d B: down the columns of whole rows, then across the tiles
+        (tile == 2 ? winogradIn2 : winogradIn4)(rows, W, 1, vert, W, 1, dataSizeX);
+        for(a = 0; a < alpha; a++)
+            (tile == 2 ? winogradIn2 : winogradIn4)(vert + a*W, 1, tile, v + (long)a*alpha*T, T, 1, T);
+        // M = U . V
+        for(a = 0; a < alpha*alpha; a++)
+            for(j = 0; j < T; j++) v[(long)a*T + j] *= kern->winograd[a];
+        // Y = AT M A: across the tiles, then down the columns
+        for(a = 0; a < alpha; a++)
+            (tile == 2 ? winogradOut2 : winogradOut4)(v + (long)a*alpha*T, T, 1, hor + a*W + 1, 1, tile, T);
+        (tile == 2 ? winogradOut2 : winogradOut4)(hor + 1, W, 1, res + 1, W, 1, c1 - 1);
+        // round without branches, then convolve directly the pixels near a .5
+        for(a = 0; a < tile; a++){
+            int *o = out + (y0+a)*W;
+            const float *y = res + a*W;
+            for(j = 1; j < c1; j++){
+                o[j] = (int)(y[j] + ((y[j] >= 0) ? 0.5f : -0.5f));
+                near[j] = fabsf(fabsf(y[j] - (float)(int)y[j]) - 0.5f) <= bound;
+            }
+            for(j = 1; j < c1; j++)
+                if(near[j]) o[j] = winogradRound(y[j], bound, in, dataSizeX, dataSizeY, kern, y0+a, j);
+        }
+    }
+    free(rows);
+    free(near);
+
+    // the pixels the tiles do not cover: border rows and columns, and the remainder of the tiles
+    for(i = rowBegin; i < rowEnd; i++)
+        for(j = 0; j < dataSizeX; j++){
+            if(i >= r0 && i < r1 && j >= 1 && j < c1){
+                j = c1 - 1;
+                continue;
+            }
+            out[i*W + j] = winogradRound(convolveSample(in, dataSizeX, dataSizeY, kern, i, j), -1,
+                                         in, dataSizeX, dataSizeY, kern, i, j);
+        }
+    return 0;
+}
+
+static int convolve2D_winograd2(int* in, int* out, int dataSizeX, int dataSizeY, int rowBegin, int rowEnd, kernelData kern)
+{
+    return convolve2D_winograd(in, out, dataSizeX, dataSizeY, rowBegin, rowEnd, kern, 2);
+}
+
+static int convolve2D_winograd4(int* in, int* out, int dataSizeX, int dataSizeY, int rowBegin, int rowEnd, kernelData kern)
+{
+    return convolve2D_winograd(in, out, dataSizeX, dataSizeY, rowBegin, rowEnd, kern, 4);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// im2col/GEMM engine
+// The output pixels of the rows are lowered into a patch panel: column p
+// holds the kernelX*kernelY input pixels under the flipped kernel at pixel p
+// (zero out of the image). The results are then the product of the matrix
+// of the kernels (one flattened vkern per row) and the panel, so every patch
+// is reused by all the kernels of convolveGemm. The panel is built for
+// GEMM_PANEL floats at a time (a block of rows, or a piece of a row for big
+// kernels), packed in slivers of GEMM_NR pixels for the microkernel, and
+// the product runs in blocks of GEMM_KC taps so a sliver stays in L1.
+// The microkernel keeps GEMM_MR x GEMM_NR sums in registers. Every sum adds
+// the taps in the order of convolve2D, so the results are identical unless
+// the compiler contracts the multiply-adds differently (the planner checks).
+///////////////////////////////////////////////////////////////////////////////
+#define GEMM_MR         4           // kernels of the microkernel
+#define GEMM_NR         8           // pixels of the microkernel, a sliver of the panel
+#define GEMM_KC         256         // taps of a block of the product
+#define GEMM_PANEL      (1 << 18)   // floats of the patch panel
+
+// Sums of mr kernels (rows of a, lda apart) and a sliver of the panel (kc x GEMM_NR) into the
+// mr x GEMM_NR tile c (ldc apart), which starts at zero on the first block of taps.
+static inline __attribute__((always_inline))
+void gemmMicro(const float *a, long lda, const float *b, float *c, long ldc, int kc, int first, const int mr)
+{
+    float acc[GEMM_MR][GEMM_NR], ar;
+    int k, r, t;
+
+    for(r = 0; r < mr; r++)
+        for(t = 0; t < GEMM_NR; t++) acc[r][t] = first ? 0 : c[r*ldc + t];
+    for(k = 0; k < kc; k++, b += GEMM_NR){
+        for(r = 0; r < mr; r++){
+            ar = a[r*lda + k];
+            for(t = 0; t < GEMM_NR; t++) acc[r][t] += ar * b[t];
+        }
+    }
+    for(r = 0; r < mr; r++)
+        for(t = 0; t < GEMM_NR; t++) c[r*ldc + t] = acc[r][t];
+}
+
+// Patch panel of the output pixels q0..q0+n-1 (row major in the image), in slivers of GEMM_NR
+// pixels: tap k of pixel p is at panel[(p/GEMM_NR)*K*GEMM_NR + k*GEMM_NR + p%GEMM_NR].
+static void gemmPanel(int* in, int dataSizeX, int dataSizeY, int kernelX, int kernelY, long q0, int n, float *panel)
+{
+    int K = kernelX*kernelY, kCenterX = kernelX/2, kCenterY = kernelY/2;
+    int s, t, m, nn, x, y, i0, j0, ri[GEMM_NR], cj[GEMM_NR];
+    float *b;
+    const int *src;
+
+    for(s = 0; s < (n + GEMM_NR - 1)/GEMM_NR; s++){
+        b = panel + (long)s*K*GEMM_NR;
+        for(t = 0; t < GEMM_NR; t++){
+            ri[t] = (int)((q0 + s*GEMM_NR + t) / dataSizeX);
+            cj[t] = (int)((q0 + s*GEMM_NR + t) % dataSizeX);
+        }
+        i0 = ri[0];
+        j0 = cj[0];
+        // a whole sliver on one row, with every tap inside the image: rows of the kernel are copies
+        if(s*GEMM_NR + GEMM_NR <= n && ri[GEMM_NR-1] == i0 && i0 >= kernelY - 1 - kCenterY && i0 + kCenterY < dataSizeY &&
+           j0 >= kernelX - 1 - kCenterX && j0 + GEMM_NR + kCenterX <= dataSizeX){
+            for(m = 0; m < kernelY; m++)
+                for(nn = 0; nn < kernelX; nn++, b += GEMM_NR){
+                    src = in + (long)(i0 + kCenterY - m)*dataSizeX + j0 + kCenterX - nn;
+                    for(t = 0; t < GEMM_NR; t++) b[t] = (float)src[t];
+                }
+            continue;
+        }
+        for(m = 0; m < kernelY; m++)
+            for(nn = 0; nn < kernelX; nn++, b += GEMM_NR)
+                for(t = 0; t < GEMM_NR; t++){
+                    y = ri[t] + kCenterY - m;
+                    x = cj[t] + kCenterX - nn;
+                    b[t] = (s*GEMM_NR + t < n && y >= 0 && y < dataSizeY && x >= 0 && x < dataSizeX) ?
+                           (float)in[(long)y*dataSizeX + x] : 0;
+                }
+    }
+}
+
+// Convolve the rows rowBegin..rowEnd-1 of one channel with nkerns kernels of the same size at once,
+// kernel k writes outs[k]. One patch panel serves all of them.
+int convolveGemm(int* in, int** outs, int dataSizeX, int dataSizeY, int rowBegin, int rowEnd,
+                 kernelData* kerns, int nkerns)
+{
+    int kernelX, kernelY, K, M, N, n, s, r, t, k0, kc, g, *o;
+    long q0, q1, ldc;
+    float *a, *panel, *c, *cg, v;
+    const float *ag, *bs;
+
+    if(!in || !outs || !kerns || nkerns <= 0 || dataSizeX <= 0) return -1;
+    kernelX = kerns[0]->kernelX;
+    kernelY = kerns[0]->kernelY;
+    for(r = 0; r < nkerns; r++)
+        if(!outs[r] || kerns[r]->kernelX != kernelX || kerns[r]->kernelY != kernelY) return -1;
+    K = kernelX*kernelY;
+    M = nkerns;
+    // pixels of a panel, whole slivers
+    N = GEMM_PANEL / K / GEMM_NR * GEMM_NR;
+    if(N < GEMM_NR) N = GEMM_NR;
+
+    // the kernels as the rows of a, the panel, and the sums of all the kernels on its pixels
+    if((a = (float *)malloc(((long)M*K + (long)K*N + (long)M*N)*sizeof(float))) == NULL) return -1;
+    panel = a + (long)M*K;
+    c = panel + (long)K*N;
+    ldc = N;
+    for(r = 0; r < M; r++) memcpy(a + (long)r*K, kerns[r]->vkern, K*sizeof(float));
+
+    q1 = (long)rowEnd*dataSizeX;
+    for(q0 = (long)rowBegin*dataSizeX; q0 < q1; q0 += N){
+        n = (q1 - q0 < N) ? (int)(q1 - q0) : N;
+        gemmPanel(in, dataSizeX, dataSizeY, kernelX, kernelY, q0, n, panel);
+        for(k0 = 0; k0 < K; k0 += GEMM_KC){
+            kc = (K - k0 < GEMM_KC) ? K - k0 : GEMM_KC;
+            for(s = 0; s < (n + GEMM_NR - 1)/GEMM_NR; s++)
+                for(g = 0; g < M; g += GEMM_MR){
+                    ag = a + (long)g*K + k0;
+                    bs = panel + (long)s*K*GEMM_NR + (long)k0*GEMM_NR;
+                    cg = c + g*ldc + s*GEMM_NR;
+                    // one specialized microkernel per number of kernels left
+                    switch(M - g){
+                    case 1: gemmMicro(ag, K, bs, cg, ldc, kc, k0 == 0, 1); break;
+                    case 2: gemmMicro(ag, K, bs, cg, ldc, kc, k0 == 0, 2); break;
+                    case 3: gemmMicro(ag, K, bs, cg, ldc, kc, k0 == 0, 3); break;
+                    default: gemmMicro(ag, K, bs, cg, ldc, kc, k0 == 0, GEMM_MR); break;
+                    }
+                }
+        }
+        // round as convolve2D
+        for(r = 0; r < M; r++){
+            o = outs[r] + q0;
+            for(t = 0; t < n; t++){
+                v = c[r*ldc + t];
+                o[t] = (int)(v + ((v >= 0) ? 0.5f : -0.5f));
+            }
+        }
+    }
+    free(a);
+    return 0;
+}
+
+static int convolve2D_gemm(int* in, int* out, int dataSizeX, int dataSizeY, int rowBegin, int rowEnd, kernelData kern)
+{
+    return convolveGemm(in, &out, dataSizeX, dataSizeY, rowBegin, rowEnd, &kern, 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Engine selection
+///////////////////////////////////////////////////////////////////////////////
+
+// Generic engine: any kernel size.
+static int convolve2D_generic(int* in, int* out, int dataSizeX, int dataSizeY, int rowBegin, int rowEnd, kernelData kern)
+{
+    return convolve2DRows(in, out, dataSizeX, dataSizeY, rowBegin, rowEnd, kern->vkern, kern->kernelX, kern->kernelY);
+}
+
+// Dispatch table of the specialized engines, indexed by kernel size.
+static const struct {
+    int kernelX;
+    int kernelY;
+    convolveFn convolve;
+} convolveTable[] = {
+    {3, 3, convolve2D_3x3},
+    {5, 5, convolve2D_5x5},
+    {7, 7, convolve2D_7x7},
+    {9, 9, convolve2D_9x9},
+};
+
+// Names of the engines, as printed by --explain and stored in the wisdom file.
+const char *engineNames[ENGINES] = {"generic", "split", "fixed", "sparse", "box", "winograd2", "winograd4", "gemm"};
+
+// Function of an engine for this kernel, NULL when the engine can not handle it.
+convolveFn engineFunction(kernelData kern, int engine){
+    int i;
+
+    switch(engine){
+    case ENGINE_GENERIC:
+        return convolve2D_generic;
+    case ENGINE_SPLIT:
+        return convolve2D_split;
+    case ENGINE_FIXED:
+        for(i = 0; i < (int)(sizeof(convolveTable)/sizeof(convolveTable[0])); i++){
+            if(convolveTable[i].kernelX == kern->kernelX && convolveTable[i].kernelY == kern->kernelY)
+                return convolveTable[i].convolve;
+        }
+        return NULL;
+    case ENGINE_SPARSE:
+        return (kern->taps && kern->ntaps < kern->kernelX*kern->kernelY) ? convolve2D_sparse : NULL;
+    case ENGINE_BOX:
+        return (kern->boxes && kern->nboxes > 0) ? convolve2D_box : NULL;
+    case ENGINE_WINOGRAD2:
+        return (kern->kernelX == 3 && kern->kernelY == 3) ? convolve2D_winograd2 : NULL;
+    case ENGINE_WINOGRAD4:
+        return (kern->kernelX == 3 && kern->kernelY == 3) ? convolve2D_winograd4 : NULL;
+    case ENGINE_GEMM:
+        return convolve2D_gemm;
+    }
+    return NULL;
+}
+
+// Use the given engine and column tile for the kernel.
+int setEngine(kernelData kern, int engine, int tileX){
+    convolveFn fn;
+
+    if(engine < 0 || engine >= ENGINES) return -1;
+    if((fn = engineFunction(kern, engine)) == NULL) return -1;
+    if(engine == ENGINE_WINOGRAD2) winogradKernel(kern, 2);
+    if(engine == ENGINE_WINOGRAD4) winogradKernel(kern, 4);
+    kern->engine = engine;
+    kern->tileX = tileX;
+    kern->convolve = fn;
+    return 0;
+}
+
+// Default engine for the kernel when there is no plan: boxes for big kernels made of a few
+// constant rectangles, sparse taps for mostly zero kernels, then a fixed-size engine. Sizes
+// without a specialization use convolve2D. Boxes and grouped taps sum in another order than
+// convolve2D, so they are only chosen for integer kernels, where the order does not change the result.
+int selectEngine(kernelData kern){
+    // four lookups per box instead of a multiply per tap
+    if(kern->integral && kern->nboxes > 0 && kern->ntaps >= BOX_MIN_TAPS && 4*kern->nboxes < kern->ntaps)
+        return ENGINE_BOX;
+    // mostly zero kernels only visit the nonzero taps
+    if(kern->integral && kern->taps && kern->ntaps <= (1.0f - SPARSE_THRESHOLD)*kern->kernelX*kern->kernelY)
+        return ENGINE_SPARSE;
+    if(engineFunction(kern, ENGINE_FIXED))
+        return ENGINE_FIXED;
+    return ENGINE_GENERIC;
+}
+
+// Kernel properties used to choose the engine: nonzero taps, constant boxes, separability and integer weights.
+int analyzeKernel(kernelData kern){
+    int i, m, n, pm = 0, pn = 0;
+    float pivot = 0, a, b;
+
+    if(buildKernelTaps(kern) || buildKernelBoxes(kern)) return -1;
+
+    kern->integral = 1;
+    for(i = 0; i < kern->kernelX*kern->kernelY; i++){
+        if(kern->vkern[i] != (float)(long)kern->vkern[i]) kern->integral = 0;
+        if(fabsf(kern->vkern[i]) > fabsf(pivot)){
+            pivot = kern->vkern[i];
+            pm = i / kern->kernelX;
+            pn = i % kern->kernelX;
+        }
+    }
+
+    // separable kernels have rank one: k(m,n)*k(pm,pn) == k(m,pn)*k(pm,n) for every tap
+    kern->separable = (pivot != 0);
+    for(m = 0; m < kern->kernelY && kern->separable; m++){
+        for(n = 0; n < kern->kernelX; n++){
+            a = kern->vkern[m*kern->kernelX + n] * pivot;
+            b = kern->vkern[m*kern->kernelX + pn] * kern->vkern[pm*kern->kernelX + n];
+            if(fabsf(a - b) > 1e-5f * fabsf(pivot*pivot)){
+                kern->separable = 0;
+                break;
+            }
+        }
+    }
+
+    kern->tileX = 0;
+    kern->engine = selectEngine(kern);
+    kern->convolve = engineFunction(kern, kern->engine);
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Convolution planner
+// The plan is the engine and column tile used for a kernel. The candidates
+// are timed on the first rows of the actual partition and the fastest one
+// is stored in the wisdom file (CONVOLUTION_WISDOM, or WISDOM_FILE in the
+// working directory), keyed by host, kernel (shape and kernelHash of its
+// values), image width, threads and ranks. The next job with the same
+// parameters reads the plan from there and skips the timing.
+///////////////////////////////////////////////////////////////////////////////
+#define WISDOM_FILE "convolution.wisdom"
+#define PLAN_SAMPLE_ROWS 32
+#define PLAN_REPETITIONS 3
+
+// Column tiles tried by the planner, 0 is the whole row.
+static const int planTiles[] = {0, 128, 512};
+
+// Plans created at the same time take turns with the wisdom file.
+static pthread_mutex_t wisdomLock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *wisdomFile(void){
+    char *name = getenv("CONVOLUTION_WISDOM");
+    return (name && name[0]) ? name : WISDOM_FILE;
+}
+
+// Look for the plan in the wisdom file. Returns 0 when found. The values of the kernel are part
+// of the key: the Winograd and GEMM engines are only kept for the kernels they were checked on.
+static int readWisdom(kernelData kern, const char *host, int sizeX, int threads, int ranks, double *seconds){
+    FILE *fp;
+    char line[512], whost[256], wengine[16];
+    int kx, ky, ntaps, separable, integral, width, wthreads, wranks, tileX, e, found = -1;
+    unsigned long long hash, khash = kernelHash(kern, 0);
+    double t;
+
+    if((fp = fopen(wisdomFile(), "r")) == NULL) return -1;
+    // line by line, the lines of an older format are skipped
+    while(fgets(line, sizeof(line), fp)){
+        if(sscanf(line, "%255s %d %d %llx %d %d %d %d %d %d %15s %d %lf",
+                  whost, &kx, &ky, &hash, &ntaps, &separable, &integral, &width, &wthreads, &wranks,
+                  wengine, &tileX, &t) != 13) continue;
+        if(strcmp(whost, host) || kx != kern->kernelX || ky != kern->kernelY || hash != khash || ntaps != kern->ntaps ||
+           separable != kern->separable || integral != kern->integral || width != sizeX ||
+           wthreads != threads || wranks != ranks) continue;
+        for(e = 0; e < ENGINES; e++){
+            // the last matching line wins
+            if(strcmp(wengine, engineNames[e]) == 0 && setEngine(kern, e, tileX) == 0){
+                *seconds = t;
+                found = 0;
+            }
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+static void writeWisdom(kernelData kern, const char *host, int sizeX, int threads, int ranks, double seconds){
+    FILE *fp;
+
+    if((fp = fopen(wisdomFile(), "a")) == NULL){
+        perror("Error: ");
+        return;
+    }
+    fprintf(fp, "%s %d %d %016llx %d %d %d %d %d %d %s %d %.9lf\n", host, kern->kernelX, kern->kernelY,
+            kernelHash(kern, 0), kern->ntaps, kern->separable, kern->integral, sizeX, threads, ranks,
+            engineNames[kern->engine], kern->tileX, seconds);
+    fclose(fp);
+}
+
+// Time the candidate engines and tiles on the first rows of the partition and keep the fastest.
+static double tuneConvolution(kernelData kern, int* sample, int sizeX, int sizeY){
+    int e, t, r, rows, bestEngine = kern->engine, bestTile = kern->tileX;
+    int *out, *direct;
+    double start, elapsed, best = -1;
+
+    rows = (sizeY < PLAN_SAMPLE_ROWS + kern->kernelY) ? sizeY : PLAN_SAMPLE_ROWS + kern->kernelY;
+    if((out = (int *)malloc(sizeX*rows*sizeof(int))) == NULL) return -1;
+    // result of convolve2D, the reference of the numerical checks
+    if((direct = (int *)malloc(sizeX*rows*sizeof(int))) != NULL)
+        convolve2DRows(sample, direct, sizeX, rows, 0, rows, kern->vkern, kern->kernelX, kern->kernelY);
+
+    for(e = 0; e < ENGINES; e++){
+        for(t = 0; t < (int)(sizeof(planTiles)/sizeof(planTiles[0])); t++){
+            // convolve2D and the integral image always work on whole rows
+            if((e == ENGINE_GENERIC || e == ENGINE_BOX) && planTiles[t] != 0) continue;
+            if(planTiles[t] >= sizeX) continue;
+            // grouping the taps and the integral image change the rounding of non integer kernels
+            if((e == ENGINE_SPARSE || e == ENGINE_BOX) && !kern->integral) continue;
+            if((e == ENGINE_WINOGRAD2 || e == ENGINE_WINOGRAD4 || e == ENGINE_GEMM) && planTiles[t] != 0) continue;
+            if(setEngine(kern, e, planTiles[t])) continue;
+            // Winograd and GEMM only when they round every pixel of the sample as convolve2D
+            if((e == ENGINE_WINOGRAD2 || e == ENGINE_WINOGRAD4 || e == ENGINE_GEMM) &&
+               (!direct || kern->convolve(sample, out, sizeX, rows, 0, rows, kern) ||
+                memcmp(out, direct, sizeX*rows*sizeof(int)) != 0)) continue;
+
+            elapsed = -1;
+            for(r = 0; r < PLAN_REPETITIONS; r++){
+                start = timerNow();
+                kern->convolve(sample, out, sizeX, rows, 0, rows, kern);
+                start = timerNow() - start;
+                if(elapsed < 0 || start < elapsed) elapsed = start;
+            }
+            if(best < 0 || elapsed < best){
+                best = elapsed;
+                bestEngine = e;
+                bestTile = planTiles[t];
+            }
+        }
+    }
+    free(out);
+    free(direct);
+    setEngine(kern, bestEngine, bestTile);
+    return best;
+}
+
+// Choose the engine and tile for the kernel on this partition. sample is a channel of the
+// partition (sizeX x sizeY pixels). With explain the plan is printed.
+int planConvolution(kernelData kern, int* sample, int sizeX, int sizeY, int threads, int ranks, int explain){
+    char host[256];
+    double seconds = 0;
+    int fromWisdom;
+
+    if(gethostname(host, sizeof(host)) != 0) strcpy(host, "localhost");
+    host[sizeof(host)-1] = '\0';
+
+    pthread_mutex_lock(&wisdomLock);
+    fromWisdom = (readWisdom(kern, host, sizeX, threads, ranks, &seconds) == 0);
+    if(!fromWisdom){
+        seconds = tuneConvolution(kern, sample, sizeX, sizeY);
+        writeWisdom(kern, host, sizeX, threads, ranks, seconds);
+    }
+    pthread_mutex_unlock(&wisdomLock);
+
+    if(explain){
+        printf("Plan: engine=%s tile=%d (%s, %.6lf seconds per sample)\n", engineNames[kern->engine],
+               kern->tileX, fromWisdom ? "from wisdom" : "tuned", seconds);
+        printf("Kernel: %dx%d, %d nonzero taps in %d weights, separable=%s, integral=%s\n",
+               kern->kernelX, kern->kernelY, kern->ntaps, kern->ngroups,
+               kern->separable ? "yes" : "no", kern->integral ? "yes" : "no");
+        printf("Image width: %d, threads: %d, ranks: %d, host: %s\n", sizeX, threads, ranks, host);
+    }
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Kernel cache
+// A prepared kernel is the kernel with its analysis (taps, weight groups,
+// properties) and the engine planned for an image width. It is cached by a
+// hash of the kernel values and the width: in memory for the plans of the
+// process, and in CONVOLUTION_KERNEL_CACHE (a directory, one file per hash)
+// when that is set, so repeated jobs reuse it. packKernel/unpackKernel give
+// the flat form stored there, which MPI programs also broadcast so that the
+// other ranks never read the kernel file.
+///////////////////////////////////////////////////////////////////////////////
+#define KERNEL_MAGIC    0x4b564e43  // "CNVK"
+#define KERNEL_VERSION  2
+#define KERNEL_HEADER   11          // ints before the values: magic, version, kernelX, kernelY,
+                                    // ntaps, ngroups, separable, integral, engine, tileX, nboxes
+
+struct structkernelcache{
+    unsigned long long hash;
+    int width;
+    kernelData kern;
+    struct structkernelcache *next;
+};
+
+static struct structkernelcache *kernelCache = NULL;
+static pthread_mutex_t kernelCacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+// FNV-1a of the kernel size, values and image width.
+unsigned long long kernelHash(kernelData kern, int width){
+    unsigned long long h = 14695981039346656037ULL;
+    const unsigned char *p;
+    size_t i;
+    int head[3] = {kern->kernelX, kern->kernelY, width};
+
+    p = (const unsigned char *)head;
+    for(i = 0; i < sizeof(head); i++) h = (h ^ p[i]) * 1099511628211ULL;
+    p = (const unsigned char *)kern->vkern;
+    for(i = 0; i < kern->kernelX*kern->kernelY*sizeof(float); i++) h = (h ^ p[i]) * 1099511628211ULL;
+    return h;
+}
+
+// Flat form of the prepared kernel. Returns its size in bytes; buf can be NULL to get the size.
+size_t packKernel(kernelData kern, void *buf){
+    size_t values = kern->kernelX*kern->kernelY*sizeof(float);
+    size_t taps = kern->ntaps*sizeof(struct structtap);
+    size_t groups = (kern->ngroups+1)*sizeof(int);
+    size_t boxes = kern->nboxes*sizeof(struct structbox);
+    size_t size = KERNEL_HEADER*sizeof(int) + values + taps + groups + boxes;
+    int *head = (int *)buf;
+    char *p = (char *)buf + KERNEL_HEADER*sizeof(int);
+
+    if(!buf) return size;
+    head[0] = KERNEL_MAGIC;
+    head[1] = KERNEL_VERSION;
+    head[2] = kern->kernelX;
+    head[3] = kern->kernelY;
+    head[4] = kern->ntaps;
+    head[5] = kern->ngroups;
+    head[6] = kern->separable;
+    head[7] = kern->integral;
+    head[8] = kern->engine;
+    head[9] = kern->tileX;
+    head[10] = kern->nboxes;
+    memcpy(p, kern->vkern, values);
+    memcpy(p + values, kern->taps, taps);
+    memcpy(p + values + taps, kern->group, groups);
+    if(boxes) memcpy(p + values + taps + groups, kern->boxes, boxes);
+    return size;
+}
+
+// The taps, weight groups and boxes of an unpacked kernel stay inside the kernel, whatever the file held.
+static int checkKernel(kernelData kern){
+    int t, g, b;
+    int kCenterX = kern->kernelX / 2, kCenterY = kern->kernelY / 2;
+    int dyMin = kCenterY - (kern->kernelY-1), dxMin = kCenterX - (kern->kernelX-1);
+
+    for(t = 0; t < kern->ntaps; t++)
+        if(kern->taps[t].dy < dyMin || kern->taps[t].dy > kCenterY ||
+           kern->taps[t].dx < dxMin || kern->taps[t].dx > kCenterX) return -1;
+    if(kern->group[0] != 0 || kern->group[kern->ngroups] != kern->ntaps) return -1;
+    for(g = 0; g < kern->ngroups; g++)
+        if(kern->group[g] >= kern->group[g+1]) return -1;
+    for(b = 0; b < kern->nboxes; b++)
+        if(kern->boxes[b].dy0 < dyMin || kern->boxes[b].dy0 > kern->boxes[b].dy1 || kern->boxes[b].dy1 > kCenterY ||
+           kern->boxes[b].dx0 < dxMin || kern->boxes[b].dx0 > kern->boxes[b].dx1 || kern->boxes[b].dx1 > kCenterX) return -1;
+    return 0;
+}
+
+// Kernel from its flat form, without reading or analyzing anything. NULL when buf is not a packed kernel,
+// or when its taps, groups or boxes fall outside the kernel (a corrupt or stale cache file).
+kernelData unpackKernel(const void *buf, size_t size){
+    const int *head = (const int *)buf;
+    const char *p = (const char *)buf + KERNEL_HEADER*sizeof(int);
+    size_t values, taps, groups, boxes;
+    kernelData kern;
+
+    if(!buf || size < KERNEL_HEADER*sizeof(int) || head[0] != KERNEL_MAGIC || head[1] != KERNEL_VERSION) return NULL;
+    if(head[2] <= 0 || head[3] <= 0 || head[4] < 0 || head[4] > head[2]*head[3] || head[5] < 0 || head[5] > head[4] ||
+       head[10] < 0 || head[10] > BOX_MAX)
+        return NULL;
+    values = head[2]*head[3]*sizeof(float);
+    taps = head[4]*sizeof(struct structtap);
+    groups = (head[5]+1)*sizeof(int);
+    boxes = head[10]*sizeof(struct structbox);
+    if(size != KERNEL_HEADER*sizeof(int) + values + taps + groups + boxes) return NULL;
+
+    if((kern = (kernelData) calloc(1, sizeof(struct structkernel))) == NULL) return NULL;
+    kern->kernelX = head[2];
+    kern->kernelY = head[3];
+    kern->ntaps = head[4];
+    kern->ngroups = head[5];
+    kern->separable = head[6];
+    kern->integral = head[7];
+    kern->vkern = (float *)malloc(values);
+    // same allocations as buildKernelTaps
+    kern->taps = (struct structtap *)malloc(kern->kernelX*kern->kernelY*sizeof(struct structtap));
+    kern->group = (int *)malloc((kern->kernelX*kern->kernelY+1)*sizeof(int));
+    kern->nboxes = head[10];
+    kern->boxes = (struct structbox *)malloc(BOX_MAX*sizeof(struct structbox));
+    if(!kern->vkern || !kern->taps || !kern->group || !kern->boxes){
+        freeKernel(kern);
+        return NULL;
+    }
+    memcpy(kern->vkern, p, values);
+    memcpy(kern->taps, p + values, taps);
+    memcpy(kern->group, p + values + taps, groups);
+    memcpy(kern->boxes, p + values + taps + groups, boxes);
+    if(checkKernel(kern) || setEngine(kern, head[8], head[9])){
+        freeKernel(kern);
+        return NULL;
+    }
+    return kern;
+}
+
+static int kernelCachePath(unsigned long long hash, char *path, size_t size){
+    char *dir = getenv("CONVOLUTION_KERNEL_CACHE");
+
+    if(!dir || !dir[0]) return -1;
+    snprintf(path, size, "%s/%016llx.kernel", dir, hash);
+    return 0;
+}
+
+// Prepared kernel for the width from the memory or disk cache. The caller owns the copy.
+kernelData cachedKernel(kernelData kern, int width){
+    unsigned long long hash = kernelHash(kern, width);
+    struct structkernelcache *e;
+    kernelData found = NULL;
+    char path[1024];
+    void *buf = NULL;
+    size_t size;
+    FILE *fp;
+    long len;
+
+    pthread_mutex_lock(&kernelCacheLock);
+    for(e = kernelCache; e && !found; e = e->next){
+        // an entry whose kernel could not be unpacked has none
+        if(e->kern && e->hash == hash && e->width == width && e->kern->kernelX == kern->kernelX && e->kern->kernelY == kern->kernelY &&
+           memcmp(e->kern->vkern, kern->vkern, kern->kernelX*kern->kernelY*sizeof(float)) == 0){
+            size = packKernel(e->kern, NULL);
+            if((buf = malloc(size)) != NULL){
+                packKernel(e->kern, buf);
+                found = unpackKernel(buf, size);
+                free(buf);
+            }
+        }
+    }
+    pthread_mutex_unlock(&kernelCacheLock);
+    if(found || kernelCachePath(hash, path, sizeof(path))) return found;
+
+    if((fp = fopen(path, "rb")) == NULL) return NULL;
+    if(fseek(fp, 0, SEEK_END) == 0 && (len = ftell(fp)) > 0 && fseek(fp, 0, SEEK_SET) == 0 &&
+       (buf = malloc(len)) != NULL && fread(buf, 1, len, fp) == (size_t)len)
+        found = unpackKernel(buf, len);
+    free(buf);
+    fclose(fp);
+    // a hash collision is not the same kernel
+    if(found && (found->kernelX != kern->kernelX || found->kernelY != kern->kernelY ||
+                 memcmp(found->vkern, kern->vkern, kern->kernelX*kern->kernelY*sizeof(float)) != 0)){
+        freeKernel(found);
+        found = NULL;
+    }
+    if(found) cacheKernel(found, width);
+    return found;
+}
+
+// Keep the prepared kernel for the width in memory and, with CONVOLUTION_KERNEL_CACHE, on disk.
+int cacheKernel(kernelData kern, int width){
+    unsigned long long hash = kernelHash(kern, width);
+    struct structkernelcache *e;
+    char path[1024], tmp[1040];
+    void *buf;
+    size_t size = packKernel(kern, NULL);
+    FILE *fp;
+    int status = 0;
+
+    if((buf = malloc(size)) == NULL) return -1;
+    packKernel(kern, buf);
+
+    pthread_mutex_lock(&kernelCacheLock);
+    for(e = kernelCache; e; e = e->next)
+        if(e->hash == hash && e->width == width) break;
+    if(!e && (e = (struct structkernelcache *)calloc(1, sizeof(struct structkernelcache))) != NULL){
+        e->hash = hash;
+        e->width = width;
+        e->next = kernelCache;
+        kernelCache = e;
+    }
+    if(e){
+        freeKernel(e->kern);
+        if((e->kern = unpackKernel(buf, size)) == NULL) status = -1;
+    }
+    pthread_mutex_unlock(&kernelCacheLock);
+
+    // written aside and renamed, so concurrent jobs never read half a file
+    if(kernelCachePath(hash, path, sizeof(path)) == 0){
+        snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+        if((fp = fopen(tmp, "wb")) == NULL || fwrite(buf, 1, size, fp) != size || fclose(fp) != 0 || rename(tmp, path) != 0){
+            perror("Error: ");
+            remove(tmp);
+            status = -1;
+        }
+    }
+    free(buf);
+    return status;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Instrumentation
+// Phase timers use the monotonic clock. Every phase is accumulated per rank
+// and per partition; the convolution is also accumulated per thread. At the
+// end each rank packs its timings in a flat record (packTimers) so the
+// master can gather them and write the JSON report (writeTimings) with the
+// min/mean/max/imbalance of every phase over the ranks.
+///////////////////////////////////////////////////////////////////////////////
+
+static const char *phaseNames[PHASES] = {"read", "copy", "kernel", "convolve", "store", "communication"};
+
+double timerNow(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1000000000.0;
+}
+
+timersData initTimers(int partitions){
+    timersData t = (timersData) calloc(1, sizeof(struct structtimers));
+
+    if(!t) return NULL;
+    t->partitions = partitions > 0 ? partitions : 1;
+    if((t->partition = (double *)calloc(t->partitions*PHASES, sizeof(double))) == NULL) return NULL;
+    t->begin = timerNow();
+    return t;
+}
+
+// The read and store phases run on the main thread, their counters are charged to thread 0.
+void timerStart(timersData t, int phase){
+    if(phase == PHASE_READ || phase == PHASE_STORE) counterStart(t);
+    t->start[phase] = timerNow();
+}
+
+// Stop the phase and charge it to the partition.
+void timerStop(timersData t, int phase, int partition){
+    double elapsed = timerNow() - t->start[phase];
+
+    if(phase == PHASE_READ || phase == PHASE_STORE) counterStop(t, 0, phase);
+
+    t->total[phase] += elapsed;
+    if(partition >= 0 && partition < t->partitions)
+        t->partition[partition*PHASES + phase] += elapsed;
+}
+
+// Convolution time of one thread. Every thread writes only its own slot.
+void timerThread(timersData t, int thread, double seconds){
+    if(thread < 0 || thread >= TIMER_THREADS) return;
+    t->thread[thread] += seconds;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Hardware counters
+// With --counters every thread opens its own perf_event_open group (cycles,
+// instructions, L1D read misses, LLC misses, branch misses, dTLB read misses) the first time it
+// starts a phase. The counts only cover user space. When the kernel refuses
+// the counters (no PMU, perf_event_paranoid, not Linux) the run goes on and
+// the report says they are unavailable. Counters that are missing on this
+// CPU are left out of the group and reported as null.
+///////////////////////////////////////////////////////////////////////////////
+
+static const char *counterNames[COUNTERS] = {"cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses", "dtlb_misses"};
+
+// Counter group of the calling thread. counterFd is -2 until it is opened and -1 when unavailable.
+static __thread int counterFd = -2;
+static __thread int counterN = 0;
+static __thread int counterId[COUNTERS];   // counter of every value of the group, in read order
+static int counterWarned = 0;
+
+static int counterOpen(void){
+#ifdef __linux__
+    static const struct {
+        unsigned int type;
+        unsigned long long config;
+    } events[COUNTERS] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    };
+    struct perf_event_attr attr;
+    int c, fd;
+
+    counterFd = -1;
+    counterN = 0;
+    for(c = 0; c < COUNTERS; c++){
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[c].type;
+        attr.config = events[c].config;
+        attr.disabled = (counterFd < 0);   // the leader starts the group
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        fd = syscall(__NR_perf_event_open, &attr, 0, -1, counterFd, 0);
+        if(fd < 0){
+            if(c == 0) break;   // without cycles there is no group
+            continue;
+        }
+        if(counterFd < 0) counterFd = fd;
+        counterId[counterN++] = c;
+    }
+    if(counterFd >= 0) return 0;
+#endif
+    counterFd = -1;
+    if(!__atomic_exchange_n(&counterWarned, 1, __ATOMIC_RELAXED))
+        fprintf(stderr, "Warning: hardware counters unavailable, only timings are reported.\n");
+    return -1;
+}
+
+// Reset and start the counters of the calling thread.
+void counterStart(timersData t){
+    if(!t->counters) return;
+    if(counterFd == -2) counterOpen();
+#ifdef __linux__
+    if(counterFd < 0) return;
+    ioctl(counterFd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(counterFd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+}
+
+// Stop the counters of the calling thread and charge them to the phase.
+void counterStop(timersData t, int thread, int phase){
+#ifdef __linux__
+    unsigned long long value[3 + COUNTERS];   // number of values, time enabled, time running, values
+    double scale;
+    int i, mask = 0;
+
+    if(!t->counters || counterFd < 0) return;
+    ioctl(counterFd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    if(thread < 0 || thread >= TIMER_THREADS) return;
+    if(read(counterFd, value, sizeof(value)) < (ssize_t)(3*sizeof(unsigned long long)) || value[2] == 0) return;
+
+    // the group may have been multiplexed with other events
+    scale = (double)value[1] / value[2];
+    for(i = 0; i < (int)value[0] && i < counterN; i++){
+        t->count[thread][phase][counterId[i]] += value[3+i] * scale;
+        mask |= 1 << counterId[i];
+    }
+    __atomic_fetch_or(&t->counterMask, mask, __ATOMIC_RELAXED);
+#endif
+}
+
+#define REC_FAULTS          (RANK_FIELDS-2)     // page faults of the rank
+#define REC_FAULT_SECONDS   (RANK_FIELDS-1)     // seconds faulting in the pages of its arena
+
+// Flat record of the rank: phases, elapsed, bytes read/written, peak RSS, threads, thread times,
+// counter mask, the hardware counts of every phase summed over the threads and the page faults.
+void packTimers(timersData t, double *rec){
+    struct rusage usage;
+    int i, p, c;
+    double *count = rec + PHASES+6+TIMER_THREADS;
+
+    t->elapsed = timerNow() - t->begin;
+    if(getrusage(RUSAGE_SELF, &usage) == 0){
+        t->peakRSS = usage.ru_maxrss;
+        t->pageFaults = usage.ru_minflt + usage.ru_majflt;
+    }
+    for(i = 0; i < TIMER_THREADS; i++)
+        if(t->thread[i] > 0) t->threads = i + 1;
+
+    for(i = 0; i < PHASES; i++) rec[i] = t->total[i];
+    rec[PHASES]   = t->elapsed;
+    rec[PHASES+1] = (double)t->bytesRead;
+    rec[PHASES+2] = (double)t->bytesWritten;
+    rec[PHASES+3] = (double)t->peakRSS;
+    rec[PHASES+4] = (double)t->threads;
+    for(i = 0; i < TIMER_THREADS; i++) rec[PHASES+5+i] = t->thread[i];
+
+    rec[PHASES+5+TIMER_THREADS] = t->counterMask;
+    for(p = 0; p < PHASES; p++){
+        for(c = 0; c < COUNTERS; c++){
+            count[p*COUNTERS + c] = 0;
+            for(i = 0; i < TIMER_THREADS; i++) count[p*COUNTERS + c] += t->count[i][p][c];
+        }
+    }
+    rec[REC_FAULTS] = (double)t->pageFaults;
+    rec[REC_FAULT_SECONDS] = t->arena ? t->arena->faultSeconds : 0;
+}
+
+// JSON string: quotes, backslashes and control characters of a path are escaped.
+static void writeJsonString(FILE *fp, const char *s){
+    fputc('"', fp);
+    for(; *s; s++){
+        if(*s == '"' || *s == '\\') fprintf(fp, "\\%c", *s);
+        else if((unsigned char)*s < 0x20) fprintf(fp, "\\u%04x", (unsigned char)*s);
+        else fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+// JSON report. recs holds the packed record of every rank; the partitions are the master ones.
+int writeTimings(char *nombre, timersData t, double *recs, int ranks, char *program, char *image,
+                 int ancho, int altura, kernelData kern, int partitions){
+    FILE *fp;
+    int r, p, i, c, threads, mask = 0;
+    double min, max, mean, v, count[COUNTERS], faultSeconds = 0;
+    long bytesRead = 0, bytesWritten = 0, peakRSS = 0, faults = 0, huge;
+
+    if((fp = fopen(nombre, "w")) == NULL){
+        perror("Error: ");
+        return -1;
+    }
+    for(r = 0; r < ranks; r++){
+        bytesRead    += (long)recs[r*RANK_FIELDS + PHASES+1];
+        bytesWritten += (long)recs[r*RANK_FIELDS + PHASES+2];
+        if((long)recs[r*RANK_FIELDS + PHASES+3] > peakRSS) peakRSS = (long)recs[r*RANK_FIELDS + PHASES+3];
+        mask |= (int)recs[r*RANK_FIELDS + PHASES+5+TIMER_THREADS];
+        faults += (long)recs[r*RANK_FIELDS + REC_FAULTS];
+        faultSeconds += recs[r*RANK_FIELDS + REC_FAULT_SECONDS];
+    }
+
+    fprintf(fp, "{\n  \"program\": ");
+    writeJsonString(fp, program);
+    fprintf(fp, ",\n  \"image\": ");
+    writeJsonString(fp, image);
+    fprintf(fp, ",\n  \"width\": %d,\n  \"height\": %d,\n", ancho, altura);
+    fprintf(fp, "  \"kernel\": \"%dx%d\",\n  \"engine\": \"%s\",\n  \"tile\": %d,\n  \"partitions\": %d,\n  \"ranks\": %d,\n",
+            kern->kernelX, kern->kernelY, engineNames[kern->engine], kern->tileX, partitions, ranks);
+    fprintf(fp, "  \"elapsed_s\": %.6lf,\n  \"peak_rss_kb\": %ld,\n  \"bytes_read\": %ld,\n  \"bytes_written\": %ld,\n",
+            recs[PHASES], peakRSS, bytesRead, bytesWritten);
+    fprintf(fp, "  \"page_faults\": %ld,\n  \"arena_fault_s\": %.6lf,\n", faults, faultSeconds);
+    // arena of the master: the pages that map it are the TLB entries the planes need
+    if(t->arena){
+        huge = arenaHugeBytes(t->arena);
+        fprintf(fp, "  \"arena\": {\"peak_bytes\": %ld, \"touched_bytes\": %ld, \"huge_bytes\": %ld, \"page_kb\": %ld, \"hugetlb\": %s, \"faults\": %ld, \"resets\": %d},\n",
+                (long)t->arena->peak, (long)t->arena->touched, huge, (long)(t->arena->pageSize / 1024),
+                t->arena->hugetlb ? "true" : "false", t->arena->faults, t->arena->resets);
+    }
+
+    // every phase reduced over the ranks, imbalance = max/mean - 1
+    fprintf(fp, "  \"phases\": {\n");
+    for(i = 0; i < PHASES; i++){
+        min = max = mean = recs[i];
+        for(r = 1; r < ranks; r++){
+            v = recs[r*RANK_FIELDS + i];
+            if(v < min) min = v;
+            if(v > max) max = v;
+            mean += v;
+        }
+        mean /= ranks;
+        fprintf(fp, "    \"%s\": {\"min_s\": %.6lf, \"mean_s\": %.6lf, \"max_s\": %.6lf, \"imbalance\": %.4lf}%s\n",
+                phaseNames[i], min, mean, max, mean > 0 ? max/mean - 1 : 0.0, i < PHASES-1 ? "," : "");
+    }
+    fprintf(fp, "  },\n");
+
+    // hardware counters summed over ranks and threads, with the derived ratios
+    if(t->counters && !mask)
+        fprintf(fp, "  \"counters\": {\"available\": false},\n");
+    else if(t->counters){
+        fprintf(fp, "  \"counters\": {\n    \"available\": true,\n");
+        for(i = 0; i < PHASES; i++){
+            if(i != PHASE_READ && i != PHASE_CONV && i != PHASE_STORE) continue;
+            for(c = 0; c < COUNTERS; c++){
+                count[c] = 0;
+                for(r = 0; r < ranks; r++) count[c] += recs[r*RANK_FIELDS + PHASES+6+TIMER_THREADS + i*COUNTERS + c];
+            }
+            fprintf(fp, "    \"%s\": {", phaseNames[i]);
+            for(c = 0; c < COUNTERS; c++){
+                if(mask & (1 << c)) fprintf(fp, "\"%s\": %.0lf, ", counterNames[c], count[c]);
+                else fprintf(fp, "\"%s\": null, ", counterNames[c]);
+            }
+            // misses per thousand instructions, memory traffic of the LLC misses per pixel
+            fprintf(fp, "\"ipc\": %.3lf", count[COUNTER_CYCLES] > 0 ? count[COUNTER_INSTRUCTIONS]/count[COUNTER_CYCLES] : 0.0);
+            for(c = COUNTER_L1D_MISSES; c < COUNTERS; c++){
+                if(mask & (1 << c))
+                    fprintf(fp, ", \"%s_per_kinst\": %.3lf", counterNames[c],
+                            count[COUNTER_INSTRUCTIONS] > 0 ? 1000.0*count[c]/count[COUNTER_INSTRUCTIONS] : 0.0);
+            }
+            if(mask & (1 << COUNTER_LLC_MISSES))
+                fprintf(fp, ", \"llc_bytes_per_pixel\": %.3lf", (double)CACHE_LINE*count[COUNTER_LLC_MISSES]/((double)ancho*altura));
+            if(i == PHASE_READ) fprintf(fp, ", \"file_bytes_per_pixel\": %.3lf", (double)bytesRead/((double)ancho*altura));
+            if(i == PHASE_STORE) fprintf(fp, ", \"file_bytes_per_pixel\": %.3lf", (double)bytesWritten/((double)ancho*altura));
+            fprintf(fp, "}%s\n", i != PHASE_STORE ? "," : "");
+        }
+        fprintf(fp, "  },\n");
+    }
+
+    fprintf(fp, "  \"per_rank\": [\n");
+    for(r = 0; r < ranks; r++){
+        fprintf(fp, "    {\"rank\": %d, \"elapsed_s\": %.6lf", r, recs[r*RANK_FIELDS + PHASES]);
+        for(i = 0; i < PHASES; i++)
+            fprintf(fp, ", \"%s_s\": %.6lf", phaseNames[i], recs[r*RANK_FIELDS + i]);
+        fprintf(fp, ", \"bytes_read\": %ld, \"bytes_written\": %ld, \"peak_rss_kb\": %ld, \"page_faults\": %ld, \"threads\": [",
+                (long)recs[r*RANK_FIELDS + PHASES+1], (long)recs[r*RANK_FIELDS + PHASES+2], (long)recs[r*RANK_FIELDS + PHASES+3],
+                (long)recs[r*RANK_FIELDS + REC_FAULTS]);
+        threads = (int)recs[r*RANK_FIELDS + PHASES+4];
+        for(i = 0; i < threads; i++)
+            fprintf(fp, "%s{\"thread\": %d, \"convolve_s\": %.6lf}", i ? ", " : "", i, recs[r*RANK_FIELDS + PHASES+5+i]);
+        fprintf(fp, "]}%s\n", r < ranks-1 ? "," : "");
+    }
+    fprintf(fp, "  ],\n");
+
+    fprintf(fp, "  \"per_partition\": [\n");
+    for(p = 0; p < t->partitions; p++){
+        fprintf(fp, "    {\"partition\": %d", p);
+        for(i = 0; i < PHASES; i++)
+            fprintf(fp, ", \"%s_s\": %.6lf", phaseNames[i], t->partition[p*PHASES + i]);
+        fprintf(fp, "}%s\n", p < t->partitions-1 ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+    fclose(fp);
+    return 0;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Thread pool
+// One pool of worker threads is shared by every plan of the process. Work is
+// submitted as a batch of numbered tasks; the thread that submits a batch
+// runs tasks of it too, then waits until every task of the batch is done.
+// Batches of different callers are queued, so several plans can be executed
+// at the same time. The pool grows to the largest number of threads a plan
+// asked for and lives as long as the process.
+///////////////////////////////////////////////////////////////////////////////
+#define POOL_MAX_THREADS TIMER_THREADS
+
+struct structbatch{
+    void (*task)(void *arg, int index, int worker);
+    void *arg;
+    int ntasks;
+    int next;                       // next task to hand out
+    int done;                       // finished tasks
+    struct structbatch *nextBatch;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;            // a batch was queued
+    pthread_cond_t done;            // a batch finished
+    struct structbatch *queue;      // batches with tasks left to hand out
+    int threads;                    // workers started
+} pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0};
+
+// Run tasks of the batch on the calling thread until every task is handed out. Called with the lock held.
+static void poolRunBatch(struct structbatch *batch, int worker){
+    struct structbatch **q;
+    int index;
+
+    while(batch->next < batch->ntasks){
+        index = batch->next++;
+        if(batch->next == batch->ntasks){
+            // nothing left to hand out, take the batch out of the queue
+            for(q = &pool.queue; *q; q = &(*q)->nextBatch){
+                if(*q == batch){
+                    *q = batch->nextBatch;
+                    break;
+                }
+            }
+        }
+        pthread_mutex_unlock(&pool.lock);
+        batch->task(batch->arg, index, worker);
+        pthread_mutex_lock(&pool.lock);
+        if(++batch->done == batch->ntasks) pthread_cond_broadcast(&pool.done);
+    }
+}
+
+static void *poolWorker(void *arg){
+    int worker = (int)(long)arg;
+
+    pthread_mutex_lock(&pool.lock);
+    for(;;){
+        while(pool.queue == NULL) pthread_cond_wait(&pool.work, &pool.lock);
+        poolRunBatch(pool.queue, worker);
+    }
+    return NULL;
+}
+
+// Start workers until the pool has threads-1 of them, the caller of a batch is the last thread.
+static void poolGrow(int threads){
+    pthread_t thread;
+
+    if(threads > POOL_MAX_THREADS) threads = POOL_MAX_THREADS;
+    pthread_mutex_lock(&pool.lock);
+    while(pool.threads < threads - 1){
+        if(pthread_create(&thread, NULL, poolWorker, (void *)(long)(pool.threads + 1)) != 0) break;
+        pthread_detach(thread);
+        pool.threads++;
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+// Run task(arg, index, worker) for index 0..ntasks-1 and wait for all of them. worker is 0 on the
+// calling thread and 1..threads on the workers.
+static void poolParallel(void (*task)(void *arg, int index, int worker), void *arg, int ntasks){
+    struct structbatch batch = {task, arg, ntasks, 0, 0, NULL};
+    struct structbatch **q;
+
+    if(ntasks <= 0) return;
+    pthread_mutex_lock(&pool.lock);
+    if(ntasks > 1 && pool.threads > 0){
+        for(q = &pool.queue; *q; q = &(*q)->nextBatch);
+        *q = &batch;
+        pthread_cond_broadcast(&pool.work);
+    }
+    poolRunBatch(&batch, 0);
+    while(batch.done < batch.ntasks) pthread_cond_wait(&pool.done, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Plan / execute
+// convExecute splits every channel in bands of rows, one task per channel
+// and band. The engines read the caller buffers directly when they are
+// contiguous planes; strided or interleaved images (and outputs that overlap
+// the input) go through contiguous copies that are also made by the tasks.
+///////////////////////////////////////////////////////////////////////////////
+#define EXEC_GATHER     0
+#define EXEC_CONVOLVE   1
+#define EXEC_SCATTER    2
+
+#define PAD_ALIGN       16  // ints, the rows of a padded plane start on a cache line
+#define STATS_BLOCK     65536   // ints of output convolved before their range is taken, while they are in cache
+
+const char *boundaryNames[CONV_BOUNDARIES] = {"zero", "clamp", "mirror", "wrap"};
+
+// Work of one convExecute call.
+struct structexec{
+    convPlan plan;
+    const convImage *in;
+    convImage *out;
+    int *src[CONV_MAX_CHANNELS];    // contiguous input channels, padded ones start at the ghost border
+    int *dst[CONV_MAX_CHANNELS];    // contiguous output channels
+    int bands;
+    int rowBegin, rowEnd;           // output rows written (convPlanSetRows)
+    int strided;                    // decimated output (convPlanSetStride)
+    int padX, padY;                 // ghost border of the padded input planes (convPlanSetBoundary)
+    int padFirst, padHeight;        // image rows of a padded plane: the ones read by rowBegin..rowEnd-1
+    int pitch;                      // ints between two rows of a padded plane
+    int lead;                       // ints before the first pixel of a padded row, padX rounded up to PAD_ALIGN
+    int stage;                      // EXEC_*
+    int status;
+    int min[CONV_MAX_CHANNELS*POOL_MAX_THREADS];   // range of the output of every task (plan->stats)
+    int max[CONV_MAX_CHANNELS*POOL_MAX_THREADS];
+};
+
+convImage convPlanar(int *R, int *G, int *B, int width, int height, int rowStride){
+    convImage img;
+
+    memset(&img, 0, sizeof(img));
+    img.width = width;
+    img.height = height;
+    img.channels = (G && B) ? 3 : 1;
+    img.data[0] = R;
+    img.data[1] = G;
+    img.data[2] = B;
+    img.pixelStride = 1;
+    img.rowStride = rowStride;
+    return img;
+}
+
+convImage convInterleaved(int *pixels, int width, int height, int channels, int rowStride){
+    convImage img;
+    int c;
+
+    memset(&img, 0, sizeof(img));
+    img.width = width;
+    img.height = height;
+    img.channels = channels;
+    for(c = 0; c < channels && c < CONV_MAX_CHANNELS; c++) img.data[c] = pixels + c;
+    img.pixelStride = channels;
+    img.rowStride = rowStride;
+    return img;
+}
+
+// Threads of a plan created with threads <= 0: CONVOLVE_THREADS, or the online processors.
+int convDefaultThreads(void){
+    char *env = getenv("CONVOLVE_THREADS");
+    long n = (env && env[0]) ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+
+    if(n < 1) n = 1;
+    if(n > POOL_MAX_THREADS) n = POOL_MAX_THREADS;
+    return (int)n;
+}
+
+convPlan convPlanCreate(kernelData kern, int width, int height, int threads, int ranks, int flags){
+    convPlan plan;
+    kernelData prepared;
+    int *sample;
+    long i, rows;
+
+    if(!kern || width <= 0 || height <= 0) return NULL;
+    if((plan = (convPlan) calloc(1, sizeof(struct structplan))) == NULL) return NULL;
+    plan->kern = *kern;
+    plan->width = width;
+    plan->height = height;
+    plan->threads = (threads > 0) ? threads : convDefaultThreads();
+    if(plan->threads > POOL_MAX_THREADS) plan->threads = POOL_MAX_THREADS;
+    plan->stride = 1;
+    poolGrow(plan->threads);
+
+    if((flags & CONV_PLAN_MEASURE) && (prepared = cachedKernel(kern, width)) != NULL){
+        // planned before for this kernel and width
+        setEngine(&plan->kern, prepared->engine, prepared->tileX);
+        freeKernel(prepared);
+        if(flags & CONV_PLAN_EXPLAIN)
+            printf("Plan: engine=%s tile=%d (from kernel cache)\n", engineNames[plan->kern.engine], plan->kern.tileX);
+    }
+    else if(flags & CONV_PLAN_MEASURE){
+        // the engines are timed on the first rows of a synthetic image, their speed does not depend on the pixels
+        rows = (height < PLAN_SAMPLE_ROWS + kern->kernelY) ? height : PLAN_SAMPLE_ROWS + kern->kernelY;
+        if((sample = (int *)malloc(width*rows*sizeof(int))) == NULL){
+            free(plan);
+            return NULL;
+        }
+        for(i = 0; i < width*rows; i++) sample[i] = (int)(i*7 % 256);
+        planConvolution(&plan->kern, sample, width, rows, plan->threads, ranks, flags & CONV_PLAN_EXPLAIN);
+        free(sample);
+        cacheKernel(&plan->kern, width);
+    }
+    else if(flags & CONV_PLAN_EXPLAIN)
+        printf("Plan: engine=%s tile=%d (default)\n", engineNames[plan->kern.engine], plan->kern.tileX);
+    return plan;
+}
+
+// Use the given engine and tile instead of the planned ones (e.g. the plan of another rank).
+int convPlanSetEngine(convPlan plan, int engine, int tileX){
+    return setEngine(&plan->kern, engine, tileX);
+}
+
+// Keep one output pixel out of stride x stride, starting at the input row firstRow and column 0.
+int convPlanSetStride(convPlan plan, int stride, int firstRow){
+    if(!plan || stride < 1 || firstRow < 0) return -1;
+    plan->stride = stride;
+    plan->firstRow = firstRow;
+    return 0;
+}
+
+// Only write the output rows rowBegin..rowEnd-1; the rows around them are still read as input. Ranks
+// that share the planes of an image convolve their own rows of it in place. rowEnd 0 = every row.
+int convPlanSetRows(convPlan plan, int rowBegin, int rowEnd){
+    if(!plan || rowBegin < 0 || (rowEnd && rowEnd < rowBegin)) return -1;
+    plan->rowBegin = rowBegin;
+    plan->rowEnd = rowEnd;
+    return 0;
+}
+
+// Convolve copies of the input with a ghost border of the kernel radius filled with the given
+// CONV_BOUNDARY_* mode. The planned engine runs on them, a decimated output uses the generic
+// convolvePadded. The zero border is the one of the engines and needs no copy.
+int convPlanSetBoundary(convPlan plan, int boundary){
+    if(!plan || boundary < 0 || boundary >= CONV_BOUNDARIES) return -1;
+    plan->boundary = boundary;
+    plan->padded = (boundary != CONV_BOUNDARY_ZERO);
+    return 0;
+}
+
+void convPlanDestroy(convPlan plan){
+    free(plan);
+}
+
+// Empty range, before the first execution. Ranges of several ranks are merged with min and max.
+void convStatsReset(convStats *stats){
+    stats->min = INT_MAX;
+    stats->max = INT_MIN;
+    stats->pixels = 0;
+}
+
+// Map the range of stats to 0..maxcolor, in place, rounding to the nearest. A flat range becomes 0.
+int convRescale(const convImage *img, const convStats *stats, int maxcolor){
+    long long range = (long long)stats->max - stats->min;
+    int c, i, j, *p;
+
+    if(!img || !stats || range < 0 || maxcolor < 0) return -1;
+    for(c = 0; c < img->channels; c++)
+        for(i = 0; i < img->height; i++){
+            p = img->data[c] + (long)i*img->rowStride;
+            for(j = 0; j < img->width; j++, p += img->pixelStride)
+                *p = range ? (int)((2*((long long)*p - stats->min)*maxcolor + range) / (2*range)) : 0;
+        }
+    return 0;
+}
+
+static int denseChannel(const convImage *img){
+    return img->pixelStride == 1 && img->rowStride == img->width;
+}
+
+// Memory of channel c of the image, [first, last) int addresses.
+static void channelRange(const convImage *img, int c, const int **first, const int **last){
+    *first = img->data[c];
+    *last = img->data[c] + (long)(img->height-1)*img->rowStride + (long)(img->width-1)*img->pixelStride + 1;
+}
+
+static int overlaps(const convImage *in, const convImage *out, int c){
+    const int *a0, *a1, *b0, *b1;
+    int k;
+
+    channelRange(out, c, &b0, &b1);
+    for(k = 0; k < in->channels; k++){
+        channelRange(in, k, &a0, &a1);
+        if(a0 < b1 && b0 < a1) return 1;
+    }
+    return 0;
+}
+
+// Pixel of a row or column of n pixels that the out of image coordinate i reads.
+static int boundaryIndex(int i, int n, int boundary){
+    int period;
+
+    if(i >= 0 && i < n) return i;
+    switch(boundary){
+    case CONV_BOUNDARY_CLAMP:
+        return (i < 0) ? 0 : n-1;
+    case CONV_BOUNDARY_MIRROR:         // ... 2 1 | 0 1 2 ... n-1 | n-2 ...
+        if(n == 1) return 0;
+        period = 2*(n-1);
+        i %= period;
+        if(i < 0) i += period;
+        return (i < n) ? i : period - i;
+    case CONV_BOUNDARY_WRAP:
+        i %= n;
+        return (i < 0) ? i + n : i;
+    }
+    return -1;                          // zero
+}
+
+// Rows rowBegin..rowEnd-1 of a padded plane (0 is the image row padFirst, a ghost row above the
+// image when it is negative).
+static void padRows(struct structexec *x, int c, int rowBegin, int rowEnd){
+    const convImage *in = x->in;
+    int i, j, y, col, *row;
+    const int *p;
+
+    for(i = rowBegin; i < rowEnd; i++){
+        row = x->src[c] + (long)(i - x->padY)*x->pitch - x->padX;
+        y = boundaryIndex(x->padFirst + i, in->height, x->plan->boundary);
+        if(y < 0){
+            memset(row, 0, (in->width + 2*x->padX)*sizeof(int));
+            continue;
+        }
+        p = in->data[c] + (long)y*in->rowStride;
+        for(j = 0; j < in->width + 2*x->padX; j++){
+            col = boundaryIndex(j - x->padX, in->width, x->plan->boundary);
+            row[j] = (col < 0) ? 0 : p[(long)col*in->pixelStride];
+        }
+        // up to the pitch, the planned engines read them for the discarded columns
+        memset(row + j, 0, (x->pitch - j)*sizeof(int));
+    }
+}
+
+// Convolution of a padded plane: every tap is inside the plane, so there is no bounds check.
+// The output pixel (i,j) is the convolution at (firstRow + stride*i, stride*j). A row is
+// accumulated tap by tap in the order of convolve2D, the inner loop runs along the row.
+static int convolvePadded(int *in, int pitch, int *out, int outSizeX, int firstRow, int stride,
+                          int rowBegin, int rowEnd, kernelData kern)
+{
+    int i, j, m, n;
+    int kCenterX = kern->kernelX / 2, kCenterY = kern->kernelY / 2;
+    const int *inPtr;
+    float w, *sum;
+
+    if((sum = (float *)malloc(outSizeX*sizeof(float))) == NULL) return -1;
+    for(i = rowBegin; i < rowEnd; i++){
+        for(j = 0; j < outSizeX; j++) sum[j] = 0;
+        for(m = 0; m < kern->kernelY; m++){
+            for(n = 0; n < kern->kernelX; n++){
+                w = kern->vkern[m*kern->kernelX + n];
+                inPtr = in + (long)(firstRow + stride*i + kCenterY - m)*pitch + kCenterX - n;
+                if(stride == 1)
+                    for(j = 0; j < outSizeX; j++) sum[j] += inPtr[j] * w;
+                else
+                    for(j = 0; j < outSizeX; j++) sum[j] += inPtr[(long)stride*j] * w;
+            }
+        }
+        for(j = 0; j < outSizeX; j++)
+            out[(long)i*outSizeX + j] = (sum[j] >= 0) ? (int)(sum[j] + 0.5f) : (int)(sum[j] - 0.5f);
+    }
+    free(sum);
+    return 0;
+}
+
+// Rows rowBegin..rowEnd-1 of a padded plane with the planned engine. The plane is seen as an
+// image of pitch columns whose columns padX..padX+width-1 are the image ones: the bounds checks
+// of the engine only clip the ghost border, that no output row kept reads past. The rows are
+// convolved into a band as wide as the pitch and their image columns copied to the output.
+static int convolvePaddedPlanned(struct structexec *x, int c, int rowBegin, int rowEnd){
+    kernelData kern = &x->plan->kern;
+    int i, rows = rowEnd - rowBegin, width = x->out->width;
+    int *in, *band;
+
+    // the output row i is the plane row i-padFirst, the band starts padY rows above it
+    in = x->src[c] + (long)(rowBegin - x->padFirst - 2*x->padY)*x->pitch - x->padX;
+    if((band = (int *)malloc((long)(rows + 2*x->padY)*x->pitch*sizeof(int))) == NULL) return -1;
+    if(kern->convolve(in, band, x->pitch, rows + 2*x->padY, x->padY, x->padY + rows, kern)){
+        free(band);
+        return -1;
+    }
+    for(i = 0; i < rows; i++)
+        memcpy(x->dst[c] + (long)(rowBegin + i)*width, band + (long)(x->padY + i)*x->pitch + x->padX, width*sizeof(int));
+    free(band);
+    return 0;
+}
+
+static void execTask(void *arg, int index, int worker){
+    struct structexec *x = (struct structexec *)arg;
+    convPlan plan = x->plan;
+    int c = index / x->bands, band = index % x->bands;
+    int width = x->in->width, height = x->in->height;
+    int outWidth = x->out->width;
+    int rowBegin = (int)((long)height*band/x->bands);
+    int rowEnd = (int)((long)height*(band+1)/x->bands);
+    int i, j, block, last, *p;
+    double start = 0;
+
+    // the bands of the convolution and the scatter are the output rows written
+    if(x->stage != EXEC_GATHER){
+        rowBegin = x->rowBegin + (int)((long)(x->rowEnd - x->rowBegin)*band/x->bands);
+        rowEnd = x->rowBegin + (int)((long)(x->rowEnd - x->rowBegin)*(band+1)/x->bands);
+    }
+    switch(x->stage){
+    case EXEC_GATHER:
+        if(x->pitch){
+            // the ghost rows are shared among the bands as well
+            padRows(x, c, (int)((long)x->padHeight*band/x->bands), (int)((long)x->padHeight*(band+1)/x->bands));
+            return;
+        }
+        if(x->src[c] == x->in->data[c]) return;
+        for(i = rowBegin; i < rowEnd; i++){
+            p = x->in->data[c] + (long)i*x->in->rowStride;
+            for(j = 0; j < width; j++) x->src[c][(long)i*width + j] = p[(long)j*x->in->pixelStride];
+        }
+        return;
+    case EXEC_CONVOLVE:
+        if(plan->timers){
+            start = timerNow();
+            counterStart(plan->timers);
+        }
+        // with plan->stats the band is convolved in blocks of rows, and the range of every block is
+        // taken right after it is written
+        block = plan->stats ? STATS_BLOCK / outWidth : rowEnd - rowBegin;
+        if(block < 4*plan->kern.kernelY) block = 4*plan->kern.kernelY;
+        x->min[index] = INT_MAX;
+        x->max[index] = INT_MIN;
+        for(i = rowBegin; i < rowEnd; i += block){
+            last = (i + block < rowEnd) ? i + block : rowEnd;
+            // the padded plane starts at the image row padFirst+padY
+            if(x->pitch && !x->strided ? convolvePaddedPlanned(x, c, i, last) :
+               x->pitch ? convolvePadded(x->src[c], x->pitch, x->dst[c], outWidth, plan->firstRow - x->padFirst - x->padY,
+                                         plan->stride, i, last, &plan->kern) :
+               x->strided ? convolve2DStrided(x->src[c], x->dst[c], width, height, plan->firstRow, plan->stride,
+                                              outWidth, i, last, &plan->kern)
+                          : plan->kern.convolve(x->src[c], x->dst[c], width, height, i, last, &plan->kern))
+                __atomic_store_n(&x->status, -1, __ATOMIC_RELAXED);
+            if(plan->stats){
+                int lo = x->min[index], hi = x->max[index];
+                for(p = x->dst[c] + (long)i*outWidth; p < x->dst[c] + (long)last*outWidth; p++){
+                    lo = (*p < lo) ? *p : lo;
+                    hi = (*p > hi) ? *p : hi;
+                }
+                x->min[index] = lo;
+                x->max[index] = hi;
+            }
+        }
+        if(plan->timers){
+            counterStop(plan->timers, worker, PHASE_CONV);
+            timerThread(plan->timers, worker, timerNow() - start);
+        }
+        return;
+    case EXEC_SCATTER:
+        if(x->dst[c] == x->out->data[c]) return;
+        for(i = rowBegin; i < rowEnd; i++){
+            p = x->out->data[c] + (long)i*x->out->rowStride;
+            for(j = 0; j < outWidth; j++) p[(long)j*x->out->pixelStride] = x->dst[c][(long)i*outWidth + j];
+        }
+        return;
+    }
+}
+
+// Work plane of convExecute, from the arena of the thread when there is one. Aligned to a cache line.
+static void *scratchAlloc(convArena arena, size_t bytes){
+    if(arena) return arenaAlloc(arena, bytes);
+    return aligned_alloc(ARENA_ALIGN, (bytes + ARENA_ALIGN-1) / ARENA_ALIGN * ARENA_ALIGN);
+}
+
+// Convolve every channel of in into out. Both images must have the same size and channels, or
+// the output is decimated (convPlanSetStride) and has at most one pixel per sample of the input.
+int convExecute(convPlan plan, const convImage *in, convImage *out){
+    struct structexec x;
+    int c, copies = 0;
+    convArena arena = threadArena;
+    size_t mark = arena ? arena->used : 0;
+
+    if(!plan || !in || !out) return -1;
+    memset(&x, 0, sizeof(x));
+    x.strided = plan->stride > 1 || plan->firstRow > 0;
+    if(in->width <= 0 || in->height <= 0 || out->width <= 0 || out->height <= 0) return -1;
+    if(!x.strided && (in->width != out->width || in->height != out->height)) return -1;
+    if(x.strided && (out->width > (in->width + plan->stride - 1)/plan->stride ||
+                     plan->firstRow + (long)(out->height-1)*plan->stride >= in->height)) return -1;
+    if(in->channels < 1 || in->channels > CONV_MAX_CHANNELS || in->channels != out->channels) return -1;
+
+    x.plan = plan;
+    x.in = in;
+    x.out = out;
+    x.rowBegin = plan->rowBegin;
+    x.rowEnd = plan->rowEnd ? plan->rowEnd : out->height;
+    if(x.rowEnd > out->height || x.rowBegin >= x.rowEnd) return -1;
+    x.bands = (plan->threads < in->height) ? plan->threads : in->height;
+    if(x.bands > x.rowEnd - x.rowBegin) x.bands = x.rowEnd - x.rowBegin;
+    if(plan->padded){
+        x.padX = plan->kern.kernelX / 2;
+        x.padY = plan->kern.kernelY / 2;
+        x.pitch = (in->width + 2*x.padX + PAD_ALIGN-1) / PAD_ALIGN * PAD_ALIGN;
+        x.lead = (x.padX + PAD_ALIGN-1) / PAD_ALIGN * PAD_ALIGN;
+        // only the rows read by the output rows written, the ranks sharing an image pad their own rows
+        x.padFirst = plan->firstRow + plan->stride*x.rowBegin - x.padY;
+        x.padHeight = plan->firstRow + plan->stride*(x.rowEnd-1) + x.padY + 1 - x.padFirst;
+    }
+    for(c = 0; c < in->channels; c++){
+        if(!in->data[c] || !out->data[c]) return -1;
+        x.src[c] = (denseChannel(in) && !x.pitch) ? in->data[c] : NULL;
+        x.dst[c] = (denseChannel(out) && !overlaps(in, out, c)) ? out->data[c] : NULL;
+    }
+    for(c = 0; c < in->channels && x.status == 0; c++){
+        if(x.pitch){
+            // ghost border planes, the first pixel of every image row is aligned
+            x.src[c] = (int *)scratchAlloc(arena, ((long)x.pitch*x.padHeight + x.lead)*sizeof(int));
+            if(!x.src[c]) x.status = -1;
+            else x.src[c] += (long)x.padY*x.pitch + x.lead;
+        }
+        else if(!x.src[c] && (x.src[c] = (int *)scratchAlloc(arena, (long)in->width*in->height*sizeof(int))) == NULL)
+            x.status = -1;
+        if(x.status == 0 && !x.dst[c] && (x.dst[c] = (int *)scratchAlloc(arena, (long)out->width*out->height*sizeof(int))) == NULL)
+            x.status = -1;
+    }
+
+    if(x.status == 0){
+        for(c = 0; c < in->channels; c++)
+            if(x.src[c] != in->data[c] || x.dst[c] != out->data[c]) copies = 1;
+        for(x.stage = EXEC_GATHER; x.stage <= EXEC_SCATTER; x.stage++){
+            if(x.stage != EXEC_CONVOLVE && !copies) continue;
+            poolParallel(execTask, &x, in->channels*x.bands);
+        }
+        // merge the range of the tasks
+        if(plan->stats && x.status == 0){
+            for(c = 0; c < in->channels*x.bands; c++){
+                if(x.min[c] < plan->stats->min) plan->stats->min = x.min[c];
+                if(x.max[c] > plan->stats->max) plan->stats->max = x.max[c];
+            }
+            plan->stats->pixels += (long)in->channels*(x.rowEnd - x.rowBegin)*out->width;
+        }
+    }
+
+    if(arena) arena->used = mark;
+    else for(c = 0; c < in->channels; c++){
+        if(x.pitch && x.src[c]) free(x.src[c] - (long)x.padY*x.pitch - x.lead);
+        else if(x.src[c] != in->data[c]) free(x.src[c]);
+        if(x.dst[c] != out->data[c]) free(x.dst[c]);
+    }
+    return x.status;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Iterated convolution
+// convIterate applies the kernel several times, every step convolving the
+// result of the previous one. Instead of a pass over the whole image per
+// step, the rows are split in tiles that advance depth steps at a time
+// (temporal blocking): a tile reads its rows plus depth*radius rows above
+// and below, and every step computes radius rows less on each side (a
+// trapezoid), so the rows of the tile are exact after depth steps. The
+// intermediate steps stay in two buffers of the worker, sized to stay in
+// cache, and the whole planes are only read and written once per depth
+// steps. The rows convolved again by the neighbour tiles are the price,
+// they are kept small against the tiles. The image border is zero, as in
+// convExecute without boundary.
+///////////////////////////////////////////////////////////////////////////////
+#define ITER_GATHER     0
+#define ITER_CONVOLVE   1
+#define ITER_SCATTER    2
+
+#define ITER_CACHE      (1 << 22)   // bytes of the two buffers of a worker, about its share of the caches
+#define ITER_MAX_DEPTH  64          // steps of a tile between two passes over the planes
+
+// Work of one convIterate call.
+struct structiter{
+    convPlan plan;
+    const convImage *in;
+    convImage *out;
+    int *a[CONV_MAX_CHANNELS];      // contiguous planes: the steps done so far
+    int *b[CONV_MAX_CHANNELS];      // and the result of the next depth steps
+    int tiles;                      // tiles of rows per channel
+    int tileRows;
+    int depth;                      // steps of this pass
+    int bufRows;                    // rows of a buffer of a worker
+    int *buf[POOL_MAX_THREADS];     // two buffers per worker, allocated by its first tile
+    int stage;                      // ITER_*
+    int status;
+};
+
+static void iterTask(void *arg, int index, int worker){
+    struct structiter *x = (struct structiter *)arg;
+    convPlan plan = x->plan;
+    int c = index / x->tiles, tile = index % x->tiles;
+    int width = x->in->width, height = x->in->height;
+    int radius = plan->kern.kernelY / 2;
+    int rowBegin = tile*x->tileRows;
+    int rowEnd = (rowBegin + x->tileRows < height) ? rowBegin + x->tileRows : height;
+    int i, j, s, lo, hi, rows, first, last, *src, *dst, *p;
+    double start = 0;
+
+    switch(x->stage){
+    case ITER_GATHER:
+        for(i = rowBegin; i < rowEnd; i++){
+            p = x->in->data[c] + (long)i*x->in->rowStride;
+            for(j = 0; j < width; j++) x->a[c][(long)i*width + j] = p[(long)j*x->in->pixelStride];
+        }
+        return;
+    case ITER_CONVOLVE:
+        if(plan->timers){
+            start = timerNow();
+            counterStart(plan->timers);
+        }
+        // the trapezoid: rows lo..hi-1 of the planes, radius rows less on each inner side per step
+        lo = (rowBegin - x->depth*radius > 0) ? rowBegin - x->depth*radius : 0;
+        hi = (rowEnd + x->depth*radius < height) ? rowEnd + x->depth*radius : height;
+        rows = hi - lo;
+        if(x->depth > 1 && !x->buf[worker] &&
+           (x->buf[worker] = (int *)malloc(2L*x->bufRows*width*sizeof(int))) == NULL){
+            __atomic_store_n(&x->status, -1, __ATOMIC_RELAXED);
+            return;
+        }
+        // the first step reads the plane, the last one writes the rows of the tile to the other plane
+        src = x->a[c] + (long)lo*width;
+        for(s = 1; s <= x->depth; s++){
+            first = (lo > 0) ? s*radius : 0;
+            last = (hi < height) ? rows - s*radius : rows;
+            if(s == x->depth){
+                dst = x->b[c] + (long)lo*width;
+                first = rowBegin - lo;
+                last = rowEnd - lo;
+            }
+            else dst = x->buf[worker] + (long)(s % 2)*x->bufRows*width;
+            if(plan->kern.convolve(src, dst, width, rows, first, last, &plan->kern))
+                __atomic_store_n(&x->status, -1, __ATOMIC_RELAXED);
+            src = dst;
+        }
+        if(plan->timers){
+            counterStop(plan->timers, worker, PHASE_CONV);
+            timerThread(plan->timers, worker, timerNow() - start);
+        }
+        return;
+    case ITER_SCATTER:
+        for(i = rowBegin; i < rowEnd; i++){
+            p = x->out->data[c] + (long)i*x->out->rowStride;
+            for(j = 0; j < width; j++) p[(long)j*x->out->pixelStride] = x->a[c][(long)i*width + j];
+        }
+        return;
+    }
+}
+
+// Convolve every channel of in iterations times into out (same size and channels, it may be in).
+// The plan must not decimate nor have a boundary other than zero, plan->stats is not gathered.
+int convIterate(convPlan plan, const convImage *in, convImage *out, int iterations){
+    struct structiter x;
+    int c, i, done, depth, radius, cacheRows, bands, *t;
+    convArena arena = threadArena;
+    size_t mark = arena ? arena->used : 0;
+
+    if(!plan || !in || !out || iterations < 1) return -1;
+    if(plan->stride > 1 || plan->firstRow > 0 || plan->padded || plan->rowEnd) return -1;
+    if(in->width <= 0 || in->height <= 0 || in->width != out->width || in->height != out->height) return -1;
+    if(in->channels < 1 || in->channels > CONV_MAX_CHANNELS || in->channels != out->channels) return -1;
+    memset(&x, 0, sizeof(x));
+    x.plan = plan;
+    x.in = in;
+    x.out = out;
+
+    // depth: the trapezoids take at most a quarter of the buffers, so the rows convolved again by
+    // the neighbour tiles stay below about 1/6. The tiles fill the rest, and there are enough of
+    // them for the threads.
+    radius = plan->kern.kernelY / 2;
+    cacheRows = ITER_CACHE / (2 * in->width * (int)sizeof(int));
+    depth = radius ? cacheRows / (8*radius) : ITER_MAX_DEPTH;
+    if(depth > ITER_MAX_DEPTH) depth = ITER_MAX_DEPTH;
+    if(depth > iterations) depth = iterations;
+    if(depth < 1) depth = 1;
+    x.tileRows = cacheRows - 2*depth*radius;
+    bands = (plan->threads + in->channels - 1) / in->channels;
+    if(x.tileRows > (in->height + bands - 1) / bands) x.tileRows = (in->height + bands - 1) / bands;
+    if(x.tileRows < 1) x.tileRows = 1;
+    x.tiles = (in->height + x.tileRows - 1) / x.tileRows;
+    x.bufRows = x.tileRows + 2*depth*radius;
+
+    for(c = 0; c < in->channels && x.status == 0; c++){
+        if(!in->data[c] || !out->data[c] ||
+           (x.a[c] = (int *)scratchAlloc(arena, (long)in->width*in->height*sizeof(int))) == NULL ||
+           (x.b[c] = (int *)scratchAlloc(arena, (long)in->width*in->height*sizeof(int))) == NULL)
+            x.status = -1;
+    }
+
+    if(x.status == 0){
+        x.stage = ITER_GATHER;
+        poolParallel(iterTask, &x, in->channels*x.tiles);
+        // one pass over the planes per depth steps
+        x.stage = ITER_CONVOLVE;
+        for(done = 0; done < iterations && x.status == 0; done += x.depth){
+            x.depth = (iterations - done < depth) ? iterations - done : depth;
+            poolParallel(iterTask, &x, in->channels*x.tiles);
+            for(c = 0; c < in->channels; c++){
+                t = x.a[c];
+                x.a[c] = x.b[c];
+                x.b[c] = t;
+            }
+        }
+        x.stage = ITER_SCATTER;
+        if(x.status == 0) poolParallel(iterTask, &x, in->channels*x.tiles);
+    }
+
+    for(i = 0; i < POOL_MAX_THREADS; i++) free(x.buf[i]);
+    if(arena) arena->used = mark;
+    else for(c = 0; c < in->channels; c++){
+        free(x.a[c]);
+        free(x.b[c]);
+    }
+    return x.status;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Frame sequences
+// Consecutive frames of a fixed camera differ in a few places. Every input
+// tile is compared with the tile of the previous frame and keeps the bounding
+// box of its changed pixels; an output tile is convolved again only when one
+// of these boxes, grown by the kernel radius, reaches it. The other tiles
+// keep the previous result, so the work follows the motion, not the tiles
+// around it.
+// The results are kept in contiguous planes and copied to the caller image.
+///////////////////////////////////////////////////////////////////////////////
+#define SEQ_GATHER      0
+#define SEQ_CONVOLVE    1
+#define SEQ_SCATTER     2
+
+// Work of one convSequenceExecute call.
+struct structseqexec{
+    convSequence seq;
+    const convImage *in;
+    convImage *out;
+    int *todo;                      // dirty tiles to convolve
+    int stage;                      // SEQ_*
+    int status;
+};
+
+// Tile t of the frame, [x0,x1) x [y0,y1).
+static void seqTile(convSequence seq, int t, int *x0, int *x1, int *y0, int *y1){
+    *x0 = (t % seq->tilesX)*seq->tile;
+    *y0 = (t / seq->tilesX)*seq->tile;
+    *x1 = (*x0 + seq->tile < seq->width) ? *x0 + seq->tile : seq->width;
+    *y1 = (*y0 + seq->tile < seq->height) ? *y0 + seq->tile : seq->height;
+}
+
+// Convolve [x0,x1) x [y0,y1) of the plane in into the same pixels of out. Where the whole window
+// is inside the image, a row of the tile is accumulated tap by tap (in the order of convolve2D)
+// into sum, which has room for x1-x0 values.
+static void convolveTile(int *in, int *out, int width, int height, int x0, int x1, int y0, int y1,
+                         kernelData kern, float *sum)
+{
+    int i, j, m, n, a, b;
+    int kCenterX = kern->kernelX / 2, kCenterY = kern->kernelY / 2;
+    const int *inPtr;
+    float w, v;
+
+    // columns [a,b) have every tap inside the image
+    a = (x0 > kCenterX) ? x0 : kCenterX;
+    b = (x1 < width - kCenterX) ? x1 : width - kCenterX;
+    for(i = y0; i < y1; i++){
+        if(i < kCenterY || i + kCenterY >= height || a >= b){
+            for(j = x0; j < x1; j++){
+                v = convolveSample(in, width, height, kern, i, j);
+                out[(long)i*width + j] = (v >= 0) ? (int)(v + 0.5f) : (int)(v - 0.5f);
+            }
+            continue;
+        }
+        for(j = a; j < b; j++) sum[j-a] = 0;
+        for(m = 0; m < kern->kernelY; m++)
+            for(n = 0; n < kern->kernelX; n++){
+                w = kern->vkern[m*kern->kernelX + n];
+                inPtr = in + (long)(i + kCenterY - m)*width + kCenterX - n;
+                for(j = a; j < b; j++) sum[j-a] += inPtr[j] * w;
+            }
+        for(j = x0; j < x1; j++){
+            v = (j >= a && j < b) ? sum[j-a] : convolveSample(in, width, height, kern, i, j);
+            out[(long)i*width + j] = (v >= 0) ? (int)(v + 0.5f) : (int)(v - 0.5f);
+        }
+    }
+}
+
+static void seqTask(void *arg, int index, int worker){
+    struct structseqexec *x = (struct structseqexec *)arg;
+    convSequence seq = x->seq;
+    convPlan plan = seq->plan;
+    int c, i, j, x0, x1, y0, y1, *box;
+    const int *p;
+    int *q;
+    float *sum;
+    double start = 0;
+
+    switch(x->stage){
+    case SEQ_GATHER:
+        // copy the tile into the planes of the sequence, with the box of the pixels that differ from
+        // the previous frame (the whole tile on the first frame)
+        seqTile(seq, index, &x0, &x1, &y0, &y1);
+        box = seq->box + 4*index;
+        box[0] = x1; box[1] = x0; box[2] = y1; box[3] = y0;
+        if(seq->frames == 0){
+            box[0] = x0; box[1] = x1; box[2] = y0; box[3] = y1;
+        }
+        for(c = 0; c < seq->channels; c++)
+            for(i = y0; i < y1; i++){
+                p = x->in->data[c] + (long)i*x->in->rowStride;
+                q = seq->src[c] + (long)i*seq->width;
+                for(j = x0; j < x1; j++){
+                    if(seq->frames == 0){
+                        q[j] = p[(long)j*x->in->pixelStride];
+                        continue;
+                    }
+                    if(q[j] == p[(long)j*x->in->pixelStride]) continue;
+                    q[j] = p[(long)j*x->in->pixelStride];
+                    if(j < box[0]) box[0] = j;
+                    if(j >= box[1]) box[1] = j + 1;
+                    if(i < box[2]) box[2] = i;
+                    if(i >= box[3]) box[3] = i + 1;
+                }
+            }
+        seq->changed[index] = (box[0] < box[1]);
+        return;
+    case SEQ_CONVOLVE:
+        if(plan->timers){
+            start = timerNow();
+            counterStart(plan->timers);
+        }
+        seqTile(seq, x->todo[index], &x0, &x1, &y0, &y1);
+        if((sum = (float *)malloc(seq->tile*sizeof(float))) == NULL){
+            __atomic_store_n(&x->status, -1, __ATOMIC_RELAXED);
+            return;
+        }
+        for(c = 0; c < seq->channels; c++)
+            convolveTile(seq->src[c], seq->dst[c], seq->width, seq->height, x0, x1, y0, y1, &plan->kern, sum);
+        free(sum);
+        if(plan->timers){
+            counterStop(plan->timers, worker, PHASE_CONV);
+            timerThread(plan->timers, worker, timerNow() - start);
+        }
+        return;
+    case SEQ_SCATTER:
+        // every tile, the unchanged ones come from the previous frames
+        seqTile(seq, index, &x0, &x1, &y0, &y1);
+        for(c = 0; c < seq->channels; c++)
+            for(i = y0; i < y1; i++){
+                q = x->out->data[c] + (long)i*x->out->rowStride;
+                p = seq->dst[c] + (long)i*seq->width;
+                for(j = x0; j < x1; j++) q[(long)j*x->out->pixelStride] = p[j];
+            }
+        return;
+    }
+}
+
+// Sequence of frames convolved with the kernel of plan, in tiles of tile x tile pixels
+// (0 = SEQ_TILE). The plan must outlive the sequence. Its engine, stride and boundary are not
+// used: the tiles are convolved in the order of convolve2D, with zeros out of the image.
+convSequence convSequenceCreate(convPlan plan, int tile){
+    convSequence seq;
+
+    if(!plan || tile < 0) return NULL;
+    if((seq = (convSequence) calloc(1, sizeof(struct structsequence))) == NULL) return NULL;
+    seq->plan = plan;
+    seq->tile = tile ? tile : SEQ_TILE;
+    return seq;
+}
+
+static void seqRelease(convSequence seq){
+    int c;
+
+    for(c = 0; c < CONV_MAX_CHANNELS; c++){
+        free(seq->src[c]);
+        free(seq->dst[c]);
+        seq->src[c] = seq->dst[c] = NULL;
+    }
+    free(seq->box);
+    free(seq->changed);
+    seq->box = NULL;
+    seq->changed = NULL;
+    seq->frames = 0;
+}
+
+// Convolve the next frame into out (same size and channels). The first frame, and a frame
+// whose size or channels differ from the previous one, are convolved whole.
+int convSequenceExecute(convSequence seq, const convImage *in, convImage *out){
+    struct structseqexec x;
+    int c, t, u, tx, ty, ry, rx, ntiles, ntodo = 0;
+    int x0, x1, y0, y1, ax, bx, ay, by, *box;
+
+    if(!seq || !in || !out) return -1;
+    if(in->width <= 0 || in->height <= 0 || in->width != out->width || in->height != out->height) return -1;
+    if(in->channels < 1 || in->channels > CONV_MAX_CHANNELS || in->channels != out->channels) return -1;
+    for(c = 0; c < in->channels; c++)
+        if(!in->data[c] || !out->data[c]) return -1;
+
+    if(seq->frames && (in->width != seq->width || in->height != seq->height || in->channels != seq->channels))
+        seqRelease(seq);
+    if(seq->frames == 0){
+        seqRelease(seq);
+        seq->width = in->width;
+        seq->height = in->height;
+        seq->channels = in->channels;
+        seq->tilesX = (in->width + seq->tile - 1)/seq->tile;
+        seq->tilesY = (in->height + seq->tile - 1)/seq->tile;
+        ntiles = seq->tilesX*seq->tilesY;
+        if((seq->box = (int *)calloc(4*ntiles, sizeof(int))) == NULL ||
+           (seq->changed = (unsigned char *)calloc(ntiles, 1)) == NULL){
+            seqRelease(seq);
+            return -1;
+        }
+        for(c = 0; c < in->channels; c++)
+            if((seq->src[c] = (int *)malloc((long)in->width*in->height*sizeof(int))) == NULL ||
+               (seq->dst[c] = (int *)malloc((long)in->width*in->height*sizeof(int))) == NULL){
+                seqRelease(seq);
+                return -1;
+            }
+    }
+    ntiles = seq->tilesX*seq->tilesY;
+
+    memset(&x, 0, sizeof(x));
+    x.seq = seq;
+    x.in = in;
+    x.out = out;
+    if((x.todo = (int *)malloc(ntiles*sizeof(int))) == NULL) return -1;
+
+    x.stage = SEQ_GATHER;
+    poolParallel(seqTask, &x, ntiles);
+
+    // an output tile is dirty when the changed box of an input tile, grown by the reach of the
+    // kernel, overlaps it: the input pixel (y,x) is read by the output rows y-ay .. y+by and the
+    // columns x-ax .. x+bx
+    ax = seq->plan->kern.kernelX/2;
+    bx = seq->plan->kern.kernelX - 1 - ax;
+    ay = seq->plan->kern.kernelY/2;
+    by = seq->plan->kern.kernelY - 1 - ay;
+    rx = (seq->plan->kern.kernelX/2 + seq->tile - 1)/seq->tile;
+    ry = (seq->plan->kern.kernelY/2 + seq->tile - 1)/seq->tile;
+    for(t = 0; t < ntiles; t++){
+        seqTile(seq, t, &x0, &x1, &y0, &y1);
+        for(u = 0, ty = t/seq->tilesX - ry; ty <= t/seq->tilesX + ry && !u; ty++)
+            for(tx = t%seq->tilesX - rx; tx <= t%seq->tilesX + rx && !u; tx++){
+                if(ty < 0 || ty >= seq->tilesY || tx < 0 || tx >= seq->tilesX || !seq->changed[ty*seq->tilesX + tx]) continue;
+                box = seq->box + 4*(ty*seq->tilesX + tx);
+                u = box[0] - ax < x1 && box[1] + bx > x0 && box[2] - ay < y1 && box[3] + by > y0;
+            }
+        if(u) x.todo[ntodo++] = t;
+    }
+    seq->dirtyTiles = ntodo;
+    seq->tiles = ntiles;
+
+    x.stage = SEQ_CONVOLVE;
+    poolParallel(seqTask, &x, ntodo);
+    x.stage = SEQ_SCATTER;
+    poolParallel(seqTask, &x, ntiles);
+
+    free(x.todo);
+    if(x.status) seq->frames = 0;   // the results are incomplete, start again
+    else seq->frames++;
+    return x.status;
+}
+
+void convSequenceDestroy(convSequence seq){
+    if(!seq) return;
+    seqRelease(seq);
+    free(seq);
+}
+
+// gcc -O2 -c libconvolve.c -o libconvolve.o && ar rcs libconvolve.a libconvolve.o
+// gcc program.c libconvolve.a -lpthread -lm     (C++ programs include libconvolve.h as well)
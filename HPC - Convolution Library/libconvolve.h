@@ -0,0 +1,352 @@
+// Convolution library
+// github : - aditya1453
+//          - widyameiriska
+//
+//  libconvolve.h
+//
+//
+// Serial Code Created by Josep Lluis Lerida on 11/03/15.
+//
+// Image convolution as a library. The PPM programs (OMP, MPI, Hybrid) and the
+// benchmark are thin wrappers over it, and it can be linked into any program
+// that already has the pixels in memory.
+//
+// A plan binds a kernel to an engine (chosen by the planner) for an image
+// width and a number of threads. Measured plans are kept in a kernel cache,
+// keyed by the kernel values and the width, in memory and in the directory
+// CONVOLUTION_KERNEL_CACHE when it is set. Executing a plan convolves every channel of
+// a caller-owned image into another one. Images can be planar (one buffer
+// per channel) or interleaved (RGBRGB...), with any row stride:
+//
+//     kernelData kern = newKernel(3, 3, weights);
+//     convPlan plan = convPlanCreate(kern, width, height, 0, 1, CONV_PLAN_MEASURE);
+//     convImage in  = convInterleaved(pixels, width, height, 3, width*3);
+//     convImage out = convInterleaved(result, width, height, 3, width*3);
+//     convExecute(plan, &in, &out);
+//     convPlanDestroy(plan);
+//     freeKernel(kern);
+//
+// Plans can also decimate (convPlanSetStride): only one pixel out of stride x
+// stride is convolved, for previews and thumbnails; convPlanSetRows writes only
+// a band of rows, for ranks that share an image. With plan->stats the range of
+// the output is gathered while it is convolved, and convRescale maps it to
+// 0..maxcolor in place. The engines read zeros out of
+// the image; convPlanSetBoundary selects clamp, mirror or wrap borders instead.
+// Frame sequences (convSequenceExecute) only convolve again the tiles near the
+// pixels that changed since the previous frame. convIterate applies a kernel
+// several times, advancing tiles of rows several steps while they are in cache.
+// Gray P2/P5 images are stored and convolved as a single plane, and color
+// images can be reduced to luma (lumaImage) when only intensity matters.
+// Images can also be kept in a binary tiled format (.cvt) whose tiles are read
+// directly, in any order; see readTiledRows.
+// Images compressed with gzip or zstd are read transparently; results are
+// compressed when the file name ends in .gz or .zst.
+// The image planes and the work buffers of a thread can be carved from an
+// arena backed by huge pages (arenaCreate, arenaUse) and recycled between
+// images with arenaReset instead of being freed.
+// Several kernels of the same size can be applied to a channel at once
+// (convolveGemm): the patches under the kernels are built once for all of them.
+//
+// Plans run on an internal pool of threads shared by the whole process.
+// Different plans can be created and executed at the same time from
+// different threads. A kernel can be shared by several plans and must
+// outlive them.
+
+#ifndef LIBCONVOLVE_H
+#define LIBCONVOLVE_H
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Structure to store image.
+struct imagenppm{
+    int altura;
+    int ancho;
+    char *comentario;
+    int maxcolor;
+    int P;
+    int *R;
+    int *G;
+    int *B;
+    int channels;   // 3, or 1 for gray (P2/P5) and luma images: G and B are NULL
+    int haloStart;  // halo rows of the last chunk read, kept for the next one
+    int haloLen;
+    struct structtiled *tiled;  // tiled file of the image (see readTiledRows), NULL for PPM/PGM
+    int arena;      // the planes were carved from an arena, they are not freed
+};
+typedef struct imagenppm* ImagenData;
+
+// Arena: one mapping aligned to huge pages that the planes and work buffers are carved from.
+#define ARENA_ALIGN     64              // bytes, alignment of the blocks
+#define ARENA_HUGEPAGE  (2L << 20)      // bytes of a huge page
+
+struct structarena{
+    char *base;
+    size_t size;            // bytes reserved
+    size_t used;            // bytes carved since the last reset
+    size_t peak;            // most bytes used at the same time
+    size_t touched;         // bytes faulted in; the blocks below it may hold old data
+    size_t pageSize;        // bytes of the pages of the mapping
+    int hugetlb;            // hugetlbfs pages, otherwise transparent huge pages are advised
+    int resets;
+    long faults;            // page faults taken while touching new blocks
+    double faultSeconds;    // time spent touching them
+};
+typedef struct structarena* convArena;
+
+// Nonzero kernel coefficient. (dy,dx) is the offset of the pixel it reads from the output pixel.
+struct structtap{
+    int dy;
+    int dx;
+    float weight;
+};
+
+// Constant rectangle of a kernel: the pixels (i+dy0..i+dy1, j+dx0..j+dx1) of the output pixel (i,j), times weight.
+struct structbox{
+    int dy0, dy1;
+    int dx0, dx1;
+    float weight;
+};
+
+// Structure to store the kernel.
+typedef struct structkernel* kernelData;
+
+// Convolution engine: convolves the rows rowBegin..rowEnd-1 of one channel of dataSizeX x dataSizeY
+// pixels with the kernel. The other rows are only read.
+typedef int (*convolveFn)(int* inbuf, int* outbuf, int sizeX, int sizeY, int rowBegin, int rowEnd, kernelData kern);
+
+struct structkernel{
+    int kernelX;
+    int kernelY;
+    float *vkern;
+    int ntaps;              // nonzero coefficients
+    struct structtap *taps; // nonzero coefficients grouped by weight
+    int ngroups;            // distinct nonzero weights
+    int *group;             // first tap of every weight group, ngroups+1 entries
+    int nboxes;             // constant rectangles that add up to the kernel, 0 = none
+    struct structbox *boxes;
+    float winograd[36];     // transformed kernel of the Winograd engines
+    int separable;          // rank one kernel
+    int integral;           // every coefficient is an integer
+    int engine;             // ENGINE_* used for this kernel
+    int tileX;              // column strip width of the engine, 0 = whole rows
+    convolveFn convolve;    // function of the engine
+};
+
+// Convolution engines
+#define ENGINE_GENERIC  0   // convolve2D, any kernel
+#define ENGINE_SPLIT    1   // any kernel, bounds checks only near the border
+#define ENGINE_FIXED    2   // unrolled engines for the sizes in convolveTable
+#define ENGINE_SPARSE   3   // nonzero taps only
+#define ENGINE_BOX      4   // sums of constant rectangles, integral image
+#define ENGINE_WINOGRAD2 5  // 3x3 kernels, F(2x2,3x3) minimal filtering
+#define ENGINE_WINOGRAD4 6  // 3x3 kernels, F(4x4,3x3) minimal filtering
+#define ENGINE_GEMM     7   // any kernel, patch panels times the kernel matrix (convolveGemm)
+#define ENGINES         8
+
+extern const char *engineNames[ENGINES];
+
+// Phases timed by the instrumentation
+#define PHASE_READ      0   // reading the image file
+#define PHASE_COPY      1   // copying image structures
+#define PHASE_KERNEL    2   // reading the kernel matrix
+#define PHASE_CONV      3   // convolution
+#define PHASE_STORE     4   // writing the resulting image
+#define PHASE_COMM      5   // MPI messages
+#define PHASES          6
+#define TIMER_THREADS   64                          // threads recorded per rank
+
+// Hardware counters read around the read, convolution and store phases
+#define COUNTER_CYCLES          0
+#define COUNTER_INSTRUCTIONS    1
+#define COUNTER_L1D_MISSES      2
+#define COUNTER_LLC_MISSES      3
+#define COUNTER_BRANCH_MISSES   4
+#define COUNTER_DTLB_MISSES     5
+#define COUNTERS                6
+#define CACHE_LINE              64  // bytes moved by a cache miss
+
+#define RANK_FIELDS     (PHASES + 8 + TIMER_THREADS + PHASES*COUNTERS) // doubles in the packed record of a rank
+
+// Structure to store the timings of a rank.
+struct structtimers{
+    double begin;                   // start of the run
+    double elapsed;                 // seconds since begin, set by packTimers
+    double start[PHASES];           // start of the running phase
+    double total[PHASES];           // seconds per phase
+    double *partition;              // seconds per partition and phase
+    int partitions;
+    double thread[TIMER_THREADS];   // convolution seconds per thread
+    int threads;                    // threads that convolved
+    long bytesRead;
+    long bytesWritten;
+    long peakRSS;                   // kB
+    long pageFaults;                // minor and major page faults of the process
+    convArena arena;                // optional, arena of the image planes
+    int counters;                   // hardware counters requested
+    int counterMask;                // counters that could be read, one bit per counter
+    double count[TIMER_THREADS][PHASES][COUNTERS]; // hardware counts per thread and phase
+};
+typedef struct structtimers* timersData;
+
+// Caller-owned image. data[c] points to the first pixel of channel c; the pixel (x,y) of the
+// channel is data[c][y*rowStride + x*pixelStride]. Planar images have pixelStride 1, interleaved
+// ones have pixelStride = channels.
+#define CONV_MAX_CHANNELS 4
+
+struct structconvimage{
+    int width;
+    int height;
+    int channels;
+    int *data[CONV_MAX_CHANNELS];
+    int pixelStride;        // ints between two pixels of a row
+    int rowStride;          // ints between two rows
+};
+typedef struct structconvimage convImage;
+
+// Flags of convPlanCreate
+#define CONV_PLAN_ESTIMATE  0   // default engine for the kernel, no timing
+#define CONV_PLAN_MEASURE   1   // time the engines (or use the kernel cache or the wisdom file)
+#define CONV_PLAN_EXPLAIN   2   // print the plan
+
+// Boundary modes of convPlanSetBoundary: what the taps read outside the image
+#define CONV_BOUNDARY_ZERO      0   // zero, as the engines do
+#define CONV_BOUNDARY_CLAMP     1   // nearest edge pixel
+#define CONV_BOUNDARY_MIRROR    2   // reflected about the edge pixel
+#define CONV_BOUNDARY_WRAP      3   // periodic image
+#define CONV_BOUNDARIES         4
+
+extern const char *boundaryNames[CONV_BOUNDARIES];
+
+// Range of the output of the executions of a plan (see structplan.stats), gathered while it is convolved.
+struct structconvstats{
+    int min;
+    int max;
+    long pixels;            // pixels convolved
+};
+typedef struct structconvstats convStats;
+
+// Plan: the kernel with the engine chosen for it, and the threads that execute it.
+struct structplan{
+    struct structkernel kern;   // copy of the kernel with the engine of this plan
+    int width;                  // width the plan was tuned for
+    int height;
+    int threads;                // row bands convolved in parallel
+    int stride;                 // decimation of the output, 1 = every pixel
+    int firstRow;               // input row of the first output row when decimating
+    int boundary;               // CONV_BOUNDARY_* of the ghost border
+    int padded;                 // convolve ghost border copies of the input (convPlanSetBoundary)
+    int rowBegin;               // output rows written (convPlanSetRows), rowEnd 0 = every row
+    int rowEnd;
+    timersData timers;          // optional, convolution time and counters per thread
+    convStats *stats;           // optional, min/max of the output, merged over the threads and executions
+};
+typedef struct structplan* convPlan;
+
+// Sequence: frames convolved with the same plan, only the tiles around the changes are convolved again.
+#define SEQ_TILE        64  // default tile side, pixels
+
+struct structsequence{
+    convPlan plan;
+    int tile;                       // tile side, pixels
+    int width;                      // size of the frames
+    int height;
+    int channels;
+    int tilesX;
+    int tilesY;
+    int frames;                     // frames convolved since the size was set
+    int tiles;                      // tiles of the last frame
+    int dirtyTiles;                 // tiles convolved for the last frame
+    int *box;                       // changed pixels of every input tile in the last frame, [x0,x1) x [y0,y1)
+    unsigned char *changed;         // input tiles that changed in the last frame
+    int *src[CONV_MAX_CHANNELS];    // last frame
+    int *dst[CONV_MAX_CHANNELS];    // its result
+};
+typedef struct structsequence* convSequence;
+
+//Functions Definition
+FILE *openImageFile(char *nombre, const char *mode);
+ImagenData initimage(char* nombre, FILE **fp, int partitions, int halo);
+ImagenData duplicateImageData(ImagenData src, int partitions, int halo);
+int lumaImage(ImagenData img);
+void setTiledTile(int tileW, int tileH);
+int readTiledRows(ImagenData img, int rowBegin, int rowEnd, int first);
+int writeTiledRows(ImagenData img, int rowBegin, int rowEnd, int first);
+
+int readImage(ImagenData Img, FILE **fp, int dim, int halosize, long int *position);
+int duplicateImageChunk(ImagenData src, ImagenData dst, int dim);
+ImagenData readImageRegion(char *nombre, int *x, int *y, int *w, int *h, int marginX, int marginY, int luma);
+int cropImage(ImagenData img, int x, int y, int w, int h);
+int initfilestore(ImagenData img, FILE **fp, char* nombre, long *position);
+int savingChunk(ImagenData img, FILE **fp, int dim, int offset);
+void freeImagestructure(ImagenData *src);
+
+convArena arenaCreate(size_t size);
+void *arenaAlloc(convArena arena, size_t bytes);
+void *arenaCalloc(convArena arena, size_t count, size_t size);
+void arenaUse(convArena arena);
+void arenaReset(convArena arena);
+long arenaHugeBytes(convArena arena);
+void arenaReport(convArena arena, FILE *fp);
+void arenaDestroy(convArena arena);
+
+kernelData leerKernel(char* nombre);
+kernelData newKernel(int kernelX, int kernelY, const float *values);
+void freeKernel(kernelData kern);
+
+int convolve2D(int* inbuf, int* outbuf, int sizeX, int sizeY, float* kernel, int ksizeX, int ksizeY);
+int convolve2DRows(int* inbuf, int* outbuf, int sizeX, int sizeY, int rowBegin, int rowEnd,
+                   float* kernel, int ksizeX, int ksizeY);
+int convolveGemm(int* in, int** outs, int sizeX, int sizeY, int rowBegin, int rowEnd,
+                 kernelData* kerns, int nkerns);
+int convolve2DStrided(int* inbuf, int* outbuf, int sizeX, int sizeY, int firstRow, int stride,
+                      int outSizeX, int rowBegin, int rowEnd, kernelData kern);
+int buildKernelTaps(kernelData kern);
+int buildKernelBoxes(kernelData kern);
+int analyzeKernel(kernelData kern);
+int selectEngine(kernelData kern);
+convolveFn engineFunction(kernelData kern, int engine);
+int setEngine(kernelData kern, int engine, int tileX);
+int planConvolution(kernelData kern, int* sample, int sizeX, int sizeY, int threads, int ranks, int explain);
+unsigned long long kernelHash(kernelData kern, int width);
+size_t packKernel(kernelData kern, void *buf);
+kernelData unpackKernel(const void *buf, size_t size);
+kernelData cachedKernel(kernelData kern, int width);
+int cacheKernel(kernelData kern, int width);
+
+convImage convPlanar(int *R, int *G, int *B, int width, int height, int rowStride);
+convImage convInterleaved(int *pixels, int width, int height, int channels, int rowStride);
+int convDefaultThreads(void);
+convPlan convPlanCreate(kernelData kern, int width, int height, int threads, int ranks, int flags);
+int convPlanSetEngine(convPlan plan, int engine, int tileX);
+int convPlanSetStride(convPlan plan, int stride, int firstRow);
+int convPlanSetBoundary(convPlan plan, int boundary);
+int convPlanSetRows(convPlan plan, int rowBegin, int rowEnd);
+int convExecute(convPlan plan, const convImage *in, convImage *out);
+int convIterate(convPlan plan, const convImage *in, convImage *out, int iterations);
+void convPlanDestroy(convPlan plan);
+void convStatsReset(convStats *stats);
+int convRescale(const convImage *img, const convStats *stats, int maxcolor);
+convSequence convSequenceCreate(convPlan plan, int tile);
+int convSequenceExecute(convSequence seq, const convImage *in, convImage *out);
+void convSequenceDestroy(convSequence seq);
+
+double timerNow(void);
+timersData initTimers(int partitions);
+void timerStart(timersData t, int phase);
+void timerStop(timersData t, int phase, int partition);
+void timerThread(timersData t, int thread, double seconds);
+void counterStart(timersData t);
+void counterStop(timersData t, int thread, int phase);
+void packTimers(timersData t, double *rec);
+int writeTimings(char *nombre, timersData t, double *recs, int ranks, char *program, char *image,
+                 int ancho, int altura, kernelData kern, int partitions);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,76 @@
+// Image converter
+// github : - aditya1453
+//          - widyameiriska
+//
+//  convertimage.c
+//
+//
+// Serial Code Created by Josep Lluis Lerida on 11/03/15.
+//
+// Converts images between the formats read by the convolution programs: PPM (P3), PGM (P2/P5),
+// gzip/zstd compressed PPM/PGM and the binary tiled format of the convolution library. The output
+// format follows the name of the result file: *.cvt is tiled, *.gz and *.zst are compressed, any
+// other name keeps the PPM/PGM format of the image. Converting to the tiled format once lets
+// repeated jobs on the same image skip the text parsing and read its tiles in parallel.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "../HPC - Convolution Library/libconvolve.h"
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// MAIN FUNCTION
+//////////////////////////////////////////////////////////////////////////////////////////////////
+int main(int argc, char **argv)
+{
+    int i, tileW = 0, tileH = 0, luma = 0;
+    long position = 0;
+    FILE *fpsrc = NULL, *fpdst = NULL;
+    ImagenData source = NULL, output = NULL;
+
+    // Options after the positional arguments
+    for(i = 3; i < argc; i++){
+        if(strcmp(argv[i], "--tile") == 0 && i+1 < argc){
+            if(sscanf(argv[++i], "%dx%d", &tileW, &tileH) == 1) tileH = tileW;
+        }
+        else if(strcmp(argv[i], "--luma") == 0) luma = 1;
+        else break;
+    }
+    if(argc < 3 || i != argc || tileW < 0 || tileH < 0)
+    {
+        printf("Usage: %s <image-file> <result-file> [--tile W[xH]] [--luma]\n", argv[0]);
+        printf("- image_file : PPM/PGM image, compressed or tiled\n");
+        printf("- result_file: *.cvt for the tiled format, *.gz or *.zst to compress, else PPM/PGM\n");
+        printf("- --tile     : tile size of the tiled format (default 256x256)\n");
+        printf("- --luma     : convert color images to a gray image\n\n");
+        return -1;
+    }
+    setTiledTile(tileW, tileH);
+
+    // The whole image is converted in one partition
+    if((source = initimage(argv[1], &fpsrc, 1, 0)) == NULL) return -1;
+    if(luma) lumaImage(source);
+    if(readImage(source, &fpsrc, source->ancho*source->altura, 0, &position)){
+        fprintf(stderr, "Error: can not read %s\n", argv[1]);
+        return -1;
+    }
+    // The result has its own file (a color image converted to luma is written as P2)
+    if((output = duplicateImageData(source, 1, 0)) == NULL || duplicateImageChunk(source, output, source->ancho*source->altura)){
+        perror("Error: ");
+        return -1;
+    }
+    if(initfilestore(output, &fpdst, argv[2], &position) ||
+       savingChunk(output, &fpdst, output->ancho*output->altura, 0) ||
+       fclose(fpdst) != 0){
+        perror("Error: ");
+        return -1;
+    }
+    fclose(fpsrc);
+    printf("%s: %dx%d, %d channels -> %s\n", argv[1], source->ancho, source->altura, source->channels, argv[2]);
+    freeImagestructure(&source);
+    freeImagestructure(&output);
+    return 0;
+}
+
+// gcc -O2 convertimage.c "../HPC - Convolution Library/libconvolve.c" -o convertimage -lpthread -lm
+// ./convertimage im03.ppm im03.cvt --tile 256
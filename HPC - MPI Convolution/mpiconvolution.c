@@ -11,6 +11,9 @@
 // The program accepts an PPM image file, a text definition of the kernel matrix and the PPM file for storing the convolution results.
 // The program allows to define image partitions for processing large images (>500MB)
 // The 2D image is represented by 1D vector for chanel R, G and B. The convolution is applied to each chanel separately.
+// The image I/O, the kernel and the convolution engines are in the convolution library (../HPC - Convolution Library).
+// The ranks of a node share the chunk in an MPI shared memory window and convolve their rows in place;
+// only the leaders of the nodes exchange pixels.
 
 #include <stdio.h>
 #include <string.h>
@@ -20,290 +23,22 @@
 #include <sys/time.h>
 #include <time.h>
 #include <mpi.h>
-#include <unistd.h>
-
-// Structure to store image.
-struct imagenppm{
-    int altura;
-    int ancho;
-    char *comentario;
-    int maxcolor;
-    int P;
-    int *R;
-    int *G;
-    int *B;
-};
-typedef struct imagenppm* ImagenData;
-
-// Structure to store the kernel.
-struct structkernel{
-    int kernelX;
-    int kernelY;
-    float *vkern;
-};
-typedef struct structkernel* kernelData;
-
-//Functions Definition
-ImagenData initimage(char* nombre, FILE **fp, int partitions, int halo);
-ImagenData duplicateImageData(ImagenData src, int partitions, int halo);
-
-int readImage(ImagenData Img, FILE **fp, int dim, int halosize, long int *position);
-int duplicateImageChunk(ImagenData src, ImagenData dst, int dim);
-int initfilestore(ImagenData img, FILE **fp, char* nombre, long *position);
-int savingChunk(ImagenData img, FILE **fp, int dim, int offset);
-int convolve2D(int* inbuf, int* outbuf, int sizeX, int sizeY, float* kernel, int ksizeX, int ksizeY);
-// void freeImagestructure(ImagenData *src);
-
-//Open Image file and image struct initialization
-ImagenData initimage(char* nombre, FILE **fp,int partitions, int halo){
-    char c;
-    char comentario[300];
-    int i=0,chunk=0;
-    ImagenData img=NULL;
-    
-    /*Opening ppm*/
-
-    if ((*fp=fopen(nombre,"r"))==NULL){
-        perror("Error: ");
-    }
-    else{
-        //Memory allocation
-        img=(ImagenData) malloc(sizeof(struct imagenppm));
-        //Reading the first line: Magical Number "P3"
-        fscanf(*fp,"%c%d ",&c,&(img->P));
-        //Reading the image comment
-        while((c=fgetc(*fp))!= '\n'){comentario[i]=c;i++;}
-        comentario[i]='\0';
-        //Allocating information for the image comment
-        img->comentario = calloc(strlen(comentario),sizeof(char));
-        strcpy(img->comentario,comentario);
-        //Reading image dimensions and color resolution
-        fscanf(*fp,"%d %d %d",&img->ancho,&img->altura,&img->maxcolor);
-        chunk = img->ancho*img->altura / partitions;
-        //We need to read an extra row.
-        chunk = chunk + img->ancho * halo;
-        if ((img->R=calloc(chunk,sizeof(int))) == NULL) {return NULL;}
-        if ((img->G=calloc(chunk,sizeof(int))) == NULL) {return NULL;}
-        if ((img->B=calloc(chunk,sizeof(int))) == NULL) {return NULL;}
-    }
-    return img;
-}
-
-//Duplicate the Image struct for the resulting image
-ImagenData duplicateImageData(ImagenData src, int partitions, int halo){
-    char c;
-    char comentario[300];
-    unsigned int imageX, imageY;
-    int i=0, chunk=0;
-    //Struct memory allocation
-    ImagenData dst=(ImagenData) malloc(sizeof(struct imagenppm));
-
-    //Copying the magic number
-    dst->P=src->P;
-    //Copying the string comment
-    dst->comentario = calloc(strlen(src->comentario),sizeof(char));
-    strcpy(dst->comentario,src->comentario);
-    //Copying image dimensions and color resolution
-    dst->ancho=src->ancho;
-    dst->altura=src->altura;
-    dst->maxcolor=src->maxcolor;
-    chunk = dst->ancho*dst->altura / partitions;
-    //We need to read an extra row.
-    chunk = chunk + src->ancho * halo;
-    if ((dst->R=calloc(chunk,sizeof(int))) == NULL) {return NULL;}
-    if ((dst->G=calloc(chunk,sizeof(int))) == NULL) {return NULL;}
-    if ((dst->B=calloc(chunk,sizeof(int))) == NULL) {return NULL;}
-    return dst;
-}
+#include "../HPC - Convolution Library/libconvolve.h"
 
-//Read the corresponding chunk from the source Image
-int readImage(ImagenData img, FILE **fp, int dim, int halosize, long *position){
-    int i=0, k=0,haloposition=0;
-    if (fseek(*fp,*position,SEEK_SET))
-        perror("Error: ");
-    haloposition = dim-(img->ancho*halosize*2);
-    for(i=0;i<dim;i++) {
-        // When start reading the halo store the position in the image file
-        if (halosize != 0 && i == haloposition) *position=ftell(*fp);
-        fscanf(*fp,"%d %d %d ",&img->R[i],&img->G[i],&img->B[i]);
-        k++;
-    }
-//    printf ("Readed = %d pixels, posicio=%lu\n",k,*position);
-    return 0;
-}
-
-//Duplication of the  just readed source chunk to the destiny image struct chunk
-int duplicateImageChunk(ImagenData src, ImagenData dst, int dim){
-    int i=0;
-    
-    for(i=0;i<dim;i++){
-        dst->R[i] = src->R[i];
-        dst->G[i] = src->G[i];
-        dst->B[i] = src->B[i];
-    }
-//    printf ("Duplicated = %d pixels\n",i);
-    return 0;
-}
 
-// Open kernel file and reading kernel matrix. The kernel matrix 2D is stored in 1D format.
-kernelData leerKernel(char* nombre){
-    FILE *fp;
-    int i=0;
-    kernelData kern=NULL;
-    
-    /*Opening the kernel file*/
-    fp=fopen(nombre,"r");
-    if(!fp){
-        perror("Error: ");
-    }
-    else{
-        //Memory allocation
-        kern=(kernelData) malloc(sizeof(struct structkernel));
-        
-        //Reading kernel matrix dimensions
-        fscanf(fp,"%d,%d,", &kern->kernelX, &kern->kernelY);
-        kern->vkern = (float *)malloc(kern->kernelX*kern->kernelY*sizeof(float));
-        
-        // Reading kernel matrix values
-        for (i=0;i<(kern->kernelX*kern->kernelY)-1;i++){
-            fscanf(fp,"%f,",&kern->vkern[i]);
-        }
-        fscanf(fp,"%f",&kern->vkern[i]);
-        fclose(fp);
+// Point the planes of the image at the shared window of the node, the planes it had are released
+static void sharePlanes(ImagenData img, int **planes){
+    if (!img->arena) {
+        free(img->R);
+        free(img->G);
+        free(img->B);
     }
-    return kern;
+    img->R = planes[0];
+    img->G = planes[1];
+    img->B = planes[2];
+    img->arena = 1; // the window owns them
 }
 
-// Open the image file with the convolution results
-int initfilestore(ImagenData img, FILE **fp, char* nombre, long *position){
-    /*Se crea el fichero con la imagen resultante*/
-    
-    if ( (*fp=fopen(nombre,"w")) == NULL ){
-        perror("Error: ");
-        return -1;
-    }
-    /*Writing Image Header*/
-    fprintf(*fp,"P%d\n%s\n%d %d\n%d\n",img->P,img->comentario,img->ancho,img->altura,img->maxcolor);
-    *position = ftell(*fp);
-    return 0;
-}
-
-// Writing the image partition to the resulting file. dim is the exact size to write. offset is the displacement for avoid halos.
-int savingChunk(ImagenData img, FILE **fp, int dim, int offset){
-    int i,k=0;
-    //Writing image partition
-    for(i=offset;i<dim+offset;i++){
-        // Debug
-        // if (i<100){
-        //     printf("%d", i); if (i+1%20==0) printf("\n");
-        // }
-        fprintf(*fp,"%d %d %d ",img->R[i],img->G[i],img->B[i]);
-    //    if ((i+1)%6==0) fprintf(*fp,"\n");
-        k++;
-    }
-    
-//    printf ("Writed = %d pixels, dim=%d, offset=%d\n",k,dim, offset);
-    return 0;
-}
-
-// This function free the space allocated for the image structure.
-// void freeImagestructure(ImagenData *src){
-    
-//     free((*src)->comentario);
-//     free((*src)->R);
-//     free((*src)->G);
-//     free((*src)->B);
-//     free(*src);
-// }
-
-///////////////////////////////////////////////////////////////////////////////
-// 2D convolution
-// 2D data are usually stored in computer memory as contiguous 1D array.
-// So, we are using 1D array for 2D data.
-// 2D convolution assumes the kernel is center originated, which means, if
-// kernel size 3 then, k[-1], k[0], k[1]. The middle of index is always 0.
-// The following programming logics are somewhat complicated because of using
-// pointer indexing in order to minimize the number of multiplications.
-//
-//
-// signed integer (32bit) version:
-///////////////////////////////////////////////////////////////////////////////
-int convolve2D(int* in, int* out, int dataSizeX, int dataSizeY,
-               float* kernel, int kernelSizeX, int kernelSizeY)
-{
-    int i, j, m, n;
-    int *inPtr, *inPtr2, *outPtr;
-    float *kPtr;
-    int kCenterX, kCenterY;
-    int rowMin, rowMax;                             // to check boundary of input array
-    int colMin, colMax;                             //
-    float sum;                                      // temp accumulation buffer
-    
-    // check validity of params
-    if(!in || !out || !kernel) return -1;
-    if(dataSizeX <= 0 || kernelSizeX <= 0) return -1;
-    
-    // find center position of kernel (half of kernel size)
-    kCenterX = (int)kernelSizeX / 2;
-    kCenterY = (int)kernelSizeY / 2;
-    
-    // init working  pointers
-    inPtr = inPtr2 = &in[dataSizeX * kCenterY + kCenterX];  // note that  it is shifted (kCenterX, kCenterY),
-    outPtr = out;
-    kPtr = kernel;
-    // start convolution
-    for(i= 0; i < dataSizeY; ++i)                   // number of rows
-    {
-        // compute the range of convolution, the current row of kernel should be between these
-        rowMax = i + kCenterY;
-        rowMin = i - dataSizeY + kCenterY;
-        
-        for(j = 0; j < dataSizeX; ++j)              // number of columns
-        {
-            // compute the range of convolution, the current column of kernel should be between these
-            colMax = j + kCenterX;
-            colMin = j - dataSizeX + kCenterX;
-            
-            sum = 0;                                // set to 0 before accumulate
-            
-            // flip the kernel and traverse all the kernel values
-            // multiply each kernel value with underlying input data
-            for(m = 0; m < kernelSizeY; ++m)        // kernel rows
-            {
-                // check if the index is out of bound of input array
-                if(m <= rowMax && m > rowMin)
-                {
-                    for(n = 0; n < kernelSizeX; ++n)
-                    {
-                        // check the boundary of array
-                        if(n <= colMax && n > colMin)
-                            sum += *(inPtr - n) * *kPtr;
-                        
-                        ++kPtr;                     // next kernel
-                    }
-                }
-                else
-                    kPtr += kernelSizeX;            // out of bound, move to next row of kernel
-                
-                inPtr -= dataSizeX;                 // move input data 1 raw up
-            }
-            
-            // convert integer number
-            if(sum >= 0) *outPtr = (int)(sum + 0.5f);
-//            else *outPtr = (int)(sum - 0.5f)*(-1);
-            // For using with image editors like GIMP or others...
-            else *outPtr = (int)(sum - 0.5f);
-            // For using with a text editor that read ppm images like libreoffice or others...
-//            else *outPtr = 0;
-            
-            kPtr = kernel;                          // reset kernel to (0,0)
-            inPtr = ++inPtr2;                       // next input
-            ++outPtr;                               // next output
-        }
-    }
-    
-    return 0;
-}
 
 //////////////////////////////////////////////////////////////////////////////////////////////////
 // MAIN FUNCTION
@@ -319,17 +54,46 @@ int main(int argc, char **argv)
     MPI_Comm_size(MPI_COMM_WORLD, &size);
 
     int i=0,j=0,k=0;
+    int explain=0;
+    char *timings=NULL;
+    int counters=0;
+    int luma=0;
+    int boundary=-1;
+    int normalize=0;
+    convStats stats;
     
+    // Options after the positional arguments
+    for(i=5;i<argc;i++){
+        if (strcmp(argv[i],"--explain")==0) explain=1;
+        else if (strcmp(argv[i],"--timings")==0 && i+1<argc) timings=argv[++i];
+        else if (strcmp(argv[i],"--counters")==0) counters=1;
+        else if (strcmp(argv[i],"--luma")==0) luma=1;
+        else if (strcmp(argv[i],"--boundary")==0 && i+1<argc) {
+            for(boundary=CONV_BOUNDARIES-1; boundary>=0 && strcmp(argv[i+1],boundaryNames[boundary])!=0; boundary--);
+            if (boundary<0) break;
+            i++;
+        }
+        else if (strcmp(argv[i],"--normalize")==0) normalize=1;
+        else break;
+    }
 //    int headstored=0, imagestored=0, stored;
-    if(argc != 5){ // Master & slaves check the argument input
+    // wrap is not offered: every rank only has its own rows to fill the ghost border. The range of
+    // --normalize is known once every row is convolved, the first partitions would be stored already.
+    if(argc < 5 || i != argc || boundary==CONV_BOUNDARY_WRAP || (normalize && atoi(argv[4])>1)){ // Master & slaves check the argument input
         if (rank==0){
-            printf("Usage: %s <image-file> <kernel-file> <result-file> <partitions>\n", argv[0]);
+            printf("Usage: %s <image-file> <kernel-file> <result-file> <partitions> [--explain] [--timings file] [--counters] [--luma]\n       [--boundary zero|clamp|mirror] [--normalize]\n", argv[0]);
             printf("\n\nError, Missing parameters:\n");
             printf("format: ./serialconvolution image_file kernel_file result_file\n");
-            printf("- image_file : source image path (*.ppm)\n");
+            printf("- image_file : source image path (*.ppm, *.pgm, may be .gz or .zst compressed)\n");
             printf("- kernel_file: kernel path (text file with 1D kernel matrix)\n");
-            printf("- result_file: result image path (*.ppm)\n");
-            printf("- partitions : Image partitions\n\n");
+            printf("- result_file: result image path (*.ppm, *.pgm, compressed when it ends in .gz or .zst)\n");
+            printf("- partitions : Image partitions\n");
+            printf("- --explain  : print the convolution plan\n");
+            printf("- --timings  : write the phase timings of every rank as JSON to file\n");
+            printf("- --counters : add hardware counters (perf_event_open) to the timings\n");
+            printf("- --luma     : convolve the luma of color images, the result is a P2 image\n");
+            printf("- --boundary : pixels read by the kernel outside the image (default: zero, without ghost border)\n");
+            printf("- --normalize: rescale the range of the result to 0..maxcolor, in 1 partition\n\n");
         }
         return -1;
     }
@@ -343,16 +107,32 @@ int main(int argc, char **argv)
                       - Kernel Matrix
                       - Duplicate Image data
                       - Open Resulting Image File
-        all slave   : - kernel Matrix
+        all slave   : - prepared kernel, broadcast by the master
     */
 
-    int imagesize, partitions, partsize, chunksize, halo, halosize;
-    long position=0;
-    double start, tstart=0, tend=0, tread=0, tcopy=0, tconv=0, tstore=0, treadk=0;
-    struct timeval tim;
+    int imagesize, partitions=0, partsize=0, chunksize, halo=0, halosize;
+    long position=0, from=0;
+    double rec[RANK_FIELDS], *recs=NULL;
     FILE *fpsrc=NULL,*fpdst=NULL;
     ImagenData source=NULL, output=NULL;
     kernelData kern=NULL;
+    convPlan plan=NULL;
+    convImage in, out;
+    timersData timers=NULL;
+    convArena arena=NULL;
+
+    // Every rank keeps its own phase timers, the master gathers them at the end
+    if ( (timers = initTimers(atoi(argv[4]))) == NULL) {
+        perror("Error: ");
+        return -1;
+    }
+    timers->counters = counters;
+    // The planes and the work buffers of the rank are carved from one arena, on huge pages when possible
+    if ( (arena = arenaCreate(0)) == NULL) {
+        fprintf(stderr,"Warning: no arena on rank %d, the planes are allocated with malloc\n", rank);
+    }
+    arenaUse(arena);
+    timers->arena = arena;
 
     if (rank==0){ // Master
         // Store number of partitions
@@ -362,10 +142,7 @@ int main(int argc, char **argv)
         // Reading kernel matrix
         ////////////////////////////////////////
         
-        gettimeofday(&tim, NULL); 
-        start = tim.tv_sec+(tim.tv_usec/1000000.0);
-        tstart = start;
-        
+        timerStart(timers, PHASE_KERNEL);
         if ( (kern = leerKernel(argv[2]))==NULL) {
             //        free(source);
             //        free(output);
@@ -375,37 +152,37 @@ int main(int argc, char **argv)
         //The matrix kernel define the halo size to use with the image. The halo is zero when the image is not partitioned.
         if (partitions==1) halo=0;
         else halo = (kern->kernelY/2)*2; 
-        gettimeofday(&tim, NULL);
-        treadk = treadk + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
+        timerStop(timers, PHASE_KERNEL, 0);
         
         ///////////////////////////////////////////////////////////////////////////////////////////////
         //Reading Image Header. Image properties: Magical number, comment, size and color resolution.
         ///////////////////////////////////////////////////////////////////////////////////////////////
 
-        gettimeofday(&tim, NULL);
-        start = tim.tv_sec+(tim.tv_usec/1000000.0);
-        //Memory allocation based on number of partitions and halo size.
+        timerStart(timers, PHASE_READ);
+        //Memory allocation based on number of partitions and halo size. The planes are replaced by
+        //the shared window of the node before they are used, they are not carved from the arena.
+        arenaUse(NULL);
         if ( (source = initimage(argv[1], &fpsrc, partitions, halo)) == NULL) {
             return -1;
         }
-        gettimeofday(&tim, NULL);
-        tread = tread + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
+        // Only the intensity is convolved
+        if (luma) lumaImage(source);
+        timers->bytesRead += ftell(fpsrc);
+        timerStop(timers, PHASE_READ, 0);
 
         //Duplicate the image struct.
-        gettimeofday(&tim, NULL);
-        start = tim.tv_sec+(tim.tv_usec/1000000.0);
+        timerStart(timers, PHASE_COPY);
         if ( (output = duplicateImageData(source, partitions, halo)) == NULL) {
             return -1;
         }
-        gettimeofday(&tim, NULL);
-        tcopy = tcopy + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
+        arenaUse(arena);
+        timerStop(timers, PHASE_COPY, 0);
 
         ///////////////////////////////////////////////////////////////////////////
         //Initialize Image Storing file. Open the file and store the image header.
         ///////////////////////////////////////////////////////////////////////////
         
-        gettimeofday(&tim, NULL);
-        start = tim.tv_sec+(tim.tv_usec/1000000.0);
+        timerStart(timers, PHASE_STORE);
         
         if (initfilestore(output, &fpdst, argv[3], &position)!=0) {
             perror("Error: ");
@@ -414,303 +191,315 @@ int main(int argc, char **argv)
             return -1;
         }
         
-        gettimeofday(&tim, NULL);
-        tstore = tstore + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
+        timerStop(timers, PHASE_STORE, 0);
 
-    } else { // Slaves also read the kernel 
-        
-        if ( (kern = leerKernel(argv[2]))==NULL) {
-            //        free(source);
-            //        free(output);
-            return -1;
-        }
-        
     }
+    // The slaves do not read the kernel file, they receive the prepared kernel from the master
 
 
     //////////////////////////////////////////////////////////////////////////////////////////////////
-    // CHUNK READING
+    // SHARED MEMORY WINDOWS
     //////////////////////////////////////////////////////////////////////////////////////////////////
     /*
         ==== Job Distribution ====
-        - Master       : - read chunk image
-                         - distributing work by static way
-                         - do convolution
-                         - receive result from slaves
-                         
-        - Slaves       : - receive job from master
-                         - do convolution
-                         - send result
+        The ranks of a node share a window (MPI_Win_allocate_shared) with the input and the output
+        planes of a chunk. The planes of the master are the window of its node; the leader of every
+        other node receives the rows of its node, with the halo of the kernel, into the window of
+        its node and sends back their result. Every rank convolves its own rows in place, reading
+        the rows around them, so only the leaders exchange pixels.
+        - Master       : - read chunk image into the window of its node
+                         - send the rows of the other nodes to their leaders
+                         - do convolution of its rows
+                         - receive the result of the other nodes
+        - Node leaders : - receive the rows of the node
+                         - do convolution of its rows
+                         - send the result of the node
+        - Slaves       : - do convolution of their rows
     */
 
-    int rem_job, job, pixel, width, height, dest; 
-    int msg[5]; // {width, height, halosize, pixel, partition}
-    int *ptrR = NULL, *ptrG = NULL, *ptrB = NULL;
+    int width, height, channels, rows, radius, plane, c=0, offset=0;
+    int rowBegin, rowEnd, nodeBegin, nodeEnd, lo, hi;
+    int msg[9]; // {width, height, halo, plane pixels, partitions, packed kernel bytes, channels, boundary, maxcolor}
+    int range[2];
+    char *kbuf = NULL;  // prepared kernel, see packKernel
+    int nodeRank, nodeSize, nodeFirst=0, leader=0, nodes=0, first, *nodeSizes=NULL;
+    int *shared=NULL, *sharedIn[3], *sharedOut[3], disp;
+    MPI_Comm node, leaders;
+    MPI_Win win;
+    MPI_Aint winSize;
+
+    // Ranks of the same node, and the leaders of the nodes (rank 0 leads its node)
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node);
+    MPI_Comm_rank(node, &nodeRank);
+    MPI_Comm_size(node, &nodeSize);
+    MPI_Comm_split(MPI_COMM_WORLD, nodeRank==0 ? 0 : MPI_UNDEFINED, rank, &leaders);
+    if (nodeRank==0) {
+        MPI_Comm_rank(leaders, &leader);
+        MPI_Comm_size(leaders, &nodes);
+        if ( (nodeSizes = (int *)malloc(nodes*sizeof(int))) == NULL) {
+            perror("Error: ");
+            MPI_Abort(MPI_COMM_WORLD, -1);
+        }
+        MPI_Allgather(&nodeSize, 1, MPI_INT, nodeSizes, 1, MPI_INT, leaders);
+        for (i=0; i<leader; i++) nodeFirst += nodeSizes[i];
+    }
+    // The ranks are numbered node after node: the rows of a node are contiguous
+    MPI_Bcast(&nodeFirst, 1, MPI_INT, 0, node);
+
+    if (rank==0) {
+        // Choose the engine for the rows of a rank, the slaves use the same plan
+        rows = source->altura/partitions + halo;
+        if ( (plan = convPlanCreate(kern, source->ancho, (rows+size-1)/size, 1, size,
+                                    CONV_PLAN_MEASURE | (explain ? CONV_PLAN_EXPLAIN : 0))) == NULL) {
+            perror("Error: ");
+            MPI_Abort(MPI_COMM_WORLD, -1);
+        }
+        msg[0] = source->ancho;
+        msg[1] = source->altura;
+        msg[2] = halo;
+        msg[3] = source->ancho*source->altura/partitions + source->ancho*halo; // pixels of a plane of a chunk
+        msg[4] = partitions;
+        msg[5] = (int)packKernel(&plan->kern, NULL);
+        msg[6] = source->channels;
+        msg[7] = boundary;
+        msg[8] = source->maxcolor;
+        if ((kbuf = (char *)malloc(msg[5])) == NULL || packKernel(&plan->kern, kbuf) != (size_t)msg[5]) {
+            perror("Error: ");
+            MPI_Abort(MPI_COMM_WORLD, -1);
+        }
+    }
 
-    // Alocating Memory 
-    ImagenData partImgIn =NULL;
-    ImagenData partImgOut=NULL; 
+    // Broadcast the image size and the prepared kernel of the master, with its engine
+    timerStart(timers, PHASE_COMM);
+    MPI_Bcast(msg, 9, MPI_INT, 0, MPI_COMM_WORLD);
+    width      = msg[0];
+    height     = msg[1];
+    halo       = msg[2];
+    plane      = msg[3];
+    partitions = msg[4];
+    channels   = msg[6];
+    if (rank!=0 && (kbuf = (char *)malloc(msg[5])) == NULL) {
+        perror("Error: ");
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    MPI_Bcast(kbuf, msg[5], MPI_BYTE, 0, MPI_COMM_WORLD);
+    if (rank!=0 && ( (kern = unpackKernel(kbuf, msg[5])) == NULL ||
+         (plan = convPlanCreate(kern, width, (height/partitions+halo+size-1)/size, 1, size, CONV_PLAN_ESTIMATE)) == NULL )) {
+        perror("Error: ");
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    if (msg[7]>=0) convPlanSetBoundary(plan, msg[7]);
+    plan->timers = timers;
+    // The threads take the range of the rows of the rank while they are in cache
+    if (normalize) {
+        convStatsReset(&stats);
+        plan->stats = &stats;
+    }
+    radius = plan->kern.kernelY/2;
 
-    if (rank==0){ 
-        
-        int c=0, offset=0;
-        imagesize = source->altura*source->ancho;
-        partsize  = (source->altura*source->ancho)/partitions;
-        // printf("%s ocupa %dx%d=%d pixels. Partitions=%d, halo=%d, partsize=%d pixels\n", argv[1], source->altura, source->ancho, imagesize, partitions, halo, partsize);
-        while (c < partitions) {
-            // printf("Master : partition %d\n", c+1);
+    // Window of the node in the memory of its leader: the input planes of a chunk, then the output ones
+    if (MPI_Win_allocate_shared(nodeRank==0 ? (MPI_Aint)2*channels*plane*sizeof(int) : 0, sizeof(int), MPI_INFO_NULL,
+                                node, &shared, &win) != MPI_SUCCESS ||
+        MPI_Win_shared_query(win, 0, &winSize, &disp, &shared) != MPI_SUCCESS) {
+        perror("Error: ");
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    for (i=0; i<3; i++) {
+        sharedIn[i]  = (i<channels) ? shared + (long)i*plane : NULL;
+        sharedOut[i] = (i<channels) ? shared + (long)(channels+i)*plane : NULL;
+    }
+    if (rank==0) {
+        sharePlanes(source, sharedIn);
+        sharePlanes(output, sharedOut);
+    }
+    timerStop(timers, PHASE_COMM, 0);
+
+    //////////////////////////////////////////////////////////////////////////////////////////////////
+    // CHUNK READING
+    //////////////////////////////////////////////////////////////////////////////////////////////////
+    for (c=0; c<partitions; c++) {
+        // Rows of the chunk; the ranks split them in order, the rows of a node are contiguous
+        halosize  = (partitions==1) ? 0 : (c==0 || c==partitions-1) ? halo/2 : halo;
+        rows      = height/partitions + halosize;
+        nodeBegin = (int)((long)rows*nodeFirst/size);
+        nodeEnd   = (int)((long)rows*(nodeFirst+nodeSize)/size);
+        rowBegin  = (int)((long)rows*(nodeFirst+nodeRank)/size);
+        rowEnd    = (int)((long)rows*(nodeFirst+nodeRank+1)/size);
+
+        if (rank==0) {
             ////////////////////////////////////////////////////////////////////////////////
-            // Reading Next chunk.
+            // Reading Next chunk, into the window of the node
             ////////////////////////////////////////////////////////////////////////////////
-        
-            gettimeofday(&tim, NULL);
-            start = tim.tv_sec+(tim.tv_usec/1000000.0);
-            if (c==0) {
-                halosize  = halo/2;
-                chunksize = partsize + (source->ancho*halosize);
-                offset    = 0;
-            }
-            else if(c<partitions-1) {
-                halosize  = halo;
-                chunksize = partsize + (source->ancho*halosize);
-                offset    = (source->ancho*halo/2);
-            }
-            else {
-                halosize  = halo/2;
-                chunksize = partsize + (source->ancho*halosize);
-                offset    = (source->ancho*halo/2);
-            }
+            timerStart(timers, PHASE_READ);
+            partsize  = (source->altura*source->ancho)/partitions;
+            chunksize = partsize + (source->ancho*halosize);
+            offset    = (c==0) ? 0 : (source->ancho*halo/2);
 
             //DEBUG
             // printf("\nRound = %d, position = %ld, partsize= %d, chunksize=%d pixels\n", c, position, partsize, chunksize);
-            
+
+            from = position;
             if (readImage(source, &fpsrc, chunksize, halo/2, &position)) {
-                return -1;
+                MPI_Abort(MPI_COMM_WORLD, -1);
             }
+            timers->bytesRead += ftell(fpsrc) - from;
+            timerStop(timers, PHASE_READ, c);
 
-            gettimeofday(&tim, NULL);
-            tread = tread + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
-            
             //Duplicate the image chunk
-            gettimeofday(&tim, NULL);
-            start = tim.tv_sec+(tim.tv_usec/1000000.0);
+            timerStart(timers, PHASE_COPY);
             if ( duplicateImageChunk(source, output, chunksize) ) {
-                return -1;
+                MPI_Abort(MPI_COMM_WORLD, -1);
             }
-            gettimeofday(&tim, NULL);
-            tcopy = tcopy + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
-
-            // DEBUG
-            // for (i=0;i<chunksize;i++)
-            //    if (source->R[i]!=output->R[i] || source->G[i]!=output->G[i] || source->B[i]!=output->B[i]) printf("At position i=%d %d!=%d,%d!=%d,%d!=%d\n",i,source->R[i],output->R[i], source->G[i],output->G[i],source->B[i],output->B[i]);
-            
+            timerStop(timers, PHASE_COPY, c);
 
             ///////////////////////////////////////////////////////////////////////////
-            // Distributing the Chunk Image to Slaves
+            // Distributing the rows of the other nodes to their leaders
             ///////////////////////////////////////////////////////////////////////////
+            timerStart(timers, PHASE_COMM);
+            for (i=1, first=nodeSizes[0]; i<nodes; first+=nodeSizes[i], i++) {
+                lo = (int)((long)rows*first/size) - radius;
+                hi = (int)((long)rows*(first+nodeSizes[i])/size) + radius;
+                if (lo < 0) lo = 0;
+                if (hi > rows) hi = rows;
+                for (j=0; j<channels; j++)
+                    MPI_Send(sharedIn[j] + (long)lo*width, (hi-lo)*width, MPI_INT, i, j+1, leaders);
+            }
+            timerStop(timers, PHASE_COMM, c);
+        }
+        else if (nodeRank==0) {
+            // Leader of another node: the rows of the node and the halo around them
+            timerStart(timers, PHASE_COMM);
+            lo = (nodeBegin-radius > 0) ? nodeBegin-radius : 0;
+            hi = (nodeEnd+radius < rows) ? nodeEnd+radius : rows;
+            for (j=0; j<channels; j++)
+                MPI_Recv(sharedIn[j] + (long)lo*width, (hi-lo)*width, MPI_INT, 0, j+1, leaders, &status);
+            timerStop(timers, PHASE_COMM, c);
+        }
 
-            // printf("Image Height : %d\n", source->altura);
-            // printf("Image Width  : %d\n", source->ancho);
-            // // Creating Job Distribution
-            // printf("Master : Preparing Distributing Job\n");
-            job       = source->altura/(size*partitions); // number of chunk image row 
-            rem_job   = (source->altura/partitions)%size; // number of remaining row 
-            pixel     = job * source->ancho; // total element
-
-            msg[0] = source->ancho; 
-            msg[1] = source->altura;
-            msg[2] = halosize;
-            msg[3] = pixel;
-            msg[4] = partitions;
-
-            // Broadcast number of pixel to other slaves
-            MPI_Bcast(msg, 5, MPI_INT, 0, MPI_COMM_WORLD);
-            
-            ptrR = source->R + pixel + rem_job * source->ancho;
-            ptrG = source->G + pixel + rem_job * source->ancho; 
-            ptrB = source->B + pixel + rem_job * source->ancho; 
-
-            // printf("Master : Sending Chunk Image ... %x\n", fpdst);
-            // Send chunk of Image to slaves
-            // printf("Master : Sending Job\n");
-            for (dest=1;dest<size;dest++){
-                
-                // Sending chunk of Image
-                MPI_Send(ptrR, pixel, MPI_INT, dest, 1, MPI_COMM_WORLD);
-                MPI_Send(ptrG, pixel, MPI_INT, dest, 2, MPI_COMM_WORLD);
-                MPI_Send(ptrB, pixel, MPI_INT, dest, 3, MPI_COMM_WORLD);
-                
-                // updating the pointer
-                ptrR += pixel;
-                ptrG += pixel;
-                ptrB += pixel; 
+        //////////////////////////////////////////////////////////////////////////////////////////////////
+        // CHUNK CONVOLUTION
+        // The rows of the rank, in place in the window of the node
+        //////////////////////////////////////////////////////////////////////////////////////////////////
+        timerStart(timers, PHASE_COMM);
+        MPI_Win_fence(0, win);
+        timerStop(timers, PHASE_COMM, c);
+
+        timerStart(timers, PHASE_CONV);
+        in  = convPlanar(sharedIn[0], sharedIn[1], sharedIn[2], width, rows, width);
+        out = convPlanar(sharedOut[0], sharedOut[1], sharedOut[2], width, rows, width);
+        if (rowEnd > rowBegin && (convPlanSetRows(plan, rowBegin, rowEnd) || convExecute(plan, &in, &out))) {
+            perror("Error: ");
+            MPI_Abort(MPI_COMM_WORLD, -1);
+        }
+        timerStop(timers, PHASE_CONV, c);
+
+        // The range of the whole image (the minimum as the maximum of its opposite), then every rank
+        // rescales its own rows in the window
+        if (normalize) {
+            timerStart(timers, PHASE_COMM);
+            range[0] = -stats.min;
+            range[1] = stats.max;
+            MPI_Allreduce(MPI_IN_PLACE, range, 2, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+            stats.min = -range[0];
+            stats.max = range[1];
+            timerStop(timers, PHASE_COMM, c);
+
+            timerStart(timers, PHASE_CONV);
+            out = convPlanar(sharedOut[0] + (long)rowBegin*width, sharedOut[1] ? sharedOut[1] + (long)rowBegin*width : NULL,
+                             sharedOut[2] ? sharedOut[2] + (long)rowBegin*width : NULL, width, rowEnd-rowBegin, width);
+            if (rowEnd > rowBegin && convRescale(&out, &stats, msg[8])) {
+                MPI_Abort(MPI_COMM_WORLD, -1);
             }
+            timerStop(timers, PHASE_CONV, c);
+        }
 
-            //////////////////////////////////////////////////////////////////////////////////////////////////
-            // CHUNK CONVOLUTION - MASTER
-            //////////////////////////////////////////////////////////////////////////////////////////////////
-            /*
-                Master get an extra job (remaining job)
-            */
-            // printf("Master : Convolution\n");
-            gettimeofday(&tim, NULL);
-            start = tim.tv_sec+(tim.tv_usec/1000000.0);
-            
-            convolve2D(source->R, output->R, source->ancho, (source->altura/(size*partitions))+ rem_job +halosize, kern->vkern, kern->kernelX, kern->kernelY);
-            convolve2D(source->G, output->G, source->ancho, (source->altura/(size*partitions))+ rem_job +halosize, kern->vkern, kern->kernelX, kern->kernelY);
-            convolve2D(source->B, output->B, source->ancho, (source->altura/(size*partitions))+ rem_job +halosize, kern->vkern, kern->kernelX, kern->kernelY);
-            
-            gettimeofday(&tim, NULL);
-            tconv = tconv + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
-            // printf("Master : Convolution Done\n");
-            // // Reset Pointer
-            // ptrR = output->R + pixel + rem_job * source->ancho;
-            // ptrG = output->G + pixel + rem_job * source->ancho; 
-            // ptrB = output->B + pixel + rem_job * source->ancho; 
-            // printf("ptrR = %x   | ptrG = %x   | ptrB = %x \n", output->R, output->G, output->B );
-            
-            //////////////////////////////////////////////////////////////////////////////
-            // Receive result from slaves
-            //////////////////////////////////////////////////////////////////////////////
-            // printf("Master : Receiving result\n");
-            output->R += rem_job*source->ancho;
-            output->G += rem_job*source->ancho;
-            output->B += rem_job*source->ancho;
-
-            for (i=1;i<size;i++){     
-                MPI_Recv(output->R + i*pixel, pixel, MPI_INT, i, 1, MPI_COMM_WORLD, &status);
-                MPI_Recv(output->G + i*pixel, pixel, MPI_INT, i, 2, MPI_COMM_WORLD, &status);
-                MPI_Recv(output->B + i*pixel, pixel, MPI_INT, i, 3, MPI_COMM_WORLD, &status);
+        timerStart(timers, PHASE_COMM);
+        MPI_Win_fence(0, win);
+
+        //////////////////////////////////////////////////////////////////////////////
+        // Result of the other nodes
+        //////////////////////////////////////////////////////////////////////////////
+        if (rank==0) {
+            for (i=1, first=nodeSizes[0]; i<nodes; first+=nodeSizes[i], i++) {
+                lo = (int)((long)rows*first/size);
+                hi = (int)((long)rows*(first+nodeSizes[i])/size);
+                for (j=0; j<channels; j++)
+                    MPI_Recv(sharedOut[j] + (long)lo*width, (hi-lo)*width, MPI_INT, i, j+1, leaders, &status);
             }
+        }
+        else if (nodeRank==0) {
+            for (j=0; j<channels; j++)
+                MPI_Send(sharedOut[j] + (long)nodeBegin*width, (nodeEnd-nodeBegin)*width, MPI_INT, 0, j+1, leaders);
+        }
+        timerStop(timers, PHASE_COMM, c);
 
+        if (rank==0) {
             //////////////////////////////////////////////////////////////////////////////////////////////////
             // CHUNK SAVING
             //////////////////////////////////////////////////////////////////////////////////////////////////
-
-            // printf("Partsize : %d\n ", partsize);
-            // printf("Chunksize : %d\n ", chunksize);
-            // printf("Partsize : %d\n ", pixel);
-            // printf("Offset : %d\n ", offset);
-            // printf("Master : Chunk saving\n");
             //Storing resulting image partition.
-            gettimeofday(&tim, NULL);
-            start = tim.tv_sec+(tim.tv_usec/1000000.0);
+            timerStart(timers, PHASE_STORE);
             if (savingChunk(output, &fpdst, partsize, offset)) {
                 perror("Error: ");
-                //        free(source);
-                //        free(output);
-                return -1;
+                MPI_Abort(MPI_COMM_WORLD, -1);
             }
-            gettimeofday(&tim, NULL);
-            tstore = tstore + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
-            //Next partition
-            c++;
+            timerStop(timers, PHASE_STORE, c);
         }
+    }
 
+    if (rank==0){ // Master
+        timers->bytesWritten = ftell(fpdst);
         fclose(fpsrc);
         fclose(fpdst);
 
-        gettimeofday(&tim, NULL);
-        tend = tim.tv_sec+(tim.tv_usec/1000000.0);
+        packTimers(timers, rec);
         printf("\nMaster:\n");
         printf("Imatge: %s\n", argv[1]);
         printf("ISizeX : %d\n", source->ancho);
         printf("ISizeY : %d\n", source->altura);
         printf("kSizeX : %d\n", kern->kernelX);
         printf("kSizeY : %d\n", kern->kernelY);
-        printf("%.6lf seconds elapsed for Reading image file.\n", tread);
-        printf("%.6lf seconds elapsed for copying image structure.\n", tcopy);
-        printf("%.6lf seconds elapsed for Reading kernel matrix.\n", treadk);
-        printf("%.6lf seconds elapsed for make the convolution.\n", tconv);
-        printf("%.6lf seconds elapsed for writing the resulting image.\n", tstore);
-        printf("%.6lf seconds elapsed\n", tend-tstart);
-        
-        // freeImagestructure(&source);
-        // freeImagestructure(&output);
-
-        free(source->R);    free(source->G);    free(source->B);
-        free(output->R);    free(output->G);    free(output->B);
-    
+        printf("Nodes  : %d\n", nodes);
+        if (normalize) printf("Range  : %d..%d normalized to 0..%d\n", stats.min, stats.max, output->maxcolor);
+        printf("%.6lf seconds elapsed for Reading image file.\n", timers->total[PHASE_READ]);
+        printf("%.6lf seconds elapsed for copying image structure.\n", timers->total[PHASE_COPY]);
+        printf("%.6lf seconds elapsed for Reading kernel matrix.\n", timers->total[PHASE_KERNEL]);
+        printf("%.6lf seconds elapsed for make the convolution.\n", timers->total[PHASE_CONV]);
+        printf("%.6lf seconds elapsed for writing the resulting image.\n", timers->total[PHASE_STORE]);
+        printf("%.6lf seconds elapsed for the communication.\n", timers->total[PHASE_COMM]);
+        printf("%.6lf seconds elapsed\n", timers->elapsed);
+        arenaReport(arena, stdout);
     } else{ // Slaves
+        printf("slave (%d) : %.6lf seconds elapsed for make the convolution.\n", rank, timers->total[PHASE_CONV]);
+        packTimers(timers, rec);
+    }
 
-        // Receive message broadcast from Master
-        
-        MPI_Bcast(msg, 5, MPI_INT, 0, MPI_COMM_WORLD);
-        width      = msg[0];
-        height     = msg[1];
-        halosize   = msg[2];
-        pixel      = msg[3];
-        partitions = msg[4];
-        
-        // DEBUG
-        // printf("Width           : %d\n", width);
-        // printf("Height          : %d\n", height);
-        // printf("Halosize        : %d\n", halosize);
-        // printf("Number of pixel : %d\n", pixel);
-        
-        // printf("Slave(%d) : Alocating Memory\n", rank);
-        // Alocating Memory - convolution input 
-        partImgIn =(ImagenData) malloc(sizeof(struct imagenppm));
-        partImgIn->R=calloc(pixel,sizeof(int)); 
-        partImgIn->G=calloc(pixel,sizeof(int)); 
-        partImgIn->B=calloc(pixel,sizeof(int)); 
-
-        // Alocating Memory - convolution output
-        partImgOut =(ImagenData) malloc(sizeof(struct imagenppm));
-        partImgOut->R=calloc(pixel,sizeof(int)); 
-        partImgOut->G=calloc(pixel,sizeof(int)); 
-        partImgOut->B=calloc(pixel,sizeof(int)); 
-        
-        // printf("Slave(%d) : Receiving Chunk Image\n", rank);
-        // Receiving Chunk Image From Master
-        MPI_Recv(partImgIn->R, pixel, MPI_INT, 0, 1, MPI_COMM_WORLD, &status);
-        MPI_Recv(partImgIn->G, pixel, MPI_INT, 0, 2, MPI_COMM_WORLD, &status);
-        MPI_Recv(partImgIn->B, pixel, MPI_INT, 0, 3, MPI_COMM_WORLD, &status);
-
-        // DEBUG : print receiving image                
-        // for (j = 0; j<50;j++){
-        //     printf("proc(%d) : partImgIn[%d] = %d \n",rank, j, partImgIn->R[j]);
-        //     if ((j+1)%20==0) printf("\n");
-        // }
-
-        //////////////////////////////////////////////////////////////////////////////////////////////////
-        // CHUNK CONVOLUTION - SLAVE
-        //////////////////////////////////////////////////////////////////////////////////////////////////
-        // printf("Slave(%d) : Convolution\n", rank);
-        gettimeofday(&tim, NULL);
-        start = tim.tv_sec+(tim.tv_usec/1000000.0);
-
-        convolve2D(partImgIn->R, partImgOut->R, width, (height/(size*partitions))+halosize, kern->vkern, kern->kernelX, kern->kernelY);
-        convolve2D(partImgIn->G, partImgOut->G, width, (height/(size*partitions))+halosize, kern->vkern, kern->kernelX, kern->kernelY);
-        convolve2D(partImgIn->B, partImgOut->B, width, (height/(size*partitions))+halosize, kern->vkern, kern->kernelX, kern->kernelY);
-        
-        gettimeofday(&tim, NULL);
-        tconv = tconv + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
-        // printf("Slave(%d) : Convolution Done\n", rank);
-        // DEBUG : print result image                
-        // for (j = 0; j<50;j++){
-        //     printf("proc(%d) : partImgOut[%d] = %d \n",rank, j, partImgOut->R[j]);
-        //     if ((j+1)%20==0) printf("\n");
-        // }
-        // printf("Slave(%d) : Sending Result\n", rank);
-        // // Sending chunk of Image
-        MPI_Send(partImgOut->R, pixel, MPI_INT, 0, 1, MPI_COMM_WORLD);
-        MPI_Send(partImgOut->G, pixel, MPI_INT, 0, 2, MPI_COMM_WORLD);
-        MPI_Send(partImgOut->B, pixel, MPI_INT, 0, 3, MPI_COMM_WORLD);
-
-        // freeImagestructure(&partImgIn);
-        // freeImagestructure(&partImgOut);
-
-        free(partImgOut->R);    free(partImgOut->G);    free(partImgOut->B);
-        free(partImgIn->R);     free(partImgIn->G);     free(partImgIn->B);
-
-
-        printf("slave (%d) : %.6lf seconds elapsed for make the convolution.\n", rank, tconv);
+    // Timings of every rank, reported by the master
+    if (rank==0 && (recs = (double *)malloc(size*RANK_FIELDS*sizeof(double))) == NULL) {
+        perror("Error: ");
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    MPI_Gather(rec, RANK_FIELDS, MPI_DOUBLE, recs, RANK_FIELDS, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    if (rank==0 && timings && writeTimings(timings, timers, recs, size, "mpiconvolution", argv[1], source->ancho, source->altura, &plan->kern, partitions)) {
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    if (rank==0) {
+        freeImagestructure(&source);
+        freeImagestructure(&output);
     }
+    free(recs);
+    free(kbuf);
+    free(nodeSizes);
+    convPlanDestroy(plan);
+    freeKernel(kern);
+    arenaDestroy(arena);
+    MPI_Win_free(&win);
+    if (nodeRank==0) MPI_Comm_free(&leaders);
+    MPI_Comm_free(&node);
     
     MPI_Finalize();
     return 0;
 }
 
-// mpicc percobaan1.c
+// mpicc -O2 mpiconvolution.c "../HPC - Convolution Library/libconvolve.c" -o mpiconvolution -lpthread -lm
 // mpiexec -n 4 ./a.out "raw file/im01.ppm" "raw file/kernel3x3_Edge.txt" cekibray.ppm 1
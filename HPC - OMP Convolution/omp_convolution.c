@@ -9,6 +9,8 @@
 // The program accepts an PPM image file, a text definition of the kernel matrix and the PPM file for storing the convolution results.
 // The program allows to define image partitions for processing large images (>500MB)
 // The 2D image is represented by 1D vector for chanel R, G and B. The convolution is applied to each chanel separately.
+// The image I/O, the kernel and the convolution engines are in the convolution library (../HPC - Convolution Library);
+// the convolution runs on its thread pool with OMP_NUM_THREADS threads.
 
 #include <stdio.h>
 #include <string.h>
@@ -18,291 +20,7 @@
 #include <sys/time.h>
 #include <time.h>
 #include <omp.h>
-
-// Structure to store image.
-struct imagenppm{
-    int altura;
-    int ancho;
-    char *comentario;
-    int maxcolor;
-    int P;
-    int *R;
-    int *G;
-    int *B;
-};
-typedef struct imagenppm* ImagenData;
-
-// Structure to store the kernel.
-struct structkernel{
-    int kernelX;
-    int kernelY;
-    float *vkern;
-};
-typedef struct structkernel* kernelData;
-
-//Functions Definition
-ImagenData initimage(char* nombre, FILE **fp, int partitions, int halo);
-ImagenData duplicateImageData(ImagenData src, int partitions, int halo);
-
-int readImage(ImagenData Img, FILE **fp, int dim, int halosize, long int *position);
-int duplicateImageChunk(ImagenData src, ImagenData dst, int dim);
-int initfilestore(ImagenData img, FILE **fp, char* nombre, long *position);
-int savingChunk(ImagenData img, FILE **fp, int dim, int offset);
-int convolve2D(int* inbuf, int* outbuf, int sizeX, int sizeY, float* kernel, int ksizeX, int ksizeY);
-void freeImagestructure(ImagenData *src);
-
-//Open Image file and image struct initialization
-ImagenData initimage(char* nombre, FILE **fp,int partitions, int halo){
-    char c;
-    char comentario[300];
-    int i=0,chunk=0;
-    ImagenData img=NULL;
-    
-    /*Opening ppm*/
-
-    if ((*fp=fopen(nombre,"r"))==NULL){
-        perror("Error: ");
-    }
-    else{
-        //Memory allocation
-        img=(ImagenData) malloc(sizeof(struct imagenppm));
-
-        //Reading the first line: Magical Number "P3"
-        fscanf(*fp,"%c%d ",&c,&(img->P));
-        
-        //Reading the image comment
-        while((c=fgetc(*fp))!= '\n'){comentario[i]=c;i++;}
-        comentario[i]='\0';
-        //Allocating information for the image comment
-        img->comentario = calloc(strlen(comentario),sizeof(char));
-        strcpy(img->comentario,comentario);
-        //Reading image dimensions and color resolution
-        fscanf(*fp,"%d %d %d",&img->ancho,&img->altura,&img->maxcolor);
-        chunk = img->ancho*img->altura / partitions;
-        //We need to read an extra row.
-        chunk = chunk + img->ancho * halo;
-        if ((img->R=calloc(chunk,sizeof(int))) == NULL) {return NULL;}
-        if ((img->G=calloc(chunk,sizeof(int))) == NULL) {return NULL;}
-        if ((img->B=calloc(chunk,sizeof(int))) == NULL) {return NULL;}
-    }
-    return img;
-}
-
-//Duplicate the Image struct for the resulting image
-ImagenData duplicateImageData(ImagenData src, int partitions, int halo){
-    char c;
-    char comentario[300];
-    unsigned int imageX, imageY;
-    int i=0, chunk=0;
-    //Struct memory allocation
-    ImagenData dst=(ImagenData) malloc(sizeof(struct imagenppm));
-
-    //Copying the magic number
-    dst->P=src->P;
-    //Copying the string comment
-    dst->comentario = calloc(strlen(src->comentario),sizeof(char));
-    strcpy(dst->comentario,src->comentario);
-    //Copying image dimensions and color resolution
-    dst->ancho=src->ancho;
-    dst->altura=src->altura;
-    dst->maxcolor=src->maxcolor;
-    chunk = dst->ancho*dst->altura / partitions;
-    //We need to read an extra row.
-    chunk = chunk + src->ancho * halo;
-    if ((dst->R=calloc(chunk,sizeof(int))) == NULL) {return NULL;}
-    if ((dst->G=calloc(chunk,sizeof(int))) == NULL) {return NULL;}
-    if ((dst->B=calloc(chunk,sizeof(int))) == NULL) {return NULL;}
-    return dst;
-}
-
-//Read the corresponding chunk from the source Image
-int readImage(ImagenData img, FILE **fp, int dim, int halosize, long *position){
-    int i=0, k=0,haloposition=0;
-    if (fseek(*fp,*position,SEEK_SET))
-        perror("Error: ");
-    haloposition = dim-(img->ancho*halosize*2);
-    for(i=0;i<dim;i++) {
-        // When start reading the halo store the position in the image file
-        if (halosize != 0 && i == haloposition) *position=ftell(*fp);
-        fscanf(*fp,"%d %d %d ",&img->R[i],&img->G[i],&img->B[i]);
-        k++;
-    }
-//    printf ("Readed = %d pixels, posicio=%lu\n",k,*position);
-    return 0;
-}
-
-//Duplication of the  just readed source chunk to the destiny image struct chunk
-int duplicateImageChunk(ImagenData src, ImagenData dst, int dim){
-    int i=0;
-    
-    for(i=0;i<dim;i++){
-        dst->R[i] = src->R[i];
-        dst->G[i] = src->G[i];
-        dst->B[i] = src->B[i];
-    }
-//    printf ("Duplicated = %d pixels\n",i);
-    return 0;
-}
-
-// Open kernel file and reading kernel matrix. The kernel matrix 2D is stored in 1D format.
-kernelData leerKernel(char* nombre){
-    FILE *fp;
-    int i=0;
-    kernelData kern=NULL;
-    
-    /*Opening the kernel file*/
-    fp=fopen(nombre,"r");
-    if(!fp){
-        perror("Error: ");
-    }
-    else{
-        //Memory allocation
-        kern=(kernelData) malloc(sizeof(struct structkernel));
-        
-        //Reading kernel matrix dimensions
-        fscanf(fp,"%d,%d,", &kern->kernelX, &kern->kernelY);
-        kern->vkern = (float *)malloc(kern->kernelX*kern->kernelY*sizeof(float));
-        
-        // Reading kernel matrix values
-        for (i=0;i<(kern->kernelX*kern->kernelY)-1;i++){
-            fscanf(fp,"%f,",&kern->vkern[i]);
-        }
-        fscanf(fp,"%f",&kern->vkern[i]);
-        fclose(fp);
-    }
-    return kern;
-}
-
-// Open the image file with the convolution results
-int initfilestore(ImagenData img, FILE **fp, char* nombre, long *position){
-    /*Se crea el fichero con la imagen resultante*/
-    if ( (*fp=fopen(nombre,"w")) == NULL ){
-        perror("Error: ");
-        return -1;
-    }
-    /*Writing Image Header*/
-    fprintf(*fp,"P%d\n%s\n%d %d\n%d\n",img->P,img->comentario,img->ancho,img->altura,img->maxcolor);
-    *position = ftell(*fp);
-    return 0;
-}
-
-// Writing the image partition to the resulting file. dim is the exact size to write. offset is the displacement for avoid halos.
-int savingChunk(ImagenData img, FILE **fp, int dim, int offset){
-    int i,k=0;
-    //Writing image partition
-    for(i=offset;i<dim+offset;i++){
-        fprintf(*fp,"%d %d %d ",img->R[i],img->G[i],img->B[i]);
-//        if ((i+1)%6==0) fprintf(*fp,"\n");
-        k++;
-    }
-//    printf ("Writed = %d pixels, dim=%d, offset=%d\n",k,dim, offset);
-    return 0;
-}
-
-// This function free the space allocated for the image structure.
-void freeImagestructure(ImagenData *src){
-    
-    free((*src)->comentario);
-    free((*src)->R);
-    free((*src)->G);
-    free((*src)->B);
-    
-    free(*src);
-}
-
-///////////////////////////////////////////////////////////////////////////////
-// 2D convolution
-// 2D data are usually stored in computer memory as contiguous 1D array.
-// So, we are using 1D array for 2D data.
-// 2D convolution assumes the kernel is center originated, which means, if
-// kernel size 3 then, k[-1], k[0], k[1]. The middle of index is always 0.
-// The following programming logics are somewhat complicated because of using
-// pointer indexing in order to minimize the number of multiplications.
-//
-//
-// signed integer (32bit) version:
-///////////////////////////////////////////////////////////////////////////////
-// convolve2D(source->R, output->R, source->ancho, (source->altura/partitions)+halosize, kern->vkern, kern->kernelX, kern->kernelY);
-int convolve2D(int* in, int* out, int dataSizeX, int dataSizeY,
-               float* kernel, int kernelSizeX, int kernelSizeY)
-{
-    int i, j, m, n;
-    int *inPtr, *inPtr2, *outPtr;
-    float *kPtr;
-    int kCenterX, kCenterY;
-    int rowMin, rowMax;                             // to check boundary of input array
-    int colMin, colMax;                             //
-    float sum;                                      // temp accumulation buffer
-    
-    // check validity of params
-    if(!in || !out || !kernel) return -1;
-    if(dataSizeX <= 0 || kernelSizeX <= 0) return -1;
-    
-    // find center position of kernel (half of kernel size)
-    kCenterX = (int)kernelSizeX / 2;
-    kCenterY = (int)kernelSizeY / 2;
-    
-    // init working  pointers
-    inPtr = inPtr2 = &in[dataSizeX * kCenterY + kCenterX];  // note that  it is shifted (kCenterX, kCenterY),
-    outPtr = out;
-    kPtr = kernel;
-    
-    // start convolution
-
-    #pragma omp parallel for schedule(dynamic,10) private (i, j, m, n, rowMax, rowMin, colMax, colMin)
-    for(i= 0; i < dataSizeY; ++i)                   // number of rows
-    {
-        // compute the range of convolution, the current row of kernel should be between these
-        rowMax = i + kCenterY;
-        rowMin = i - dataSizeY + kCenterY;
-
-        for(j = 0; j < dataSizeX; ++j)              // number of columns
-        {
-            // compute the range of convolution, the current column of kernel should be between these
-            colMax = j + kCenterX;
-            colMin = j - dataSizeX + kCenterX;
-            
-            sum = 0;                                // set to 0 before accumulate
-            
-            // flip the kernel and traverse all the kernel values
-            // multiply each kernel value with underlying input data
-            
-            for(m = 0; m < kernelSizeY; ++m)        // kernel rows
-            {
-                // check if the index is out of bound of input array
-                if(m <= rowMax && m > rowMin)
-                {
-                    for(n = 0; n < kernelSizeX; ++n)
-                    {
-                        // check the boundary of array
-                        if(n <= colMax && n > colMin)
-                            sum += *(inPtr - n) * *kPtr;
-                        
-                        ++kPtr;                     // next kernel
-                    }
-                }
-                else
-                    kPtr += kernelSizeX;            // out of bound, move to next row of kernel
-                
-                inPtr -= dataSizeX;                 // move input data 1 raw up
-            }
-            
-            // convert integer number
-            if(sum >= 0) *outPtr = (int)(sum + 0.5f);
-//            else *outPtr = (int)(sum - 0.5f)*(-1);
-            // For using with image editors like GIMP or others...
-            else *outPtr = (int)(sum - 0.5f);
-            // For using with a text editor that read ppm images like libreoffice or others...
-//            else *outPtr = 0;
-            
-            kPtr = kernel;                          // reset kernel to (0,0)
-            inPtr = ++inPtr2;                       // next input
-            ++outPtr;                               // next output
-        }
-    }
-    
-    return 0;
-}
+#include "../HPC - Convolution Library/libconvolve.h"
 
 
 //////////////////////////////////////////////////////////////////////////////////////////////////
@@ -311,18 +29,76 @@ int convolve2D(int* in, int* out, int dataSizeX, int dataSizeY,
 int main(int argc, char **argv)
 {
     int i=0,j=0,k=0;
+    int explain=0;
+    char *timings=NULL;
+    int counters=0;
+    int luma=0;
+    int roi=0, roiX=0, roiY=0, roiW=0, roiH=0;
+    int stride=1;
+    int boundary=-1;
+    int frames=0;
+    int useArena=1;
+    int normalize=0;
+    int iterations=1;
+    convStats stats;
 //    int headstored=0, imagestored=0, stored;
     
-    if(argc != 5)
+    // Options after the positional arguments
+    for(i=5;i<argc;i++){
+        if (strcmp(argv[i],"--explain")==0) explain=1;
+        else if (strcmp(argv[i],"--timings")==0 && i+1<argc) timings=argv[++i];
+        else if (strcmp(argv[i],"--counters")==0) counters=1;
+        else if (strcmp(argv[i],"--luma")==0) luma=1;
+        else if (strcmp(argv[i],"--no-arena")==0) useArena=0;
+        else if (strcmp(argv[i],"--normalize")==0) normalize=1;
+        else if (strcmp(argv[i],"--iterations")==0 && i+1<argc && (iterations=atoi(argv[++i]))>0);
+        else if (strcmp(argv[i],"--boundary")==0 && i+1<argc) {
+            for(boundary=CONV_BOUNDARIES-1; boundary>=0 && strcmp(argv[i+1],boundaryNames[boundary])!=0; boundary--);
+            if (boundary<0) break;
+            i++;
+        }
+        else if (strcmp(argv[i],"--roi")==0 && i+1<argc &&
+                 sscanf(argv[++i],"%d,%d,%d,%d",&roiX,&roiY,&roiW,&roiH)==4 && roiW>0 && roiH>0) roi=1;
+        else if (strcmp(argv[i],"--sequence")==0 && i+1<argc && (frames=atoi(argv[++i]))>0);
+        else if (strcmp(argv[i],"--stride")==0 && i+1<argc && (stride=atoi(argv[++i]))>0);
+        else break;
+    }
+    if(argc < 5 || i != argc || (roi && stride>1) || (frames && (roi || stride>1 || boundary>=0)) || (normalize && (roi || frames)) ||
+       (iterations>1 && (roi || frames || stride>1 || boundary>=0 || normalize)))
     {
-        printf("Usage: %s <image-file> <kernel-file> <result-file> <partitions>\n", argv[0]);
+        printf("Usage: %s <image-file> <kernel-file> <result-file> <partitions> [--explain] [--timings file] [--counters] [--luma] [--roi x,y,w,h] [--stride s]\n       [--boundary zero|clamp|mirror|wrap] [--sequence frames] [--no-arena] [--normalize] [--iterations n]\n", argv[0]);
         
         printf("\n\nError, Missing parameters:\n");
         printf("format: ./serialconvolution image_file kernel_file result_file\n");
-        printf("- image_file : source image path (*.ppm)\n");
+        printf("- image_file : source image path (*.ppm, *.pgm, may be .gz or .zst compressed)\n");
         printf("- kernel_file: kernel path (text file with 1D kernel matrix)\n");
-        printf("- result_file: result image path (*.ppm)\n");
-        printf("- partitions : Image partitions\n\n");
+        printf("- result_file: result image path (*.ppm, *.pgm, compressed when it ends in .gz or .zst)\n");
+        printf("- partitions : Image partitions\n");
+        printf("- --explain  : print the convolution plan\n");
+        printf("- --timings  : write the phase timings as JSON to file\n");
+        printf("- --counters : add hardware counters (perf_event_open) to the timings\n");
+        printf("- --luma     : convolve the luma of color images, the result is a P2 image\n");
+        printf("- --roi      : convolve only the w x h region at (x,y), the result has its size\n");
+        printf("- --stride   : keep one pixel out of s x s, the result is s times smaller (not with --roi,\n");
+        printf("               the height must be a multiple of the partitions)\n");
+        printf("- --boundary : pixels read by the kernel outside the image (default: zero, without ghost border)\n");
+        printf("- --sequence : convolve frames 0..frames-1, image_file and result_file are printf patterns (frame%%04d.ppm);\n");
+        printf("               only the tiles that changed since the previous frame are convolved again\n");
+        printf("- --no-arena : allocate the planes with malloc instead of carving them from an arena on huge pages\n");
+        printf("               (its size is CONVOLUTION_ARENA_MB, by default it reserves address space as needed)\n");
+        printf("- --normalize: rescale the range of the result to 0..maxcolor, in 1 partition (not with --roi or --sequence)\n");
+        printf("- --iterations: apply the kernel n times, every time to the previous result (only with the zero boundary,\n");
+        printf("               not with --roi, --stride, --sequence or --normalize)\n\n");
+        return -1;
+    }
+    // The ghost border of a chunk only sees its own rows, the rows wrapped around are in another one
+    if (boundary==CONV_BOUNDARY_WRAP && atoi(argv[4])>1) {
+        printf("Error: --boundary wrap needs the whole image in 1 partition\n");
+        return -1;
+    }
+    // The range is known once every row is convolved, the first partitions would be stored already
+    if (normalize && atoi(argv[4])>1) {
+        printf("Error: --normalize needs the whole image in 1 partition\n");
         return -1;
     }
     
@@ -330,19 +106,31 @@ int main(int argc, char **argv)
     // READING IMAGE HEADERS, KERNEL Matrix, DUPLICATE IMAGE DATA, OPEN RESULTING IMAGE FILE
     //////////////////////////////////////////////////////////////////////////////////////////////////
     int imagesize, partitions, partsize, chunksize, halo, halosize;
-    long position=0;
-    double start, tstart=0, tend=0, tread=0, tcopy=0, tconv=0, tstore=0, treadk=0;
-    struct timeval tim;
+    long position=0, from=0;
+    double rec[RANK_FIELDS];
     FILE *fpsrc=NULL,*fpdst=NULL;
     ImagenData source=NULL, output=NULL;
+    timersData timers=NULL;
+    convPlan plan=NULL;
+    convImage in, out;
+    convArena arena=NULL;
 
     // Store number of partitions
     partitions = atoi(argv[4]);
+    if ( (timers = initTimers(partitions)) == NULL) {
+        perror("Error: ");
+        return -1;
+    }
+    timers->counters = counters;
+    // The planes and the work buffers of the run are carved from one arena, on huge pages when possible
+    if (useArena && (arena = arenaCreate(0)) == NULL) {
+        fprintf(stderr,"Warning: no arena, the planes are allocated with malloc\n");
+    }
+    arenaUse(arena);
+    timers->arena = arena;
     ////////////////////////////////////////
     //Reading kernel matrix
-    gettimeofday(&tim, NULL);
-    start = tim.tv_sec+(tim.tv_usec/1000000.0);
-    tstart = start;
+    timerStart(timers, PHASE_KERNEL);
     kernelData kern=NULL;
     if ( (kern = leerKernel(argv[2]))==NULL) {
         //        free(source);
@@ -351,55 +139,218 @@ int main(int argc, char **argv)
     }
     //The matrix kernel define the halo size to use with the image. The halo is zero when the image is not partitioned.
     if (partitions==1) halo=0;
-    else halo = (kern->kernelY/2)*2;
-    gettimeofday(&tim, NULL);
-    treadk = treadk + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
+    else halo = (kern->kernelY/2)*2*iterations; // every iteration reaches the kernel radius further
+    timerStop(timers, PHASE_KERNEL, 0);
+
+    if (frames) {
+        //////////////////////////////////////////////////////////////////////////////////////////////////
+        // FRAME SEQUENCE
+        // Every frame is read and stored whole, in one partition. The convolution keeps the previous
+        // frame and its result, and only convolves again the tiles around the pixels that changed.
+        //////////////////////////////////////////////////////////////////////////////////////////////////
+        char name[4096];
+        convSequence seq=NULL;
+        int frame, tiles=0, dirty=0;
+        double seconds;
+
+        for (frame=0; frame<frames; frame++) {
+            timerStart(timers, PHASE_READ);
+            snprintf(name, sizeof(name), argv[1], frame);
+            if ( (source = initimage(name, &fpsrc, 1, 0)) == NULL) {
+                return -1;
+            }
+            // Only the intensity is convolved
+            if (luma) lumaImage(source);
+            if (readImage(source, &fpsrc, source->ancho*source->altura, 0, &position)) {
+                return -1;
+            }
+            timers->bytesRead += ftell(fpsrc);
+            fclose(fpsrc);
+            timerStop(timers, PHASE_READ, 0);
+
+            timerStart(timers, PHASE_COPY);
+            if ( (output = duplicateImageData(source, 1, 0)) == NULL) {
+                return -1;
+            }
+            timerStop(timers, PHASE_COPY, 0);
+
+            // Planning (and autotuning) is not part of the convolution time
+            if (!plan) {
+                if ( (plan = convPlanCreate(kern, source->ancho, source->altura, omp_get_max_threads(), 1,
+                                            CONV_PLAN_MEASURE | (explain ? CONV_PLAN_EXPLAIN : 0))) == NULL ||
+                     (seq = convSequenceCreate(plan, 0)) == NULL) {
+                    perror("Error: ");
+                    return -1;
+                }
+                plan->timers = timers;
+            }
+            timerStart(timers, PHASE_CONV);
+            seconds = timerNow();
+            in  = convPlanar(source->R, source->G, source->B, source->ancho, source->altura, source->ancho);
+            out = convPlanar(output->R, output->G, output->B, source->ancho, source->altura, source->ancho);
+            if (convSequenceExecute(seq, &in, &out)) {
+                perror("Error: ");
+                return -1;
+            }
+            seconds = timerNow() - seconds;
+            timerStop(timers, PHASE_CONV, 0);
+            tiles += seq->tiles;
+            dirty += seq->dirtyTiles;
+
+            timerStart(timers, PHASE_STORE);
+            snprintf(name, sizeof(name), argv[3], frame);
+            if (initfilestore(output, &fpdst, name, &position)!=0 ||
+                savingChunk(output, &fpdst, source->ancho*source->altura, 0)) {
+                perror("Error: ");
+                return -1;
+            }
+            timers->bytesWritten += ftell(fpdst);
+            fclose(fpdst);
+            timerStop(timers, PHASE_STORE, 0);
+
+            printf("Frame %d: %d of %d tiles convolved, %.6lf seconds\n", frame, seq->dirtyTiles, seq->tiles, seconds);
+            freeImagestructure(&source);
+            freeImagestructure(&output);
+            // the planes of the next frame reuse the pages of this one
+            arenaReset(arena);
+        }
+
+        packTimers(timers, rec);
+        printf("%d frames, %d of %d tiles convolved\n", frames, dirty, tiles);
+        printf("%.6lf seconds elapsed for Reading the frames.\n", timers->total[PHASE_READ]);
+        printf("%.6lf seconds elapsed for make the convolution.\n", timers->total[PHASE_CONV]);
+        printf("%.6lf seconds elapsed for writing the resulting frames.\n", timers->total[PHASE_STORE]);
+        printf("%.6lf seconds elapsed\n", timers->elapsed);
+        arenaReport(arena, stdout);
+        if (timings && writeTimings(timings, timers, rec, 1, "omp_convolution", argv[1], plan->width, plan->height, &plan->kern, 1)) {
+            return -1;
+        }
+        convSequenceDestroy(seq);
+        convPlanDestroy(plan);
+        freeKernel(kern);
+        arenaDestroy(arena);
+        return 0;
+    }
+
+    if (roi) {
+        //////////////////////////////////////////////////////////////////////////////////////////////////
+        // REGION OF INTEREST
+        // Only the region and the kernel halo around it are read and convolved, in one partition.
+        //////////////////////////////////////////////////////////////////////////////////////////////////
+        timerStart(timers, PHASE_READ);
+        if ( (source = readImageRegion(argv[1], &roiX, &roiY, &roiW, &roiH, kern->kernelX/2, kern->kernelY/2, luma)) == NULL) {
+            return -1;
+        }
+        timerStop(timers, PHASE_READ, 0);
+
+        timerStart(timers, PHASE_COPY);
+        if ( (output = duplicateImageData(source, 1, 0)) == NULL) {
+            return -1;
+        }
+        timerStop(timers, PHASE_COPY, 0);
+
+        // Planning (and autotuning) is not part of the convolution time
+        if ( (plan = convPlanCreate(kern, source->ancho, source->altura, omp_get_max_threads(), 1,
+                                    CONV_PLAN_MEASURE | (explain ? CONV_PLAN_EXPLAIN : 0))) == NULL) {
+            perror("Error: ");
+            return -1;
+        }
+        if (boundary>=0) convPlanSetBoundary(plan, boundary);
+        plan->timers = timers;
+        timerStart(timers, PHASE_CONV);
+        in  = convPlanar(source->R, source->G, source->B, source->ancho, source->altura, source->ancho);
+        out = convPlanar(output->R, output->G, output->B, source->ancho, source->altura, source->ancho);
+        if (convExecute(plan, &in, &out)) {
+            perror("Error: ");
+            return -1;
+        }
+        timerStop(timers, PHASE_CONV, 0);
+
+        //Only the region is stored, without the halo
+        timerStart(timers, PHASE_STORE);
+        if (cropImage(output, roiX, roiY, roiW, roiH) || initfilestore(output, &fpdst, argv[3], &position)!=0 ||
+            savingChunk(output, &fpdst, roiW*roiH, 0)) {
+            perror("Error: ");
+            return -1;
+        }
+        timers->bytesWritten = ftell(fpdst);
+        fclose(fpdst);
+        timerStop(timers, PHASE_STORE, 0);
+
+        packTimers(timers, rec);
+        printf("Imatge: %s, region %dx%d\n", argv[1], roiW, roiH);
+        printf("%.6lf seconds elapsed for Reading the region.\n", timers->total[PHASE_READ]);
+        printf("%.6lf seconds elapsed for make the convolution.\n", timers->total[PHASE_CONV]);
+        printf("%.6lf seconds elapsed for writing the resulting image.\n", timers->total[PHASE_STORE]);
+        printf("%.6lf seconds elapsed\n", timers->elapsed);
+        arenaReport(arena, stdout);
+        if (timings && writeTimings(timings, timers, rec, 1, "omp_convolution", argv[1], roiW, roiH, &plan->kern, 1)) {
+            return -1;
+        }
+        freeImagestructure(&source);
+        freeImagestructure(&output);
+        convPlanDestroy(plan);
+        freeKernel(kern);
+        arenaDestroy(arena);
+        return 0;
+    }
 
     ////////////////////////////////////////
     //Reading Image Header. Image properties: Magical number, comment, size and color resolution.
-    gettimeofday(&tim, NULL);
-    start = tim.tv_sec+(tim.tv_usec/1000000.0);
+    timerStart(timers, PHASE_READ);
     //Memory allocation based on number of partitions and halo size.
     if ( (source = initimage(argv[1], &fpsrc, partitions, halo)) == NULL) {
         return -1;
     }
-    gettimeofday(&tim, NULL);
-    tread = tread + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
+    // The halo of a chunk can only come from its neighbours
+    if (halo/2 > source->altura/partitions) {
+        printf("Error: %d iterations reach beyond the neighbour partitions, use fewer partitions\n", iterations);
+        return -1;
+    }
+    // The partitions split the pixels: they start on a row, as the samples of --stride need, when the rows divide
+    if (stride>1 && source->altura % partitions) {
+        printf("Error: --stride needs a height divisible by the partitions (%d rows, %d partitions)\n", source->altura, partitions);
+        return -1;
+    }
+    // Only the intensity is convolved
+    if (luma) lumaImage(source);
+    timers->bytesRead += ftell(fpsrc);
+    timerStop(timers, PHASE_READ, 0);
     
     //Duplicate the image struct.
-    gettimeofday(&tim, NULL);
-    start = tim.tv_sec+(tim.tv_usec/1000000.0);
+    timerStart(timers, PHASE_COPY);
     if ( (output = duplicateImageData(source, partitions, halo)) == NULL) {
         return -1;
     }
-    gettimeofday(&tim, NULL);
-    tcopy = tcopy + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
+    //A decimated result keeps the samples (s*i, s*j) of the image, its planes fit in the ones of a chunk
+    output->ancho  = (source->ancho+stride-1)/stride;
+    output->altura = (source->altura+stride-1)/stride;
+    timerStop(timers, PHASE_COPY, 0);
     
     ////////////////////////////////////////
     //Initialize Image Storing file. Open the file and store the image header.
-    gettimeofday(&tim, NULL);
-    start = tim.tv_sec+(tim.tv_usec/1000000.0);
+    timerStart(timers, PHASE_STORE);
     if (initfilestore(output, &fpdst, argv[3], &position)!=0) {
         perror("Error: ");
         //        free(source);
         //        free(output);
         return -1;
     }
-    gettimeofday(&tim, NULL);
-    tstore = tstore + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
+    timerStop(timers, PHASE_STORE, 0);
 
     //////////////////////////////////////////////////////////////////////////////////////////////////
     // CHUNK READING
     //////////////////////////////////////////////////////////////////////////////////////////////////
     int c=0, offset=0;
+    int partrows, sampleBegin, sampleEnd;
     imagesize = source->altura*source->ancho;
     partsize  = (source->altura*source->ancho)/partitions;
+    partrows  = source->altura/partitions;
 //    printf("%s ocupa %dx%d=%d pixels. Partitions=%d, halo=%d, partsize=%d pixels\n", argv[1], source->altura, source->ancho, imagesize, partitions, halo, partsize);
     while (c < partitions) {
         ////////////////////////////////////////////////////////////////////////////////
         //Reading Next chunk.
-        gettimeofday(&tim, NULL);
-        start = tim.tv_sec+(tim.tv_usec/1000000.0);
+        timerStart(timers, PHASE_READ);
         if (c==0) {
             halosize  = halo/2;
             chunksize = partsize + (source->ancho*halosize);
@@ -418,101 +369,128 @@ int main(int argc, char **argv)
         //DEBUG
 //        printf("\nRound = %d, position = %ld, partsize= %d, chunksize=%d pixels\n", c, position, partsize, chunksize);
         
+        from = position;
         if (readImage(source, &fpsrc, chunksize, halo/2, &position)) {
             return -1;
         }
-        gettimeofday(&tim, NULL);
-        tread = tread + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
+        timers->bytesRead += ftell(fpsrc) - from;
+        timerStop(timers, PHASE_READ, c);
         
         //Duplicate the image chunk
-        gettimeofday(&tim, NULL);
-        start = tim.tv_sec+(tim.tv_usec/1000000.0);
-        if ( duplicateImageChunk(source, output, chunksize) ) {
+        timerStart(timers, PHASE_COPY);
+        if ( stride==1 && duplicateImageChunk(source, output, chunksize) ) {
             return -1;
         }
         //DEBUG
 //        for (i=0;i<chunksize;i++)
 //            if (source->R[i]!=output->R[i] || source->G[i]!=output->G[i] || source->B[i]!=output->B[i]) printf("At position i=%d %d!=%d,%d!=%d,%d!=%d\n",i,source->R[i],output->R[i], source->G[i],output->G[i],source->B[i],output->B[i]);
-        gettimeofday(&tim, NULL);
-        tcopy = tcopy + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
+        timerStop(timers, PHASE_COPY, c);
         
         //////////////////////////////////////////////////////////////////////////////////////////////////
         // CHUNK CONVOLUTION
         //////////////////////////////////////////////////////////////////////////////////////////////////
-        gettimeofday(&tim, NULL);
-        start = tim.tv_sec+(tim.tv_usec/1000000.0);
-
-        #pragma omp parallel num_threads(4)
-        {
-            #pragma omp sections nowait
-            {
-                #pragma omp section 
-                {
-                    convolve2D(source->R, output->R, source->ancho, (source->altura/partitions)+halosize, kern->vkern, kern->kernelX, kern->kernelY);
-                }
-                #pragma omp section 
-                {
-                    convolve2D(source->G, output->G, source->ancho, (source->altura/partitions)+halosize, kern->vkern, kern->kernelX, kern->kernelY);
-                }
-                #pragma omp section 
-                {
-                    convolve2D(source->B, output->B, source->ancho, (source->altura/partitions)+halosize, kern->vkern, kern->kernelX, kern->kernelY);
-                }               
+        // Choose the engine on the first partition, planning is not part of the convolution time
+        if (c==0) {
+            if ( (plan = convPlanCreate(kern, source->ancho, (source->altura/partitions)+halosize, omp_get_max_threads(), 1,
+                                        CONV_PLAN_MEASURE | (explain ? CONV_PLAN_EXPLAIN : 0))) == NULL) {
+                perror("Error: ");
+                return -1;
             }
-        }        
+            if (boundary>=0) convPlanSetBoundary(plan, boundary);
+            plan->timers = timers;
+            // The threads take the range of the result while it is in cache
+            if (normalize) {
+                convStatsReset(&stats);
+                plan->stats = &stats;
+            }
+        }
+        timerStart(timers, PHASE_CONV);
+
+        // Rows sampleBegin..sampleEnd-1 of a decimated result fall in this partition. The first one is
+        // convolved at the chunk row of its sample, after the upper halo.
+        sampleBegin = (c*partrows+stride-1)/stride;
+        sampleEnd   = ((c+1)*partrows+stride-1)/stride;
+        if (stride>1 && convPlanSetStride(plan, stride, sampleBegin*stride - c*partrows + (c>0 ? halo/2 : 0))) {
+            return -1;
+        }
+
+        // R, G and B planes of the chunk, split in bands of rows among the threads
+        in  = convPlanar(source->R, source->G, source->B, source->ancho, (source->altura/partitions)+halosize, source->ancho);
+        if (stride==1)
+            out = convPlanar(output->R, output->G, output->B, source->ancho, (source->altura/partitions)+halosize, source->ancho);
+        else
+            out = convPlanar(output->R, output->G, output->B, output->ancho, sampleEnd-sampleBegin, output->ancho);
+        if (out.height>0 && (iterations>1 ? convIterate(plan, &in, &out, iterations) : convExecute(plan, &in, &out))) {
+            perror("Error: ");
+            return -1;
+        }
+        if (normalize && convRescale(&out, &stats, output->maxcolor)) {
+            return -1;
+        }
         
         // convolve2D(source->R, output->R, source->ancho, (source->altura/partitions)+halosize, kern->vkern, kern->kernelX, kern->kernelY);
         // convolve2D(source->G, output->G, source->ancho, (source->altura/partitions)+halosize, kern->vkern, kern->kernelX, kern->kernelY);
         // convolve2D(source->B, output->B, source->ancho, (source->altura/partitions)+halosize, kern->vkern, kern->kernelX, kern->kernelY);
         
-        gettimeofday(&tim, NULL);
-        tconv = tconv + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
+        timerStop(timers, PHASE_CONV, c);
         
         //////////////////////////////////////////////////////////////////////////////////////////////////
         // CHUNK SAVING
         //////////////////////////////////////////////////////////////////////////////////////////////////
         //Storing resulting image partition.
-        gettimeofday(&tim, NULL);
-        start = tim.tv_sec+(tim.tv_usec/1000000.0);
-        if (savingChunk(output, &fpdst, partsize, offset)) {
+        timerStart(timers, PHASE_STORE);
+        if (stride>1 ? savingChunk(output, &fpdst, (sampleEnd-sampleBegin)*output->ancho, 0)
+                     : savingChunk(output, &fpdst, partsize, offset)) {
             perror("Error: ");
             //        free(source);
             //        free(output);
             return -1;
         }
-        gettimeofday(&tim, NULL);
-        tstore = tstore + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
+        timerStop(timers, PHASE_STORE, c);
         //Next partition
         c++;
     }
 
+    timers->bytesWritten = ftell(fpdst);
     fclose(fpsrc);
     fclose(fpdst);
     
 //    freeImagestructure(&source);
 //    freeImagestructure(&output);
     
-    gettimeofday(&tim, NULL);
-    tend = tim.tv_sec+(tim.tv_usec/1000000.0);
+    packTimers(timers, rec);
     
     printf("Imatge: %s\n", argv[1]);
     printf("ISizeX : %d\n", source->ancho);
     printf("ISizeY : %d\n", source->altura);
+    if (stride>1) printf("OSize  : %dx%d (stride %d)\n", output->ancho, output->altura, stride);
+    if (normalize) printf("Range  : %d..%d normalized to 0..%d\n", stats.min, stats.max, output->maxcolor);
+    if (iterations>1) printf("Iters  : %d\n", iterations);
     printf("kSizeX : %d\n", kern->kernelX);
     printf("kSizeY : %d\n", kern->kernelY);
-    printf("%.6lf seconds elapsed for Reading image file.\n", tread);
-    printf("%.6lf seconds elapsed for copying image structure.\n", tcopy);
-    printf("%.6lf seconds elapsed for Reading kernel matrix.\n", treadk);
-    printf("%.6lf seconds elapsed for make the convolution.\n", tconv);
-    printf("%.6lf seconds elapsed for writing the resulting image.\n", tstore);
-    printf("%.6lf seconds elapsed\n", tend-tstart);
+    printf("%.6lf seconds elapsed for Reading image file.\n", timers->total[PHASE_READ]);
+    printf("%.6lf seconds elapsed for copying image structure.\n", timers->total[PHASE_COPY]);
+    printf("%.6lf seconds elapsed for Reading kernel matrix.\n", timers->total[PHASE_KERNEL]);
+    printf("%.6lf seconds elapsed for make the convolution.\n", timers->total[PHASE_CONV]);
+    printf("%.6lf seconds elapsed for writing the resulting image.\n", timers->total[PHASE_STORE]);
+    printf("%.6lf seconds elapsed\n", timers->elapsed);
+    arenaReport(arena, stdout);
+    
+    if (timings && writeTimings(timings, timers, rec, 1, "omp_convolution", argv[1], source->ancho, source->altura, &plan->kern, partitions)) {
+        return -1;
+    }
     
     freeImagestructure(&source);
     freeImagestructure(&output);
+    convPlanDestroy(plan);
+    freeKernel(kern);
+    arenaDestroy(arena);
     
     return 0;
 }
 
+// gcc -O2 -fopenmp omp_convolution.c "../HPC - Convolution Library/libconvolve.c" -o omp_convolution -lpthread -lm
+
 // ./a.out im03.ppm '01. Edge.txt' cekibray.ppm 1
 // Imatge: im03.ppm
 // ISizeX : 800